@@ -1,42 +1,337 @@
 #include "args.h"
 
+#include <uv.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define MAX_LINE 4096
+#define DEFAULT_MAX_WORKERS 4
+
 const char* prog_name = NULL;
-const char* repo_path = ".";
+char** repo_paths = NULL;
+int repo_count = 0;
 int timeout = 30; // s
+int psi_threshold = 0; // %, 0 means the pressure governor is disabled
+int psi_max_defer = 60; // s
+int cpu_priority = CPU_PRIORITY_NORMAL; // nice level or CPU_PRIORITY_IDLE
+bool io_idle = false;
+const char* control_path = NULL;
+const char* metrics_address = NULL;
+bool log_json = false;
+const char* trace_path = NULL;
+const char* record_path = NULL;
+int mem_budget = 0; // MB, 0 means libgit2 defaults
+int workers = 0; // 0 means one per CPU, up to DEFAULT_MAX_WORKERS
+bool warm_start = false;
+int poll_interval = 0; // ms, 0 means the watcher of the platform is used
+int cold_after = 0; // s, 0 means directories are never demoted
+bool retention = false;
+bool retention_branch = false; // the checked out branch may be rewritten
+bool private_ref = false; // commits go to refs/gwatch/<branch>
+bool snapshot = false;
 
 void print_usage()
 {
-    printf("Usage: %s [-r path/to/git/repo] [-t timeout_in_s]\n", prog_name);
+    printf("Usage: %s [-r path/to/git/repo]... [-f path/to/repo/list] "
+           "[-t timeout_in_s]\n"
+           "    [--psi-threshold pressure_in_percent] "
+           "[--psi-max-defer max_deferral_in_s]\n"
+           "    [--cpu-priority normal|idle|nice_level] "
+           "[--io-priority normal|idle]\n"
+           "    [--control path/to/control/socket] "
+           "[--workers commit_thread_count]\n"
+           "    [--mem-budget memory_in_MB] [--warm-start on|off]\n"
+           "    [--metrics port|path/to/metrics/socket] "
+           "[--log-format text|json]\n"
+           "    [--trace path/to/trace.json] "
+           "[--record path/to/recording]\n"
+           "    [--poll off|interval_in_ms] [--cold-after off|idle_time_in_s]\n"
+           "    [--retention off|on|branch] [--private off|on] [--snapshot off|on]\n",
+           prog_name);
+}
+
+bool parse_bounded(const char* value, long int min, long int max, int* out)
+{
+    char* end = NULL;
+    long int v = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || v < min || v > max)
+        return false;
+
+    *out = (int)v;
+    return true;
+}
+
+void add_repo_path(const char* path)
+{
+    size_t len = strlen(path);
+    char* copy = malloc(len + 1);
+    memcpy(copy, path, len + 1);
+
+    repo_paths = realloc(repo_paths, (size_t)(repo_count + 1) * sizeof(char*));
+    repo_paths[repo_count++] = copy;
+}
+
+bool read_repo_list(const char* list_path)
+{
+    FILE* f = fopen(list_path, "r");
+    if (!f)
+    {
+        printf("Cannot open the repository list %s\n", list_path);
+        return false;
+    }
+
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), f))
+    {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+
+        // empty lines and comments are skipped
+        if (len > 0 && line[0] != '#')
+            add_repo_path(line);
+    }
+
+    fclose(f);
+    return true;
 }
 
 bool parse_pair(char* argv[], int offset)
 {
     static bool timeout_set = false;
-    static bool repo_set = false;
+    static bool psi_threshold_set = false;
+    static bool psi_max_defer_set = false;
+    static bool cpu_priority_set = false;
+    static bool io_priority_set = false;
+    static bool control_set = false;
+    static bool workers_set = false;
+    static bool mem_budget_set = false;
+    static bool warm_start_set = false;
+    static bool metrics_set = false;
+    static bool log_format_set = false;
+    static bool trace_set = false;
+    static bool record_set = false;
+    static bool poll_set = false;
+    static bool cold_after_set = false;
+    static bool retention_set = false;
+    static bool private_set = false;
+    static bool snapshot_set = false;
 
-    if (!repo_set && strcmp(argv[offset], "-r") == 0)
+    if (strcmp(argv[offset], "-r") == 0)
     {
-        repo_path = argv[offset+1];
-        repo_set = true;
+        add_repo_path(argv[offset+1]);
         return true;
     }
+    else if (strcmp(argv[offset], "-f") == 0)
+    {
+        return read_repo_list(argv[offset+1]);
+    }
     else if (!timeout_set && strcmp(argv[offset], "-t") == 0)
     {
-        long int t = strtol(argv[offset+1], NULL, 10);
-        if (t >= 1 && t <= 100000)
+        if (!parse_bounded(argv[offset+1], 1, 100000, &timeout))
+        {
+            printf("Timeout value must be between 1s and 100000s\n");
+            return false;
+        }
+        timeout_set = true;
+        return true;
+    }
+    else if (!psi_threshold_set && strcmp(argv[offset], "--psi-threshold") == 0)
+    {
+        if (!parse_bounded(argv[offset+1], 1, 100, &psi_threshold))
+        {
+            printf("Pressure threshold must be between 1%% and 100%%\n");
+            return false;
+        }
+        psi_threshold_set = true;
+        return true;
+    }
+    else if (!psi_max_defer_set && strcmp(argv[offset], "--psi-max-defer") == 0)
+    {
+        if (!parse_bounded(argv[offset+1], 0, 100000, &psi_max_defer))
+        {
+            printf("Maximum deferral must be between 0s and 100000s\n");
+            return false;
+        }
+        psi_max_defer_set = true;
+        return true;
+    }
+    else if (!cpu_priority_set && strcmp(argv[offset], "--cpu-priority") == 0)
+    {
+        if (strcmp(argv[offset+1], "normal") == 0)
+            cpu_priority = CPU_PRIORITY_NORMAL;
+        else if (strcmp(argv[offset+1], "idle") == 0)
+            cpu_priority = CPU_PRIORITY_IDLE;
+        else if (!parse_bounded(argv[offset+1], 1, 19, &cpu_priority))
+        {
+            printf("CPU priority must be normal, idle or a nice level "
+                    "between 1 and 19\n");
+            return false;
+        }
+        cpu_priority_set = true;
+        return true;
+    }
+    else if (!io_priority_set && strcmp(argv[offset], "--io-priority") == 0)
+    {
+        if (strcmp(argv[offset+1], "normal") == 0)
+            io_idle = false;
+        else if (strcmp(argv[offset+1], "idle") == 0)
+            io_idle = true;
+        else
+        {
+            printf("IO priority must be normal or idle\n");
+            return false;
+        }
+        io_priority_set = true;
+        return true;
+    }
+    else if (!control_set && strcmp(argv[offset], "--control") == 0)
+    {
+        control_path = argv[offset+1];
+        control_set = true;
+        return true;
+    }
+    else if (!workers_set && strcmp(argv[offset], "--workers") == 0)
+    {
+        if (!parse_bounded(argv[offset+1], 1, 64, &workers))
+        {
+            printf("Number of commit threads must be between 1 and 64\n");
+            return false;
+        }
+        workers_set = true;
+        return true;
+    }
+    else if (!mem_budget_set && strcmp(argv[offset], "--mem-budget") == 0)
+    {
+        if (!parse_bounded(argv[offset+1], 16, 1048576, &mem_budget))
         {
-            timeout = (int)t;
-            timeout_set = true;
+            printf("Memory budget must be between 16MB and 1048576MB\n");
+            return false;
         }
+        mem_budget_set = true;
+        return true;
+    }
+    else if (!warm_start_set && strcmp(argv[offset], "--warm-start") == 0)
+    {
+        if (strcmp(argv[offset+1], "on") == 0)
+            warm_start = true;
+        else if (strcmp(argv[offset+1], "off") == 0)
+            warm_start = false;
         else
         {
-            printf("Timeout value must be between 1s and 100000s\n");
+            printf("Warm start must be on or off\n");
+            return false;
+        }
+        warm_start_set = true;
+        return true;
+    }
+    else if (!metrics_set && strcmp(argv[offset], "--metrics") == 0)
+    {
+        int port;
+        const char* value = argv[offset+1];
+        if (strspn(value, "0123456789") == strlen(value) &&
+                !parse_bounded(value, 1, 65535, &port))
+        {
+            printf("Metrics port must be between 1 and 65535\n");
+            return false;
+        }
+        metrics_address = value;
+        metrics_set = true;
+        return true;
+    }
+    else if (!log_format_set && strcmp(argv[offset], "--log-format") == 0)
+    {
+        if (strcmp(argv[offset+1], "text") == 0)
+            log_json = false;
+        else if (strcmp(argv[offset+1], "json") == 0)
+            log_json = true;
+        else
+        {
+            printf("Log format must be text or json\n");
+            return false;
+        }
+        log_format_set = true;
+        return true;
+    }
+    else if (!trace_set && strcmp(argv[offset], "--trace") == 0)
+    {
+        trace_path = argv[offset+1];
+        trace_set = true;
+        return true;
+    }
+    else if (!record_set && strcmp(argv[offset], "--record") == 0)
+    {
+        record_path = argv[offset+1];
+        record_set = true;
+        return true;
+    }
+    else if (!poll_set && strcmp(argv[offset], "--poll") == 0)
+    {
+        if (strcmp(argv[offset+1], "off") == 0)
+            poll_interval = 0;
+        else if (!parse_bounded(argv[offset+1], 10, 600000, &poll_interval))
+        {
+            printf("Poll interval must be off or between 10ms and 600000ms\n");
+            return false;
+        }
+        poll_set = true;
+        return true;
+    }
+    else if (!cold_after_set && strcmp(argv[offset], "--cold-after") == 0)
+    {
+        if (strcmp(argv[offset+1], "off") == 0)
+            cold_after = 0;
+        else if (!parse_bounded(argv[offset+1], 1, 1000000, &cold_after))
+        {
+            printf("Idle time must be off or between 1s and 1000000s\n");
+            return false;
+        }
+        cold_after_set = true;
+        return true;
+    }
+    else if (!retention_set && strcmp(argv[offset], "--retention") == 0)
+    {
+        if (strcmp(argv[offset+1], "on") == 0)
+            retention = true;
+        else if (strcmp(argv[offset+1], "branch") == 0)
+            retention = retention_branch = true;
+        else if (strcmp(argv[offset+1], "off") == 0)
+            retention = false;
+        else
+        {
+            printf("Retention must be on, branch or off\n");
+            return false;
+        }
+        retention_set = true;
+        return true;
+    }
+    else if (!private_set && strcmp(argv[offset], "--private") == 0)
+    {
+        if (strcmp(argv[offset+1], "on") == 0)
+            private_ref = true;
+        else if (strcmp(argv[offset+1], "off") == 0)
+            private_ref = false;
+        else
+        {
+            printf("Private must be on or off\n");
             return false;
         }
+        private_set = true;
+        return true;
+    }
+    else if (!snapshot_set && strcmp(argv[offset], "--snapshot") == 0)
+    {
+        if (strcmp(argv[offset+1], "on") == 0)
+            snapshot = true;
+        else if (strcmp(argv[offset+1], "off") == 0)
+            snapshot = false;
+        else
+        {
+            printf("Snapshot must be on or off\n");
+            return false;
+        }
+        snapshot_set = true;
         return true;
     }
 
@@ -59,22 +354,18 @@ bool parse_args_impl(int argc, char* argv[])
     if (last_slash)
         prog_name = last_slash + 1;
 
-    if (argc == 2 || argc == 4 || argc > 5)
+    if (argc % 2 == 0)
         return false;
 
-    if (argc == 3)
-        return parse_pair(argv, 1);
-
-    if (argc == 5)
+    for (int i = 1; i < argc; i += 2)
     {
-        if (!parse_pair(argv, 1))
-        {
+        if (!parse_pair(argv, i))
             return false;
-        }
-
-        return parse_pair(argv, 3);
     }
 
+    if (repo_count == 0)
+        add_repo_path(".");
+
     return true;
 }
 
@@ -93,12 +384,117 @@ const char* get_prog_name()
     return prog_name;
 }
 
-const char* get_repo_path()
+int get_repo_count()
 {
-    return repo_path;
+    return repo_count;
+}
+
+const char* get_repo_path(int i)
+{
+    return repo_paths[i];
 }
 
 int get_timeout()
 {
     return timeout;
 }
+
+int get_psi_threshold()
+{
+    return psi_threshold;
+}
+
+int get_psi_max_defer()
+{
+    return psi_max_defer;
+}
+
+int get_cpu_priority()
+{
+    return cpu_priority;
+}
+
+bool get_io_idle()
+{
+    return io_idle;
+}
+
+const char* get_control_path()
+{
+    return control_path;
+}
+
+const char* get_metrics_address()
+{
+    return metrics_address;
+}
+
+bool get_log_json()
+{
+    return log_json;
+}
+
+const char* get_trace_path()
+{
+    return trace_path;
+}
+
+const char* get_record_path()
+{
+    return record_path;
+}
+
+int get_workers()
+{
+    if (workers == 0)
+    {
+        uv_cpu_info_t* cpus;
+        int count = 1;
+        if (uv_cpu_info(&cpus, &count) == 0)
+            uv_free_cpu_info(cpus, count);
+        workers = count < DEFAULT_MAX_WORKERS ? count : DEFAULT_MAX_WORKERS;
+        if (workers < 1)
+            workers = 1;
+    }
+    return workers;
+}
+
+int get_mem_budget()
+{
+    return mem_budget;
+}
+
+bool get_warm_start()
+{
+    return warm_start;
+}
+
+int get_poll_interval()
+{
+    return poll_interval;
+}
+
+int get_cold_after()
+{
+    return cold_after;
+}
+
+bool get_retention()
+{
+    return retention;
+}
+
+bool get_retention_branch()
+{
+    return retention_branch;
+}
+
+bool get_private()
+{
+    return private_ref;
+}
+
+bool get_snapshot()
+{
+    return snapshot;
+}
@@ -2,7 +2,29 @@
 
 #include <stdbool.h>
 
+#define CPU_PRIORITY_NORMAL 0
+#define CPU_PRIORITY_IDLE -1
+
 bool parse_args(int argc, char* argv[]);
 const char* get_prog_name();
-const char* get_repo_path();
+int get_repo_count();
+const char* get_repo_path(int i);
 int get_timeout();
+int get_psi_threshold();
+int get_psi_max_defer();
+int get_cpu_priority();
+bool get_io_idle();
+const char* get_control_path();
+const char* get_metrics_address();
+bool get_log_json();
+const char* get_trace_path();
+const char* get_record_path();
+int get_workers();
+int get_mem_budget();
+bool get_warm_start();
+int get_poll_interval();
+int get_cold_after();
+bool get_retention();
+bool get_retention_branch();
+bool get_private();
+bool get_snapshot();
@@ -0,0 +1,465 @@
+#define _XOPEN_SOURCE 700
+
+#include "driver.h"
+#include "tree_gen.h"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define NS_PER_MS 1000000ULL
+#define NS_PER_S 1000000000ULL
+
+enum
+{
+    SCENARIO_COLD_START,
+    SCENARIO_SAVE,
+    SCENARIO_BURST,
+    SCENARIO_BULK,
+    SCENARIO_RENAME,
+    SCENARIO_COUNT
+};
+
+const char* scenario_names[SCENARIO_COUNT] = {
+    "cold_start", "save", "burst", "bulk", "rename"
+};
+
+typedef struct latencies
+{
+    uint64_t* values; // ns
+    int count;
+    int failed;
+} latencies;
+
+const char* gwatch_path = GWATCH_PATH;
+const char* work_dir = NULL;
+const char* json_path = NULL;
+tree_spec spec = { 200, 5000, 6, 64, 65536, true, 42 };
+int iterations = 10;
+int burst_size = 50;
+int bulk_size = 1000;
+int gwatch_timeout = 1; // s
+bool keep = false;
+char** extra_args = NULL;
+int extra_count = 0;
+
+latencies results[SCENARIO_COUNT];
+
+void print_bench_usage(const char* name)
+{
+    printf("Usage: %s [--gwatch path/to/gwatch] [--workdir path] [--keep on|off]\n"
+           "    [--dirs count] [--files count] [--depth levels] "
+           "[--seed number]\n"
+           "    [--size-min bytes] [--size-max bytes] "
+           "[--size-dist uniform|pareto]\n"
+           "    [--iterations count] [--burst count] [--bulk count] "
+           "[--timeout s]\n"
+           "    [--json path/to/results.json] [-- gwatch_args...]\n", name);
+}
+
+bool parse_number(const char* value, long int min, long int max, long int* out)
+{
+    char* end = NULL;
+    long int v = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || v < min || v > max)
+        return false;
+
+    *out = v;
+    return true;
+}
+
+bool parse_int(const char* value, long int min, long int max, int* out)
+{
+    long int v;
+    if (!parse_number(value, min, max, &v))
+        return false;
+
+    *out = (int)v;
+    return true;
+}
+
+bool parse_bench_pair(const char* name, const char* value)
+{
+    long int v;
+
+    if (strcmp(name, "--gwatch") == 0)
+        gwatch_path = value;
+    else if (strcmp(name, "--workdir") == 0)
+        work_dir = value;
+    else if (strcmp(name, "--json") == 0)
+        json_path = value;
+    else if (strcmp(name, "--keep") == 0)
+    {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)
+            return false;
+        keep = strcmp(value, "on") == 0;
+    }
+    else if (strcmp(name, "--dirs") == 0)
+        return parse_int(value, 1, 10000000, &spec.dirs);
+    else if (strcmp(name, "--files") == 0)
+        return parse_int(value, 1, 100000000, &spec.files);
+    else if (strcmp(name, "--depth") == 0)
+        return parse_int(value, 1, 100, &spec.depth);
+    else if (strcmp(name, "--seed") == 0)
+    {
+        if (!parse_number(value, 1, 0x7fffffffL, &v))
+            return false;
+        spec.seed = (uint64_t)v;
+    }
+    else if (strcmp(name, "--size-min") == 0)
+    {
+        if (!parse_number(value, 0, 0x7fffffffL, &v))
+            return false;
+        spec.size_min = (size_t)v;
+    }
+    else if (strcmp(name, "--size-max") == 0)
+    {
+        if (!parse_number(value, 0, 0x7fffffffL, &v))
+            return false;
+        spec.size_max = (size_t)v;
+    }
+    else if (strcmp(name, "--size-dist") == 0)
+    {
+        if (strcmp(value, "uniform") != 0 && strcmp(value, "pareto") != 0)
+            return false;
+        spec.pareto = strcmp(value, "pareto") == 0;
+    }
+    else if (strcmp(name, "--iterations") == 0)
+        return parse_int(value, 1, 100000, &iterations);
+    else if (strcmp(name, "--burst") == 0)
+        return parse_int(value, 1, 100000, &burst_size);
+    else if (strcmp(name, "--bulk") == 0)
+        return parse_int(value, 1, 10000000, &bulk_size);
+    else if (strcmp(name, "--timeout") == 0)
+        return parse_int(value, 1, 100000, &gwatch_timeout);
+    else
+        return false;
+
+    return true;
+}
+
+bool parse_bench_args(int argc, char* argv[])
+{
+    int i = 1;
+    for (; i < argc && strcmp(argv[i], "--") != 0; i += 2)
+    {
+        if (i + 1 >= argc || !parse_bench_pair(argv[i], argv[i+1]))
+            return false;
+    }
+
+    // everything after -- goes to gwatch as it is
+    if (i < argc)
+    {
+        extra_args = argv + i + 1;
+        extra_count = argc - i - 1;
+    }
+
+    return spec.size_max >= spec.size_min;
+}
+
+void record(int scenario, bool found, uint64_t latency)
+{
+    latencies* l = &results[scenario];
+    if (!found)
+    {
+        ++l->failed;
+        return;
+    }
+
+    l->values = realloc(l->values, (size_t)(l->count + 1) * sizeof(uint64_t));
+    l->values[l->count++] = latency;
+}
+
+int compare_latency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank
+double percentile(const latencies* l, int p)
+{
+    if (l->count == 0)
+        return 0.0;
+
+    int rank = (p * l->count + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return (double)l->values[rank - 1] / (double)NS_PER_MS;
+}
+
+uint64_t wait_timeout()
+{
+    return ((uint64_t)gwatch_timeout + 120) * NS_PER_S;
+}
+
+bool hash_file(const char* root, const char* rel, git_oid* id)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    return git_odb_hashfile(id, path, GIT_OBJ_BLOB) == 0;
+}
+
+// waits for the last written path, the ones before it are in the same or an
+// earlier commit
+bool wait_for(bench_driver* d, int scenario, const char* rel, uint64_t since)
+{
+    git_oid id;
+    uint64_t latency = 0;
+    bool found = hash_file(d->root, rel, &id) &&
+        driver_wait_commit(d, rel, &id, since, wait_timeout(), &latency);
+
+    record(scenario, found, latency);
+    if (!found)
+        fprintf(stderr, "%s: %s was not committed in time\n",
+                scenario_names[scenario], rel);
+    return found;
+}
+
+bool write_file(const char* root, const char* rel, size_t size, uint64_t* rng)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    if (!write_random_file(path, size, rng))
+    {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool run_save(bench_driver* d, tree_info* info, uint64_t* rng)
+{
+    const char* rel = info->files[bench_random(rng) % (uint64_t)info->file_count];
+    uint64_t since = uv_hrtime();
+    return write_file(d->root, rel, tree_pick_size(&spec, rng), rng) &&
+        wait_for(d, SCENARIO_SAVE, rel, since);
+}
+
+bool run_burst(bench_driver* d, tree_info* info, uint64_t* rng)
+{
+    const char* rel = NULL;
+    uint64_t since = uv_hrtime();
+    for (int i = 0; i < burst_size; ++i)
+    {
+        rel = info->files[bench_random(rng) % (uint64_t)info->file_count];
+        if (!write_file(d->root, rel, tree_pick_size(&spec, rng), rng))
+            return false;
+    }
+    return wait_for(d, SCENARIO_BURST, rel, since);
+}
+
+bool run_bulk(bench_driver* d, tree_info* info, uint64_t* rng, int iteration)
+{
+    char dir[64];
+    char rel[128];
+    char path[4096];
+
+    // like copying a folder in, everything is new
+    snprintf(dir, sizeof(dir), "bulk%d", iteration);
+    snprintf(path, sizeof(path), "%s/%s", d->root, dir);
+    uint64_t since = uv_hrtime();
+    if (mkdir(path, 0755) < 0)
+    {
+        fprintf(stderr, "Cannot create %s\n", path);
+        return false;
+    }
+
+    for (int i = 0; i < bulk_size; ++i)
+    {
+        snprintf(rel, sizeof(rel), "%s/f%d.txt", dir, i);
+        if (!write_file(d->root, rel, tree_pick_size(&spec, rng), rng))
+            return false;
+        tree_add_file(info, rel);
+    }
+    return wait_for(d, SCENARIO_BULK, rel, since);
+}
+
+bool run_rename(bench_driver* d, tree_info* info, uint64_t* rng, int iteration)
+{
+    char from[2048];
+    char to[2064];
+    char from_path[4096];
+    char to_path[4096];
+
+    // the parent of a random file that is not in the root
+    const char* file = NULL;
+    for (int tries = 0; tries < 100 && !file; ++tries)
+    {
+        file = info->files[bench_random(rng) % (uint64_t)info->file_count];
+        if (!strchr(file, '/') || strncmp(file, "bulk", 4) == 0)
+            file = NULL;
+    }
+    if (!file)
+        return true;
+
+    size_t len = (size_t)(strrchr(file, '/') - file);
+    snprintf(from, sizeof(from), "%.*s", (int)len, file);
+    snprintf(to, sizeof(to), "%s_r%d", from, iteration);
+    snprintf(from_path, sizeof(from_path), "%s/%s", d->root, from);
+    snprintf(to_path, sizeof(to_path), "%s/%s", d->root, to);
+
+    uint64_t since = uv_hrtime();
+    if (rename(from_path, to_path) < 0)
+    {
+        fprintf(stderr, "Cannot rename %s\n", from_path);
+        return false;
+    }
+
+    // both the new path has to appear and the old one to go away
+    char moved[4096];
+    snprintf(moved, sizeof(moved), "%s%s", to, file + len);
+    tree_rename_dir(info, from, to);
+    uint64_t latency = 0;
+    bool found = driver_wait_commit(d, from, NULL, since, wait_timeout(),
+            &latency);
+    if (found)
+        return wait_for(d, SCENARIO_RENAME, moved, since);
+
+    record(SCENARIO_RENAME, false, 0);
+    fprintf(stderr, "rename: %s was not committed in time\n", to);
+    return false;
+}
+
+int remove_cb(const char* path, const struct stat* sb, int type,
+        struct FTW* ftw)
+{
+    (void)sb;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+void print_results(const tree_info* info, unsigned long commits,
+        double minutes, const struct rusage* usage)
+{
+    double user = (double)usage->ru_utime.tv_sec +
+        (double)usage->ru_utime.tv_usec / 1e6;
+    double sys = (double)usage->ru_stime.tv_sec +
+        (double)usage->ru_stime.tv_usec / 1e6;
+
+    for (int i = 0; i < SCENARIO_COUNT; ++i)
+        qsort(results[i].values, (size_t)results[i].count, sizeof(uint64_t),
+                compare_latency);
+
+    printf("tree: %d directories, %d files, %llu bytes\n", info->dir_count,
+            spec.files, (unsigned long long)info->bytes);
+    printf("%-12s %6s %6s %10s %10s %10s %10s\n", "scenario", "runs",
+            "failed", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (int i = 0; i < SCENARIO_COUNT; ++i)
+    {
+        const latencies* l = &results[i];
+        printf("%-12s %6d %6d %10.1f %10.1f %10.1f %10.1f\n",
+                scenario_names[i], l->count, l->failed, percentile(l, 50),
+                percentile(l, 90), percentile(l, 99), percentile(l, 100));
+    }
+    printf("commits: %lu (%.1f per minute)\n", commits,
+            minutes > 0 ? (double)commits / minutes : 0.0);
+    printf("gwatch CPU time: %.2fs user, %.2fs system, peak RSS %ld kB\n",
+            user, sys, usage->ru_maxrss);
+
+    if (!json_path)
+        return;
+
+    FILE* f = fopen(json_path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot write %s\n", json_path);
+        return;
+    }
+
+    fprintf(f, "{\"tree\":{\"dirs\":%d,\"files\":%d,\"bytes\":%llu},",
+            info->dir_count, spec.files, (unsigned long long)info->bytes);
+    fprintf(f, "\"scenarios\":{");
+    for (int i = 0; i < SCENARIO_COUNT; ++i)
+    {
+        const latencies* l = &results[i];
+        fprintf(f, "%s\"%s\":{\"runs\":%d,\"failed\":%d,\"p50_ms\":%.3f,"
+                "\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+                i ? "," : "", scenario_names[i], l->count, l->failed,
+                percentile(l, 50), percentile(l, 90), percentile(l, 99),
+                percentile(l, 100));
+    }
+    fprintf(f, "},\"commits\":%lu,\"commits_per_minute\":%.3f,"
+            "\"cpu_user_s\":%.3f,\"cpu_system_s\":%.3f,\"peak_rss_kb\":%ld}\n",
+            commits, minutes > 0 ? (double)commits / minutes : 0.0,
+            user, sys, usage->ru_maxrss);
+    fclose(f);
+}
+
+int main(int argc, char* argv[])
+{
+    if (!parse_bench_args(argc, argv))
+    {
+        print_bench_usage(argv[0]);
+        return -1;
+    }
+
+    char root[4096];
+    uv_fs_t req;
+    const char* tmp = work_dir ? work_dir : getenv("TMPDIR");
+    snprintf(root, sizeof(root), "%s/gwatch_bench_XXXXXX", tmp ? tmp : "/tmp");
+    if (uv_fs_mkdtemp(NULL, &req, root, NULL) < 0)
+    {
+        fprintf(stderr, "Cannot create a directory in %s\n", tmp ? tmp : "/tmp");
+        return -1;
+    }
+    snprintf(root, sizeof(root), "%s", req.path);
+    uv_fs_req_cleanup(&req);
+
+    git_libgit2_init();
+
+    tree_info info;
+    printf("Generating %d directories and %d files in %s\n", spec.dirs,
+            spec.files, root);
+    if (!tree_generate(root, &spec, &info))
+    {
+        fprintf(stderr, "Cannot generate the tree in %s\n", root);
+        return -1;
+    }
+
+    bench_driver d;
+    bool ok = driver_start(&d, gwatch_path, root, gwatch_timeout,
+            extra_args, extra_count);
+
+    // the initial commit has the whole tree
+    if (ok)
+        ok = wait_for(&d, SCENARIO_COLD_START,
+                info.files[info.file_count - 1], d.started);
+
+    uint64_t rng = spec.seed + 1;
+    for (int i = 0; ok && i < iterations; ++i)
+    {
+        ok = run_save(&d, &info, &rng) &&
+            run_burst(&d, &info, &rng) &&
+            run_bulk(&d, &info, &rng, i) &&
+            run_rename(&d, &info, &rng, i);
+    }
+
+    double minutes = (double)(uv_hrtime() - d.started) / (60.0 * NS_PER_S);
+    unsigned long commits = driver_count_commits(&d);
+    if (!driver_stop(&d))
+    {
+        fprintf(stderr, "gwatch exited with status %lld\n",
+                (long long)d.exit_status);
+        ok = false;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    print_results(&info, commits, minutes, &usage);
+
+    tree_info_free(&info);
+    for (int i = 0; i < SCENARIO_COUNT; ++i)
+        free(results[i].values);
+    git_libgit2_shutdown();
+
+    if (!keep)
+        nftw(root, remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+
+    return ok ? 0 : -1;
+}
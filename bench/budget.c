@@ -0,0 +1,72 @@
+#include "budget.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_LINE 1024
+
+bool budget_check(const char* path, const char* scenario,
+        budget_metric_fn metric, bool check_time)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot open the budget file %s\n", path);
+        return false;
+    }
+
+    char line[MAX_LINE];
+    int line_no = 0;
+    int checked = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), f))
+    {
+        char name[128];
+        char bench[128];
+        char metric_name[128];
+        double budget;
+        double tolerance;
+
+        ++line_no;
+        line[strcspn(line, "\r\n#")] = '\0';
+        if (line[strspn(line, " \t")] == '\0')
+            continue;
+
+        if (sscanf(line, "%127s %127s %127s %lf %lf", name, bench,
+                    metric_name, &budget, &tolerance) != 5)
+        {
+            fprintf(stderr, "%s:%d: expected scenario, benchmark, metric, "
+                    "budget and tolerance\n", path, line_no);
+            ok = false;
+            continue;
+        }
+        if (strcmp(name, scenario) != 0)
+            continue;
+
+        double value;
+        if (!metric(bench, metric_name, &value))
+        {
+            fprintf(stderr, "%s:%d: %s %s was not measured\n", path, line_no,
+                    bench, metric_name);
+            ok = false;
+            continue;
+        }
+
+        double limit = budget * (1.0 + tolerance / 100.0);
+        bool within = value <= limit;
+        bool gated = check_time || strcmp(metric_name, "ms") != 0;
+        printf("%-6s %s %s: %.1f, budget %.1f + %.0f%%\n",
+                within ? "ok" : gated ? "OVER" : "slow", bench, metric_name,
+                value, budget, tolerance);
+        ok = ok && (within || !gated);
+        ++checked;
+    }
+
+    fclose(f);
+    if (checked == 0)
+    {
+        fprintf(stderr, "%s has no budgets for %s\n", path, scenario);
+        return false;
+    }
+    return ok;
+}
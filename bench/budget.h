@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+// looks up a measured value, false if the benchmark or metric is unknown
+typedef bool(*budget_metric_fn)(const char* bench, const char* metric,
+        double* value);
+
+// checks every line of the budget file that belongs to scenario:
+//     scenario benchmark metric budget tolerance_percent
+// a value may exceed its budget by the tolerance, beyond that the check
+// fails; times (the ms metric) depend on the machine and its load, they only
+// fail the check with check_time and are reported otherwise
+bool budget_check(const char* path, const char* scenario,
+        budget_metric_fn metric, bool check_time);
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+
+#include "counters.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_ADD(p, v) __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+
+sys_counters totals;
+
+void count_syscall()
+{
+    ATOMIC_ADD(&totals.syscalls, 1);
+}
+
+void count_alloc(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    size_t size = malloc_usable_size(ptr);
+    ATOMIC_ADD(&totals.allocations, 1);
+    ATOMIC_ADD(&totals.allocated_bytes, size);
+    int64_t live = ATOMIC_ADD(&totals.live_bytes, (int64_t)size);
+
+    int64_t peak = ATOMIC_LOAD(&totals.peak_bytes);
+    while (live > peak && !__atomic_compare_exchange_n(&totals.peak_bytes,
+                &peak, live, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// blocks allocated inside libc (scandir, realpath) are only seen when freed,
+// so live_bytes can drift a little below zero
+void count_free(void* ptr)
+{
+    if (ptr)
+        ATOMIC_ADD(&totals.live_bytes, -(int64_t)malloc_usable_size(ptr));
+}
+
+void counters_reset()
+{
+    ATOMIC_STORE(&totals.syscalls, 0);
+    ATOMIC_STORE(&totals.allocations, 0);
+    ATOMIC_STORE(&totals.allocated_bytes, 0);
+    ATOMIC_STORE(&totals.peak_bytes, ATOMIC_LOAD(&totals.live_bytes));
+}
+
+void counters_read(sys_counters* out)
+{
+    out->syscalls = ATOMIC_LOAD(&totals.syscalls);
+    out->allocations = ATOMIC_LOAD(&totals.allocations);
+    out->allocated_bytes = ATOMIC_LOAD(&totals.allocated_bytes);
+    out->live_bytes = ATOMIC_LOAD(&totals.live_bytes);
+    out->peak_bytes = ATOMIC_LOAD(&totals.peak_bytes);
+}
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+char* __real_strdup(const char* str);
+
+void* __wrap_malloc(size_t size)
+{
+    void* ptr = __real_malloc(size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    void* ptr = __real_calloc(count, size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    count_free(ptr);
+    void* moved = __real_realloc(ptr, size);
+    count_alloc(moved);
+    return moved;
+}
+
+void __wrap_free(void* ptr)
+{
+    count_free(ptr);
+    __real_free(ptr);
+}
+
+char* __wrap_strdup(const char* str)
+{
+    char* copy = __real_strdup(str);
+    count_alloc(copy);
+    return copy;
+}
+
+// every wrapper counts one system call and forwards to the real function
+
+#define WRAP(ret, name, params, args) \
+    ret __real_##name params; \
+    ret __wrap_##name params \
+    { \
+        count_syscall(); \
+        return __real_##name args; \
+    }
+
+WRAP(int, close, (int fd), (fd))
+WRAP(ssize_t, read, (int fd, void* buf, size_t n), (fd, buf, n))
+WRAP(ssize_t, write, (int fd, const void* buf, size_t n), (fd, buf, n))
+WRAP(ssize_t, pread64, (int fd, void* buf, size_t n, off64_t off),
+        (fd, buf, n, off))
+WRAP(ssize_t, pwrite64, (int fd, const void* buf, size_t n, off64_t off),
+        (fd, buf, n, off))
+WRAP(off64_t, lseek64, (int fd, off64_t off, int whence), (fd, off, whence))
+WRAP(int, stat, (const char* path, struct stat* st), (path, st))
+WRAP(int, stat64, (const char* path, struct stat64* st), (path, st))
+WRAP(int, lstat64, (const char* path, struct stat64* st), (path, st))
+WRAP(int, fstat, (int fd, struct stat* st), (fd, st))
+WRAP(int, fstat64, (int fd, struct stat64* st), (fd, st))
+WRAP(int, access, (const char* path, int mode), (path, mode))
+WRAP(DIR*, opendir, (const char* path), (path))
+WRAP(struct dirent*, readdir, (DIR* dir), (dir))
+WRAP(struct dirent64*, readdir64, (DIR* dir), (dir))
+WRAP(int, closedir, (DIR* dir), (dir))
+WRAP(int, scandir64, (const char* path, struct dirent64*** list,
+        int (*filter)(const struct dirent64*),
+        int (*compare)(const struct dirent64**, const struct dirent64**)),
+        (path, list, filter, compare))
+WRAP(void*, mmap, (void* addr, size_t n, int prot, int flags, int fd,
+        off_t off), (addr, n, prot, flags, fd, off))
+WRAP(void*, mmap64, (void* addr, size_t n, int prot, int flags, int fd,
+        off64_t off), (addr, n, prot, flags, fd, off))
+WRAP(int, munmap, (void* addr, size_t n), (addr, n))
+WRAP(int, ftruncate, (int fd, off_t size), (fd, size))
+WRAP(int, ftruncate64, (int fd, off64_t size), (fd, size))
+WRAP(int, fsync, (int fd), (fd))
+WRAP(int, mkdir, (const char* path, mode_t mode), (path, mode))
+WRAP(int, rename, (const char* from, const char* to), (from, to))
+WRAP(int, unlink, (const char* path), (path))
+
+int __real_open(const char* path, int flags, ...);
+int __real_open64(const char* path, int flags, ...);
+long __real_syscall(long number, ...);
+
+mode_t open_mode(int flags, va_list ap)
+{
+    return (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE ?
+        (mode_t)va_arg(ap, int) : 0;
+}
+
+int __wrap_open(const char* path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+
+    count_syscall();
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_open64(const char* path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+
+    count_syscall();
+    return __real_open64(path, flags, mode);
+}
+
+// libuv calls inotify and statx through syscall(), the arguments are passed
+// on as they are
+long __wrap_syscall(long number, ...)
+{
+    long a[6];
+    va_list ap;
+    va_start(ap, number);
+    for (int i = 0; i < 6; ++i)
+        a[i] = va_arg(ap, long);
+    va_end(ap);
+
+    count_syscall();
+    return __real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// filled in by the --wrap'ed libc functions in counters.c, only the calls
+// made by gwatch, libgit2 and libuv are seen, not the ones inside libc
+typedef struct sys_counters
+{
+    uint64_t syscalls;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    int64_t live_bytes;
+    int64_t peak_bytes; // of live_bytes since the last counters_reset
+} sys_counters;
+
+void counters_reset();
+void counters_read(sys_counters* out);
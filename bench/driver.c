@@ -0,0 +1,195 @@
+#include "driver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the ref is also polled at this interval, in case a rename is missed
+#define TICK_MS 20
+
+void exit_cb(uv_process_t* process, int64_t exit_status, int term_signal)
+{
+    bench_driver* d = process->data;
+    (void)term_signal;
+
+    d->running = false;
+    d->exit_status = exit_status;
+    uv_close((uv_handle_t*)process, NULL);
+}
+
+void refs_cb(uv_fs_event_t* handle, const char* filename, int events,
+        int status)
+{
+    bench_driver* d = handle->data;
+    (void)filename;
+    (void)events;
+    (void)status;
+
+    ++d->ref_changes;
+}
+
+void tick_cb(uv_timer_t* handle)
+{
+    (void)handle;
+}
+
+bool driver_start(bench_driver* d, const char* gwatch, const char* root,
+        int timeout, char** extra_args, int extra_count)
+{
+    char refs[4096];
+    char timeout_arg[16];
+
+    memset(d, 0, sizeof(*d));
+    d->root = root;
+    uv_loop_init(&d->loop);
+
+    uv_fs_event_init(&d->loop, &d->refs_watch);
+    d->refs_watch.data = d;
+    uv_timer_init(&d->loop, &d->tick);
+
+    if (git_repository_init(&d->repo, root, false) < 0)
+    {
+        fprintf(stderr, "Cannot create a repository in %s\n", root);
+        return false;
+    }
+
+    // the ref file is replaced on every commit, renames show up here
+    snprintf(refs, sizeof(refs), "%s/.git/refs/heads", root);
+    uv_fs_event_start(&d->refs_watch, refs_cb, refs, 0);
+
+    snprintf(timeout_arg, sizeof(timeout_arg), "%d", timeout);
+    char** args = malloc((size_t)(extra_count + 6) * sizeof(char*));
+    int argc = 0;
+    args[argc++] = (char*)(uintptr_t)gwatch;
+    args[argc++] = "-r";
+    args[argc++] = (char*)(uintptr_t)root;
+    args[argc++] = "-t";
+    args[argc++] = timeout_arg;
+    for (int i = 0; i < extra_count; ++i)
+        args[argc++] = extra_args[i];
+    args[argc] = NULL;
+
+    // gwatch logs every event, that would only measure the terminal
+    uv_stdio_container_t stdio[3];
+    stdio[0].flags = UV_IGNORE;
+    stdio[1].flags = UV_IGNORE;
+    stdio[2].flags = UV_INHERIT_FD;
+    stdio[2].data.fd = 2;
+
+    uv_process_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.exit_cb = exit_cb;
+    options.file = gwatch;
+    options.args = args;
+    options.stdio = stdio;
+    options.stdio_count = 3;
+
+    d->process.data = d;
+    d->started = uv_hrtime();
+    int error = uv_spawn(&d->loop, &d->process, &options);
+    free(args);
+
+    if (error < 0)
+    {
+        fprintf(stderr, "Cannot start %s, %s\n", gwatch, uv_strerror(error));
+        return false;
+    }
+
+    d->running = true;
+    return true;
+}
+
+bool head_matches(bench_driver* d, const char* path, const git_oid* id)
+{
+    git_reference* head = NULL;
+    git_object* tree = NULL;
+    git_tree_entry* entry = NULL;
+    bool matches = false;
+
+    if (git_repository_head(&head, d->repo) == 0 &&
+            git_reference_peel(&tree, head, GIT_OBJ_TREE) == 0)
+    {
+        int error = git_tree_entry_bypath(&entry, (git_tree*)tree, path);
+        if (id)
+            matches = error == 0 && git_oid_equal(git_tree_entry_id(entry), id);
+        else
+            matches = error == GIT_ENOTFOUND;
+    }
+
+    git_tree_entry_free(entry);
+    git_object_free(tree);
+    git_reference_free(head);
+    return matches;
+}
+
+bool driver_wait_commit(bench_driver* d, const char* path, const git_oid* id,
+        uint64_t since, uint64_t timeout_ns, uint64_t* latency)
+{
+    uv_timer_start(&d->tick, tick_cb, TICK_MS, TICK_MS);
+
+    bool found = false;
+    while (d->running && uv_hrtime() - since < timeout_ns)
+    {
+        unsigned long changes = d->ref_changes;
+        uv_run(&d->loop, UV_RUN_ONCE);
+
+        // the time is taken as soon as the ref is seen to move
+        uint64_t now = uv_hrtime();
+        if ((changes != d->ref_changes || !found) &&
+                head_matches(d, path, id))
+        {
+            *latency = now - since;
+            found = true;
+            break;
+        }
+    }
+
+    uv_timer_stop(&d->tick);
+    return found;
+}
+
+bool driver_sleep_until(bench_driver* d, uint64_t until)
+{
+    uint64_t now;
+    while (d->running && (now = uv_hrtime()) < until)
+    {
+        uv_timer_start(&d->tick, tick_cb, (until - now + 999999) / 1000000, 0);
+        uv_run(&d->loop, UV_RUN_ONCE);
+    }
+    uv_timer_stop(&d->tick);
+    return d->running;
+}
+
+unsigned long driver_count_commits(bench_driver* d)
+{
+    git_revwalk* walk = NULL;
+    git_oid id;
+    unsigned long count = 0;
+
+    if (d->repo && git_revwalk_new(&walk, d->repo) == 0 &&
+            git_revwalk_push_head(walk) == 0)
+    {
+        while (git_revwalk_next(&id, walk) == 0)
+            ++count;
+    }
+
+    git_revwalk_free(walk);
+    return count;
+}
+
+bool driver_stop(bench_driver* d)
+{
+    if (d->running)
+        uv_process_kill(&d->process, SIGTERM);
+
+    uv_fs_event_stop(&d->refs_watch);
+    uv_close((uv_handle_t*)&d->refs_watch, NULL);
+    uv_close((uv_handle_t*)&d->tick, NULL);
+
+    uv_run(&d->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&d->loop);
+    git_repository_free(d->repo);
+    d->repo = NULL;
+
+    return d->exit_status == 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <git2.h>
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// one gwatch process working on the tree under root
+typedef struct bench_driver
+{
+    uv_loop_t loop;
+    uv_process_t process;
+    uv_fs_event_t refs_watch;
+    uv_timer_t tick;
+    bool running;
+    int64_t exit_status;
+    const char* root;
+    git_repository* repo;
+    unsigned long ref_changes;
+    uint64_t started; // ns
+} bench_driver;
+
+bool driver_start(bench_driver* d, const char* gwatch, const char* root,
+        int timeout, char** extra_args, int extra_count);
+
+// waits until HEAD has path with the content id, or without path if id is
+// NULL; *latency is the time from since to the commit that showed it
+bool driver_wait_commit(bench_driver* d, const char* path, const git_oid* id,
+        uint64_t since, uint64_t timeout_ns, uint64_t* latency);
+
+// runs the loop until the time is reached, false if gwatch exited meanwhile
+bool driver_sleep_until(bench_driver* d, uint64_t until);
+
+unsigned long driver_count_commits(bench_driver* d);
+
+bool driver_stop(bench_driver* d);
@@ -0,0 +1,447 @@
+#include "../args.h"
+#include "../commit_worker.h"
+#include "../fs_listener.h"
+#include "../fs_oper_mem.h"
+#include "../logs.h"
+#include "../repos.h"
+#include "tree_gen.h"
+
+#include <git2.h>
+#include <git2/sys/mempack.h>
+#include <git2/sys/repository.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define CHECK_MS 10
+
+// a repository that lives in memory: the tree in fs_oper_mem.c and the
+// objects in a mempack odb
+typedef struct mem_repo
+{
+    watched_repo* repo;
+    git_repository* git;
+    git_odb_backend* mempack;
+    git_index* index;
+    git_oid head;
+    git_oid head_tree;
+    bool has_head;
+    char** files; // relative paths
+    int file_count;
+    char** dirs;
+    int dir_count;
+} mem_repo;
+
+int mem_repo_count = 1;
+int mem_dirs = 200;
+int mem_files = 5000;
+int mem_file_size = 256;
+int mem_new_percent = 1; // of the events, the rest change existing files
+int mem_batch = 10000; // events per loop iteration
+long long mem_events = 10000000;
+int mem_timeout = 1; // s
+uint64_t mem_seed = 42;
+
+mem_repo* mem_repos = NULL;
+uv_loop_t mem_loop;
+uv_idle_t mem_inject;
+uv_timer_t mem_check;
+long long mem_injected = 0;
+uint64_t mem_rng;
+uint64_t mem_start;
+uint64_t mem_inject_end;
+uint64_t mem_end;
+
+void mem_usage(const char* name)
+{
+    printf("Usage: %s [--events count] [--repos count] [--dirs count] "
+           "[--files count]\n"
+           "    [--file-size bytes] [--new-percent percent] "
+           "[--batch events_per_iteration]\n"
+           "    [--timeout s] [--seed number]\n", name);
+}
+
+bool mem_pair(const char* name, const char* value)
+{
+    char* end = NULL;
+    long long v = strtoll(value, &end, 10);
+    if (end == value || *end != '\0' || v < 0)
+        return false;
+
+    if (strcmp(name, "--events") == 0)
+        mem_events = v;
+    else if (strcmp(name, "--repos") == 0 && v >= 1 && v <= 10000)
+        mem_repo_count = (int)v;
+    else if (strcmp(name, "--dirs") == 0 && v >= 1 && v <= 10000000)
+        mem_dirs = (int)v;
+    else if (strcmp(name, "--files") == 0 && v >= 1 && v <= 100000000)
+        mem_files = (int)v;
+    else if (strcmp(name, "--file-size") == 0 && v <= 100000000)
+        mem_file_size = (int)v;
+    else if (strcmp(name, "--new-percent") == 0 && v <= 100)
+        mem_new_percent = (int)v;
+    else if (strcmp(name, "--batch") == 0 && v >= 1 && v <= 100000000)
+        mem_batch = (int)v;
+    else if (strcmp(name, "--timeout") == 0 && v >= 1 && v <= 100000)
+        mem_timeout = (int)v;
+    else if (strcmp(name, "--seed") == 0 && v >= 1)
+        mem_seed = (uint64_t)v;
+    else
+        return false;
+
+    return true;
+}
+
+// a/b, or just b when a is empty
+char* mem_join(const char* a, const char* b)
+{
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    size_t sep = a_len > 0 ? 1 : 0;
+    char* path = malloc(a_len + sep + b_len + 1);
+    memcpy(path, a, a_len);
+    path[a_len] = '/';
+    memcpy(path + a_len + sep, b, b_len + 1);
+    return path;
+}
+
+void mem_add_file(mem_repo* r, const char* dir, int n)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "f%d.txt", n);
+    char* rel = mem_join(dir, name);
+
+    char* full = mem_join(r->repo->path, rel);
+    memfs_write(full);
+    free(full);
+
+    r->files = realloc(r->files, (size_t)(r->file_count + 1) * sizeof(char*));
+    r->files[r->file_count++] = rel;
+}
+
+bool mem_repo_init(mem_repo* r, int index)
+{
+    char root[64];
+    snprintf(root, sizeof(root), "/mem/repo%d", index);
+    memset(r, 0, sizeof(*r));
+
+    git_odb* odb = NULL;
+    if (git_repository_new(&r->git) < 0 || git_odb_new(&odb) < 0 ||
+            git_mempack_new(&r->mempack) < 0 ||
+            git_odb_add_backend(odb, r->mempack, 1) < 0 ||
+            git_index_new(&r->index) < 0)
+    {
+        git_odb_free(odb);
+        return false;
+    }
+    git_repository_set_odb(r->git, odb);
+    git_repository_set_index(r->git, r->index);
+    git_odb_free(odb);
+
+    // directories hang below random earlier ones, files in random ones
+    memfs_mkdir(root);
+    r->dirs = malloc((size_t)mem_dirs * sizeof(char*));
+    r->dirs[r->dir_count++] = mem_join("", "");
+    for (int i = 1; i < mem_dirs; ++i)
+    {
+        char name[64];
+        const char* parent = r->dirs[bench_random(&mem_rng) %
+            (uint64_t)r->dir_count];
+        snprintf(name, sizeof(name), "d%d", i);
+        char* rel = mem_join(parent, name);
+
+        char* full = mem_join(root, rel);
+        memfs_mkdir(full);
+        free(full);
+        r->dirs[r->dir_count++] = rel;
+    }
+
+    r->repo = repos_add(root);
+    for (int i = 0; i < mem_files; ++i)
+        mem_add_file(r, r->dirs[bench_random(&mem_rng) %
+                (uint64_t)r->dir_count], i);
+    return true;
+}
+
+void mem_repo_free(mem_repo* r)
+{
+    for (int i = 0; i < r->file_count; ++i)
+        free(r->files[i]);
+    for (int i = 0; i < r->dir_count; ++i)
+        free(r->dirs[i]);
+    free(r->files);
+    free(r->dirs);
+    git_index_free(r->index);
+    git_repository_free(r->git);
+}
+
+mem_repo* find_mem_repo(const watched_repo* repo)
+{
+    for (int i = 0; i < mem_repo_count; ++i)
+    {
+        if (mem_repos[i].repo == repo)
+            return &mem_repos[i];
+    }
+    return NULL;
+}
+
+// the content is derived from the path and its version
+bool stage_file(git_index* index, const char* rel, uint64_t version)
+{
+    char* buf = malloc((size_t)mem_file_size + 64);
+    int header = snprintf(buf, 64, "%s %llu\n", rel,
+            (unsigned long long)version);
+    size_t len = (size_t)(header < 64 ? header : 63);
+    if (len < (size_t)mem_file_size)
+    {
+        memset(buf + len, 'x', (size_t)mem_file_size - len);
+        len = (size_t)mem_file_size;
+    }
+
+    git_index_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.path = rel;
+    entry.mode = GIT_FILEMODE_BLOB;
+    int error = git_index_add_frombuffer(index, &entry, buf, len);
+    free(buf);
+    return error == 0;
+}
+
+void stage_scanned(const char* rel, uint64_t version, void* arg)
+{
+    stage_file(arg, rel, version);
+}
+
+// takes the place of commit() from git.c, on a commit thread
+void mem_commit(watched_repo* repo)
+{
+    mem_repo* r = find_mem_repo(repo);
+    repo->commit_result = COMMIT_FAILED;
+    repo->committed_tree_valid = false;
+
+    if (repo->commit_full_scan)
+    {
+        git_index_clear(r->index);
+        memfs_foreach_file(repo->path, stage_scanned, r->index);
+    }
+    else
+    {
+        size_t it = 0;
+        const char* rel;
+        while (path_map_next(&repo->commit_paths, &it, &rel, NULL))
+        {
+            char* full = mem_join(repo->path, rel);
+            uint64_t version = memfs_file_version(full);
+            free(full);
+
+            if (version > 0)
+            {
+                if (!stage_file(r->index, rel, version))
+                    return;
+            }
+            else
+            {
+                git_index_remove_directory(r->index, rel, 0);
+                git_index_remove(r->index, rel, 0);
+            }
+        }
+    }
+
+    git_oid tree_id;
+    if (git_index_write_tree(&tree_id, r->index) < 0)
+        return;
+
+    repo->commit_result = COMMIT_NO_CHANGES;
+    if (r->has_head && git_oid_equal(&tree_id, &r->head_tree))
+        return;
+
+    git_tree* tree = NULL;
+    git_commit* parent = NULL;
+    git_signature* sig = NULL;
+    if (git_tree_lookup(&tree, r->git, &tree_id) == 0 &&
+            (!r->has_head || git_commit_lookup(&parent, r->git, &r->head) == 0) &&
+            git_signature_new(&sig, "gwatch", "gwatch", 0, 0) == 0)
+    {
+        const git_commit* parents[1] = { parent };
+        if (git_commit_create(&r->head, r->git, NULL, sig, sig, NULL,
+                    "gwatch", tree, r->has_head ? 1 : 0, parents) == 0)
+        {
+            r->has_head = true;
+            r->head_tree = tree_id;
+            repo->commit_result = COMMIT_CREATED;
+        }
+        else
+            repo->commit_result = COMMIT_FAILED;
+    }
+    else
+        repo->commit_result = COMMIT_FAILED;
+
+    git_signature_free(sig);
+    git_commit_free(parent);
+    git_tree_free(tree);
+}
+
+void mem_shutdown_done()
+{
+    uv_stop(&mem_loop);
+}
+
+bool all_committed()
+{
+    for (int i = 0; i < mem_repo_count; ++i)
+    {
+        const watched_repo* repo = mem_repos[i].repo;
+        if (repo->committing || repo->full_scan || repo->dirty.count > 0)
+            return false;
+    }
+    return true;
+}
+
+void check_cb(uv_timer_t* handle)
+{
+    if (!all_committed())
+        return;
+
+    uv_timer_stop(handle);
+    mem_end = uv_hrtime();
+    fs_listener_shutdown(mem_shutdown_done);
+}
+
+void inject_cb(uv_idle_t* handle)
+{
+    for (int i = 0; i < mem_batch && mem_injected < mem_events;
+            ++i, ++mem_injected)
+    {
+        mem_repo* r = &mem_repos[bench_random(&mem_rng) %
+            (uint64_t)mem_repo_count];
+
+        if ((int)(bench_random(&mem_rng) % 100) < mem_new_percent)
+        {
+            mem_add_file(r, r->dirs[bench_random(&mem_rng) %
+                    (uint64_t)r->dir_count], mem_files + r->file_count);
+            continue;
+        }
+
+        char* full = mem_join(r->repo->path,
+                r->files[bench_random(&mem_rng) % (uint64_t)r->file_count]);
+        memfs_write(full);
+        free(full);
+    }
+
+    if (mem_injected < mem_events)
+        return;
+
+    // whatever is still pending is committed right away
+    uv_idle_stop(handle);
+    mem_inject_end = uv_hrtime();
+    for (int i = 0; i < mem_repo_count; ++i)
+        fs_listener_flush(mem_repos[i].repo);
+    uv_timer_start(&mem_check, check_cb, CHECK_MS, CHECK_MS);
+}
+
+void mem_close_handle(uv_handle_t* handle, void* arg)
+{
+    (void)arg;
+    if (!uv_is_closing(handle))
+        uv_close(handle, NULL);
+}
+
+void mem_report()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double inject_s = (double)(mem_inject_end - mem_start) / 1e9;
+    double total_s = (double)(mem_end - mem_start) / 1e9;
+
+    unsigned long commits = 0;
+    uint64_t service = 0;
+    uint64_t service_max = 0;
+    uint64_t wait = 0;
+    for (int i = 0; i < mem_repo_count; ++i)
+    {
+        commit_queue_stats stats;
+        commit_queue_get_stats(&mem_repos[i].repo->queue, &stats);
+        commits += stats.jobs;
+        service += stats.service_total;
+        wait += stats.wait_total;
+        if (stats.service_max > service_max)
+            service_max = stats.service_max;
+    }
+
+    fprintf(stderr, "%lld events in %.3fs, %.0f events/s\n", mem_injected,
+            inject_s, inject_s > 0 ? (double)mem_injected / inject_s : 0.0);
+    fprintf(stderr, "%lu commits in %.3fs, %.2f ms on average (max %.2f ms), "
+            "%.2f ms waiting for a thread\n", commits, total_s,
+            commits ? (double)service / (double)commits / 1e6 : 0.0,
+            (double)service_max / 1e6,
+            commits ? (double)wait / (double)commits / 1e6 : 0.0);
+    fprintf(stderr, "CPU time: %.2fs user, %.2fs system, peak RSS %ld kB\n",
+            (double)usage.ru_utime.tv_sec +
+            (double)usage.ru_utime.tv_usec / 1e6,
+            (double)usage.ru_stime.tv_sec +
+            (double)usage.ru_stime.tv_usec / 1e6, usage.ru_maxrss);
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc || !mem_pair(argv[i], argv[i+1]))
+        {
+            mem_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // nothing is on disk, so there is no state to save or start from
+    char timeout[16];
+    snprintf(timeout, sizeof(timeout), "%d", mem_timeout);
+    char* gwatch_argv[] = { "gwatch", "-t", timeout, "--warm-start", "off",
+        NULL };
+    if (!parse_args(5, gwatch_argv))
+        return -1;
+
+    git_libgit2_init();
+    mem_rng = mem_seed;
+    mem_repos = calloc((size_t)mem_repo_count, sizeof(mem_repo));
+    for (int i = 0; i < mem_repo_count; ++i)
+    {
+        if (!mem_repo_init(&mem_repos[i], i))
+        {
+            fprintf(stderr, "Cannot create an in-memory repository\n");
+            return -1;
+        }
+    }
+
+    // gwatch's own log goes to stdout, the report to stderr
+    logs_start(false);
+    uv_loop_init(&mem_loop);
+    commit_worker_start(&mem_loop, get_workers());
+    fs_listener_init(&mem_loop, mem_commit);
+    for (int i = 0; i < mem_repo_count; ++i)
+        fs_listener_add(mem_repos[i].repo, true);
+
+    uv_timer_init(&mem_loop, &mem_check);
+    uv_idle_init(&mem_loop, &mem_inject);
+    uv_idle_start(&mem_inject, inject_cb);
+    mem_start = uv_hrtime();
+    uv_run(&mem_loop, UV_RUN_DEFAULT);
+
+    commit_worker_stop();
+    uv_walk(&mem_loop, mem_close_handle, NULL);
+    uv_run(&mem_loop, UV_RUN_DEFAULT);
+    uv_loop_close(&mem_loop);
+    logs_stop();
+
+    mem_report();
+
+    for (int i = 0; i < mem_repo_count; ++i)
+        mem_repo_free(&mem_repos[i]);
+    free(mem_repos);
+    repos_free();
+    memfs_clear();
+    git_libgit2_shutdown();
+    return 0;
+}
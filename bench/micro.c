@@ -0,0 +1,503 @@
+#define _XOPEN_SOURCE 700
+
+#include "budget.h"
+#include "counters.h"
+#include "tree_gen.h"
+#include "../args.h"
+#include "../fs_oper.h"
+#include "../git.h"
+#include "../repos.h"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define NS_PER_MS 1000000.0
+
+enum
+{
+    MICRO_WATCH,
+    MICRO_STATUS_INITIAL,
+    MICRO_STATUS_FULL,
+    MICRO_STATUS_PATHS,
+    MICRO_STATUS_BULK,
+    MICRO_COUNT
+};
+
+const char* micro_names[MICRO_COUNT] = {
+    "watch", "status_initial", "status_full", "status_paths", "status_bulk"
+};
+
+typedef struct micro_sample
+{
+    uint64_t ns;
+    sys_counters counters; // peak_bytes relative to the start
+    int64_t retained_bytes; // still allocated at the end
+    int64_t rss_bytes; // growth of the resident set
+} micro_sample;
+
+typedef struct micro_result
+{
+    micro_sample* samples;
+    int count;
+} micro_result;
+
+int micro_dirs = 1000;
+int micro_files_per_dir = 10;
+int micro_ignored = 0; // % of the directories
+int micro_depth = 6;
+int micro_file_size = 256;
+int micro_runs = 5;
+int micro_bulk = 0; // new files per bulk import, 0 skips it
+long int micro_seed = 42;
+const char* micro_workdir = NULL;
+const char* micro_json = NULL;
+const char* micro_budget = NULL;
+const char* micro_scenario = NULL;
+bool micro_check_time = false;
+bool micro_keep = false;
+
+micro_result micro_results[MICRO_COUNT];
+const micro_sample* micro_medians[MICRO_COUNT];
+
+void micro_usage(const char* name)
+{
+    printf("Usage: %s [--dirs count] [--files-per-dir count] "
+           "[--ignored percent]\n"
+           "    [--depth levels] [--file-size bytes] [--runs count] "
+           "[--bulk count]\n"
+           "    [--seed number] [--workdir path] [--keep on|off] "
+           "[--json path/to/results.json]\n"
+           "    [--budget path/to/budgets.txt --scenario name] "
+           "[--check-time on|off]\n", name);
+}
+
+bool micro_int(const char* value, long int min, long int max, int* out)
+{
+    char* end = NULL;
+    long int v = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || v < min || v > max)
+        return false;
+
+    *out = (int)v;
+    return true;
+}
+
+bool micro_pair(const char* name, const char* value)
+{
+    int seed;
+
+    if (strcmp(name, "--dirs") == 0)
+        return micro_int(value, 1, 10000000, &micro_dirs);
+    else if (strcmp(name, "--files-per-dir") == 0)
+        return micro_int(value, 0, 100000, &micro_files_per_dir);
+    else if (strcmp(name, "--ignored") == 0)
+        return micro_int(value, 0, 100, &micro_ignored);
+    else if (strcmp(name, "--depth") == 0)
+        return micro_int(value, 1, 100, &micro_depth);
+    else if (strcmp(name, "--file-size") == 0)
+        return micro_int(value, 0, 100000000, &micro_file_size);
+    else if (strcmp(name, "--runs") == 0)
+        return micro_int(value, 1, 10000, &micro_runs);
+    else if (strcmp(name, "--bulk") == 0)
+        return micro_int(value, 0, 10000000, &micro_bulk);
+    else if (strcmp(name, "--seed") == 0)
+    {
+        if (!micro_int(value, 1, 0x7fffffffL, &seed))
+            return false;
+        micro_seed = seed;
+    }
+    else if (strcmp(name, "--workdir") == 0)
+        micro_workdir = value;
+    else if (strcmp(name, "--json") == 0)
+        micro_json = value;
+    else if (strcmp(name, "--budget") == 0)
+        micro_budget = value;
+    else if (strcmp(name, "--scenario") == 0)
+        micro_scenario = value;
+    else if (strcmp(name, "--check-time") == 0)
+    {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)
+            return false;
+        micro_check_time = strcmp(value, "on") == 0;
+    }
+    else if (strcmp(name, "--keep") == 0)
+    {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)
+            return false;
+        micro_keep = strcmp(value, "on") == 0;
+    }
+    else
+        return false;
+
+    return true;
+}
+
+int64_t resident_bytes()
+{
+    size_t rss = 0;
+    uv_resident_set_memory(&rss);
+    return (int64_t)rss;
+}
+
+typedef struct micro_clock
+{
+    uint64_t start;
+    int64_t live_bytes;
+    int64_t rss_bytes;
+} micro_clock;
+
+void micro_start(micro_clock* clock)
+{
+    counters_reset();
+    sys_counters c;
+    counters_read(&c);
+    clock->live_bytes = c.live_bytes;
+    clock->rss_bytes = resident_bytes();
+    clock->start = uv_hrtime();
+}
+
+void micro_stop(int bench, const micro_clock* clock)
+{
+    micro_sample s;
+    s.ns = uv_hrtime() - clock->start;
+    counters_read(&s.counters);
+    s.counters.peak_bytes -= clock->live_bytes;
+    s.retained_bytes = s.counters.live_bytes - clock->live_bytes;
+    s.rss_bytes = resident_bytes() - clock->rss_bytes;
+
+    micro_result* r = &micro_results[bench];
+    r->samples = realloc(r->samples,
+            (size_t)(r->count + 1) * sizeof(micro_sample));
+    r->samples[r->count++] = s;
+}
+
+void micro_fs_cb(watched_repo* repo, const char* path, int events)
+{
+    (void)repo;
+    (void)path;
+    (void)events;
+}
+
+void micro_close_cb(uv_handle_t* handle, void* arg)
+{
+    (void)arg;
+    if (!uv_is_closing(handle))
+        uv_close(handle, NULL);
+}
+
+// watches are registered and torn down again, every run starts from nothing
+void bench_watch(const char* root)
+{
+    for (int i = 0; i < micro_runs; ++i)
+    {
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        watched_repo* repo = repos_add(root);
+
+        micro_clock clock;
+        micro_start(&clock);
+        fs_listener_start_impl(&loop, repo, micro_fs_cb);
+        micro_stop(MICRO_WATCH, &clock);
+
+        fs_listener_stop_impl(repo);
+        uv_walk(&loop, micro_close_cb, NULL);
+        uv_run(&loop, UV_RUN_DEFAULT);
+        uv_loop_close(&loop);
+        repos_remove(repo);
+    }
+}
+
+bool micro_commit(int bench, watched_repo* repo)
+{
+    micro_clock clock;
+    micro_start(&clock);
+    commit(repo);
+    micro_stop(bench, &clock);
+
+    path_map_clear(&repo->commit_paths);
+    return repo->commit_result != COMMIT_FAILED;
+}
+
+bool bench_status(const char* root, tree_info* info)
+{
+    watched_repo* repo = repos_add(root);
+    uint64_t rng = (uint64_t)micro_seed + 1;
+    char path[4096];
+
+    // the first commit hashes and stores everything
+    repo->commit_full_scan = true;
+    bool ok = micro_commit(MICRO_STATUS_INITIAL, repo);
+
+    // nothing changed, the whole tree is compared with the index
+    for (int i = 0; ok && i < micro_runs; ++i)
+    {
+        repo->commit_full_scan = true;
+        ok = micro_commit(MICRO_STATUS_FULL, repo);
+    }
+
+    // a single changed file, as reported by the watcher
+    for (int i = 0; ok && i < micro_runs && info->file_count > 0; ++i)
+    {
+        const char* rel =
+            info->files[bench_random(&rng) % (uint64_t)info->file_count];
+        snprintf(path, sizeof(path), "%s/%s", root, rel);
+        if (!write_random_file(path, (size_t)micro_file_size + 1 + (size_t)i,
+                    &rng))
+            return false;
+
+        repo->commit_full_scan = false;
+        path_map_add(&repo->commit_paths, rel, NULL);
+        ok = micro_commit(MICRO_STATUS_PATHS, repo);
+    }
+
+    // a folder of new files copied in, the watcher reports just the folder
+    for (int i = 0; ok && i < micro_runs && micro_bulk > 0; ++i)
+    {
+        char dir[64];
+        snprintf(dir, sizeof(dir), "bulk%d", i);
+        snprintf(path, sizeof(path), "%s/%s", root, dir);
+        if (mkdir(path, 0755) < 0)
+            return false;
+
+        for (int j = 0; j < micro_bulk; ++j)
+        {
+            snprintf(path, sizeof(path), "%s/%s/f%d.txt", root, dir, j);
+            if (!write_random_file(path, (size_t)micro_file_size, &rng))
+                return false;
+        }
+
+        repo->commit_full_scan = false;
+        path_map_add(&repo->commit_paths, dir, NULL);
+        ok = micro_commit(MICRO_STATUS_BULK, repo);
+    }
+
+    repos_remove(repo);
+    return ok;
+}
+
+int compare_sample(const void* a, const void* b)
+{
+    uint64_t x = ((const micro_sample*)a)->ns;
+    uint64_t y = ((const micro_sample*)b)->ns;
+    return x < y ? -1 : x > y;
+}
+
+// the run with the median time, with its own counters
+const micro_sample* median_sample(micro_result* r)
+{
+    if (r->count == 0)
+        return NULL;
+
+    qsort(r->samples, (size_t)r->count, sizeof(micro_sample), compare_sample);
+    return &r->samples[r->count / 2];
+}
+
+bool micro_metric(const char* bench, const char* metric, double* value)
+{
+    const micro_sample* s = NULL;
+    for (int i = 0; i < MICRO_COUNT; ++i)
+    {
+        if (strcmp(bench, micro_names[i]) == 0)
+            s = micro_medians[i];
+    }
+    if (!s)
+        return false;
+
+    if (strcmp(metric, "ms") == 0)
+        *value = (double)s->ns / NS_PER_MS;
+    else if (strcmp(metric, "syscalls") == 0)
+        *value = (double)s->counters.syscalls;
+    else if (strcmp(metric, "allocations") == 0)
+        *value = (double)s->counters.allocations;
+    else if (strcmp(metric, "peak_bytes") == 0)
+        *value = (double)s->counters.peak_bytes;
+    else
+        return false;
+
+    return true;
+}
+
+void print_micro_results(int dir_count, int file_count)
+{
+    double per_k = 1000.0 / (double)dir_count;
+    const micro_sample* const* samples = micro_medians;
+
+    printf("tree: %d directories (%d%% ignored), %d files\n", dir_count,
+            micro_ignored, file_count);
+    printf("%-15s %4s %10s %10s %10s %10s %10s %10s %10s %10s\n", "benchmark",
+            "runs", "ms", "ms/1k", "syscalls", "calls/1k", "allocs",
+            "peak KB", "kept KB", "KB/1k");
+    for (int i = 0; i < MICRO_COUNT; ++i)
+    {
+        const micro_sample* s = samples[i];
+        if (!s)
+            continue;
+
+        double ms = (double)s->ns / NS_PER_MS;
+        double kept = (double)s->retained_bytes / 1024.0;
+        printf("%-15s %4d %10.2f %10.2f %10llu %10.0f %10llu %10.0f "
+                "%10.0f %10.1f\n", micro_names[i], micro_results[i].count,
+                ms, ms * per_k, (unsigned long long)s->counters.syscalls,
+                (double)s->counters.syscalls * per_k,
+                (unsigned long long)s->counters.allocations,
+                (double)s->counters.peak_bytes / 1024.0, kept, kept * per_k);
+    }
+
+    if (!micro_json)
+        return;
+
+    FILE* f = fopen(micro_json, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot write %s\n", micro_json);
+        return;
+    }
+
+    fprintf(f, "{\"tree\":{\"dirs\":%d,\"ignored_percent\":%d,\"files\":%d},"
+            "\"benchmarks\":{", dir_count, micro_ignored, file_count);
+    bool first = true;
+    for (int i = 0; i < MICRO_COUNT; ++i)
+    {
+        const micro_sample* s = samples[i];
+        if (!s)
+            continue;
+
+        fprintf(f, "%s\"%s\":{\"runs\":%d,\"ms\":%.3f,\"syscalls\":%llu,"
+                "\"allocations\":%llu,\"allocated_bytes\":%llu,"
+                "\"peak_bytes\":%lld,\"retained_bytes\":%lld,"
+                "\"rss_bytes\":%lld}", first ? "" : ",", micro_names[i],
+                micro_results[i].count, (double)s->ns / NS_PER_MS,
+                (unsigned long long)s->counters.syscalls,
+                (unsigned long long)s->counters.allocations,
+                (unsigned long long)s->counters.allocated_bytes,
+                (long long)s->counters.peak_bytes,
+                (long long)s->retained_bytes, (long long)s->rss_bytes);
+        first = false;
+    }
+    fprintf(f, "}}\n");
+    fclose(f);
+}
+
+int micro_remove_cb(const char* path, const struct stat* sb, int type,
+        struct FTW* ftw)
+{
+    (void)sb;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+// the ignored share of the directories goes below build/, which is listed in
+// .gitignore but still watched
+bool make_tree(const char* root, tree_info* info, int* dir_count)
+{
+    char path[4096];
+    int ignored = micro_dirs * micro_ignored / 100;
+    tree_spec spec = { micro_dirs - ignored, 0, micro_depth,
+        (size_t)micro_file_size, (size_t)micro_file_size, false,
+        (uint64_t)micro_seed };
+    spec.files = spec.dirs * micro_files_per_dir;
+
+    if (!tree_generate(root, &spec, info))
+        return false;
+    *dir_count = info->dir_count;
+
+    if (ignored > 0)
+    {
+        tree_info ignored_info;
+        snprintf(path, sizeof(path), "%s/build", root);
+        if (mkdir(path, 0755) < 0)
+            return false;
+
+        spec.dirs = ignored;
+        spec.files = ignored * micro_files_per_dir;
+        bool ok = tree_generate(path, &spec, &ignored_info);
+        *dir_count += ignored_info.dir_count;
+        tree_info_free(&ignored_info);
+
+        snprintf(path, sizeof(path), "%s/.gitignore", root);
+        FILE* f = fopen(path, "w");
+        if (!ok || !f || fputs("/build/\n", f) < 0)
+            ok = false;
+        if (f)
+            fclose(f);
+        if (!ok)
+            return false;
+    }
+
+    git_repository* repo = NULL;
+    if (git_repository_init(&repo, root, false) < 0)
+        return false;
+    git_repository_free(repo);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc || !micro_pair(argv[i], argv[i+1]))
+        {
+            micro_usage(argv[0]);
+            return -1;
+        }
+    }
+    if (micro_budget && !micro_scenario)
+    {
+        micro_usage(argv[0]);
+        return -1;
+    }
+
+    char root[4096];
+    uv_fs_t req;
+    const char* tmp = micro_workdir ? micro_workdir : getenv("TMPDIR");
+    snprintf(root, sizeof(root), "%s/gwatch_micro_XXXXXX", tmp ? tmp : "/tmp");
+    if (uv_fs_mkdtemp(NULL, &req, root, NULL) < 0)
+    {
+        fprintf(stderr, "Cannot create a directory in %s\n", tmp ? tmp : "/tmp");
+        return -1;
+    }
+    snprintf(root, sizeof(root), "%s", req.path);
+    uv_fs_req_cleanup(&req);
+
+    // the commit path runs with gwatch's default options, and with the
+    // hash cache of the warm start
+    char* gwatch_argv[] = { "gwatch", "--warm-start", "on", NULL };
+    parse_args(3, gwatch_argv);
+    git_libgit2_init();
+
+    tree_info info;
+    int dir_count = 0;
+    bool ok = make_tree(root, &info, &dir_count);
+    if (!ok)
+        fprintf(stderr, "Cannot generate the tree in %s\n", root);
+
+    if (ok)
+    {
+        bench_watch(root);
+        ok = bench_status(root, &info);
+        for (int i = 0; i < MICRO_COUNT; ++i)
+            micro_medians[i] = median_sample(&micro_results[i]);
+        print_micro_results(dir_count,
+                micro_dirs * micro_files_per_dir);
+    }
+
+    if (ok && micro_budget)
+    {
+        ok = budget_check(micro_budget, micro_scenario, micro_metric,
+                micro_check_time);
+    }
+
+    tree_info_free(&info);
+    for (int i = 0; i < MICRO_COUNT; ++i)
+        free(micro_results[i].samples);
+    git_libgit2_shutdown();
+
+    if (!micro_keep)
+        nftw(root, micro_remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,363 @@
+#define _XOPEN_SOURCE 700
+
+#include "driver.h"
+#include "tree_gen.h"
+#include "../path_map.h"
+#include "../recorder.h"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define NS_PER_S 1000000000ULL
+
+const char* replay_gwatch = GWATCH_PATH;
+const char* replay_recording = NULL;
+const char* replay_source = NULL;
+const char* replay_workdir = NULL;
+const char* replay_json = NULL;
+bool replay_fast = false;
+bool replay_keep = false;
+int replay_timeout = 1; // s
+char** replay_extra = NULL;
+int replay_extra_count = 0;
+
+typedef struct replay_stats
+{
+    unsigned long events;
+    unsigned long replayed;
+    unsigned long writes;
+    unsigned long removes;
+    unsigned long dirs;
+    uint64_t recorded_ns;
+} replay_stats;
+
+void replay_usage(const char* name)
+{
+    printf("Usage: %s --recording path/to/recording "
+           "[--source recorded/repo/path]\n"
+           "    [--speed recorded|fast] [--gwatch path/to/gwatch] "
+           "[--timeout s]\n"
+           "    [--workdir path] [--keep on|off] "
+           "[--json path/to/results.json] [-- gwatch_args...]\n", name);
+}
+
+bool replay_pair(const char* name, const char* value)
+{
+    if (strcmp(name, "--recording") == 0)
+        replay_recording = value;
+    else if (strcmp(name, "--source") == 0)
+        replay_source = value;
+    else if (strcmp(name, "--gwatch") == 0)
+        replay_gwatch = value;
+    else if (strcmp(name, "--workdir") == 0)
+        replay_workdir = value;
+    else if (strcmp(name, "--json") == 0)
+        replay_json = value;
+    else if (strcmp(name, "--speed") == 0)
+    {
+        if (strcmp(value, "recorded") != 0 && strcmp(value, "fast") != 0)
+            return false;
+        replay_fast = strcmp(value, "fast") == 0;
+    }
+    else if (strcmp(name, "--keep") == 0)
+    {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)
+            return false;
+        replay_keep = strcmp(value, "on") == 0;
+    }
+    else if (strcmp(name, "--timeout") == 0)
+    {
+        char* end = NULL;
+        long int v = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || v < 1 || v > 100000)
+            return false;
+        replay_timeout = (int)v;
+    }
+    else
+        return false;
+
+    return true;
+}
+
+bool replay_args(int argc, char* argv[])
+{
+    int i = 1;
+    for (; i < argc && strcmp(argv[i], "--") != 0; i += 2)
+    {
+        if (i + 1 >= argc || !replay_pair(argv[i], argv[i+1]))
+            return false;
+    }
+
+    if (i < argc)
+    {
+        replay_extra = argv + i + 1;
+        replay_extra_count = argc - i - 1;
+    }
+
+    return replay_recording != NULL;
+}
+
+int replay_remove_cb(const char* path, const struct stat* sb, int type,
+        struct FTW* ftw)
+{
+    (void)sb;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+void remove_tree(const char* path)
+{
+    nftw(path, replay_remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// creates the missing parents of path, like mkdir -p
+void make_parents(const char* path, size_t root_len)
+{
+    char buf[4096];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char* it = buf + root_len + 1; (it = strchr(it, '/')) != NULL; ++it)
+    {
+        *it = '\0';
+        mkdir(buf, 0755);
+        *it = '/';
+    }
+}
+
+// the recording has only content ids and sizes, a changed id is replayed as
+// new content of the same size
+bool apply_event(const char* root, const recorded_event* event,
+        path_map* written, replay_stats* stats, bool* is_file,
+        git_oid* expected)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, event->path);
+    *is_file = false;
+
+    switch (event->kind)
+    {
+        case RECORDED_MISSING:
+        {
+            git_oid* last = path_map_get(written, event->path);
+            path_map_remove(written, event->path);
+            free(last);
+            remove_tree(path);
+            ++stats->removes;
+            *is_file = true;
+            return true;
+        }
+        case RECORDED_DIR:
+            make_parents(path, strlen(root));
+            mkdir(path, 0755);
+            ++stats->dirs;
+            return true;
+        case RECORDED_FILE:
+        {
+            git_oid* last = path_map_get(written, event->path);
+            if (last && git_oid_equal(last, &event->id))
+                return true;
+
+            uint64_t rng;
+            memcpy(&rng, event->id.id, sizeof(rng));
+            rng |= 1;
+            make_parents(path, strlen(root));
+            if (!write_random_file(path, (size_t)event->size, &rng) ||
+                    git_odb_hashfile(expected, path, GIT_OBJ_BLOB) < 0)
+            {
+                fprintf(stderr, "Cannot write %s\n", path);
+                return false;
+            }
+
+            if (!last)
+            {
+                last = malloc(sizeof(git_oid));
+                path_map_add(written, event->path, last);
+            }
+            git_oid_cpy(last, &event->id);
+            ++stats->writes;
+            *is_file = true;
+            return true;
+        }
+        case RECORDED_OTHER:
+        default:
+            return true;
+    }
+}
+
+void print_replay(const replay_stats* stats, double replay_s,
+        double latency_ms, unsigned long commits, const struct rusage* usage)
+{
+    double user = (double)usage->ru_utime.tv_sec +
+        (double)usage->ru_utime.tv_usec / 1e6;
+    double sys = (double)usage->ru_stime.tv_sec +
+        (double)usage->ru_stime.tv_usec / 1e6;
+    double recorded_s = (double)stats->recorded_ns / (double)NS_PER_S;
+    double minutes = replay_s / 60.0;
+
+    printf("events: %lu recorded, %lu replayed (%lu writes, %lu removals, "
+            "%lu directories)\n", stats->events, stats->replayed,
+            stats->writes, stats->removes, stats->dirs);
+    printf("duration: %.2fs recorded, %.2fs replayed\n", recorded_s,
+            replay_s);
+    printf("last change committed after %.1f ms\n", latency_ms);
+    printf("commits: %lu (%.1f per minute)\n", commits,
+            minutes > 0 ? (double)commits / minutes : 0.0);
+    printf("gwatch CPU time: %.2fs user, %.2fs system, peak RSS %ld kB\n",
+            user, sys, usage->ru_maxrss);
+
+    if (!replay_json)
+        return;
+
+    FILE* f = fopen(replay_json, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot write %s\n", replay_json);
+        return;
+    }
+
+    fprintf(f, "{\"events\":%lu,\"replayed\":%lu,\"writes\":%lu,"
+            "\"removes\":%lu,\"dirs\":%lu,\"recorded_s\":%.3f,"
+            "\"replayed_s\":%.3f,\"last_commit_ms\":%.3f,\"commits\":%lu,"
+            "\"commits_per_minute\":%.3f,\"cpu_user_s\":%.3f,"
+            "\"cpu_system_s\":%.3f,\"peak_rss_kb\":%ld}\n", stats->events,
+            stats->replayed, stats->writes, stats->removes, stats->dirs,
+            recorded_s, replay_s, latency_ms, commits,
+            minutes > 0 ? (double)commits / minutes : 0.0, user, sys,
+            usage->ru_maxrss);
+    fclose(f);
+}
+
+int main(int argc, char* argv[])
+{
+    if (!replay_args(argc, argv))
+    {
+        replay_usage(argv[0]);
+        return -1;
+    }
+
+    recording rec;
+    if (!recording_open(&rec, replay_recording))
+    {
+        fprintf(stderr, "Cannot read the recording %s\n", replay_recording);
+        return -1;
+    }
+
+    char root[4096];
+    uv_fs_t req;
+    const char* tmp = replay_workdir ? replay_workdir : getenv("TMPDIR");
+    snprintf(root, sizeof(root), "%s/gwatch_replay_XXXXXX",
+            tmp ? tmp : "/tmp");
+    if (uv_fs_mkdtemp(NULL, &req, root, NULL) < 0)
+    {
+        fprintf(stderr, "Cannot create a directory in %s\n",
+                tmp ? tmp : "/tmp");
+        recording_close(&rec);
+        return -1;
+    }
+    snprintf(root, sizeof(root), "%s", req.path);
+    uv_fs_req_cleanup(&req);
+
+    git_libgit2_init();
+
+    bench_driver d;
+    bool ok = driver_start(&d, replay_gwatch, root, replay_timeout,
+            replay_extra, replay_extra_count);
+
+    replay_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    path_map written;
+    path_map_init(&written);
+    char* source = NULL;
+    char* last_path = NULL;
+    git_oid last_id;
+    bool last_exists = false;
+    uint64_t start = uv_hrtime();
+    uint64_t first = 0;
+    uint64_t last_change = start;
+
+    recorded_event event;
+    while (ok && recording_next(&rec, &event))
+    {
+        ++stats.events;
+        stats.recorded_ns = event.time;
+
+        // only one repository of the recording is replayed
+        if (!source)
+        {
+            if (replay_source && strcmp(event.repo, replay_source) != 0)
+                continue;
+            source = malloc(strlen(event.repo) + 1);
+            strcpy(source, event.repo);
+            first = event.time;
+        }
+        else if (strcmp(event.repo, source) != 0)
+            continue;
+
+        if (!replay_fast && !driver_sleep_until(&d, start + event.time - first))
+            break;
+
+        bool is_file;
+        git_oid id;
+        ok = apply_event(root, &event, &written, &stats, &is_file, &id);
+        ++stats.replayed;
+
+        // the last file change is the one to wait for
+        if (ok && is_file)
+        {
+            free(last_path);
+            last_path = malloc(strlen(event.path) + 1);
+            strcpy(last_path, event.path);
+            last_exists = event.kind == RECORDED_FILE;
+            last_id = id;
+            last_change = uv_hrtime();
+        }
+    }
+
+    if (ok && recording_error(&rec))
+    {
+        fprintf(stderr, "The recording %s is damaged\n", replay_recording);
+        ok = false;
+    }
+
+    uint64_t latency = 0;
+    if (ok && last_path && !driver_wait_commit(&d, last_path,
+                last_exists ? &last_id : NULL, last_change,
+                ((uint64_t)replay_timeout + 120) * NS_PER_S, &latency))
+    {
+        fprintf(stderr, "%s was not committed in time\n", last_path);
+        ok = false;
+    }
+
+    double replay_s = (double)(uv_hrtime() - start) / (double)NS_PER_S;
+    unsigned long commits = driver_count_commits(&d);
+    if (!driver_stop(&d))
+    {
+        fprintf(stderr, "gwatch exited with status %lld\n",
+                (long long)d.exit_status);
+        ok = false;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    print_replay(&stats, replay_s, (double)latency / 1e6, commits, &usage);
+
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (path_map_next(&written, &it, &path, &value))
+        free(value);
+    path_map_free(&written);
+    free(last_path);
+    free(source);
+    recording_close(&rec);
+    git_libgit2_shutdown();
+
+    if (!replay_keep)
+        remove_tree(root);
+
+    return ok ? 0 : -1;
+}
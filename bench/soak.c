@@ -0,0 +1,476 @@
+#define _XOPEN_SOURCE 700
+
+#include "tree_gen.h"
+#include "../args.h"
+#include "../commit_worker.h"
+#include "../fs_listener.h"
+#include "../git.h"
+#include "../logs.h"
+#include "../mem_governor.h"
+#include "../repos.h"
+
+#include <dirent.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define STEP_MS 1
+
+typedef struct soak_sample
+{
+    unsigned long cycle;
+    double rss_kb;
+    double fds;
+    double handles;
+    double cache_kb; // libgit2's object cache
+} soak_sample;
+
+enum
+{
+    SOAK_WAIT_COMMIT,
+    SOAK_SETTLE
+};
+
+unsigned long soak_cycles = 1000000;
+int soak_writes = 1; // files changed per cycle
+int soak_dir_churn = 100; // cycles between adding and removing a folder
+unsigned long soak_sample_every = 0; // 0 means 200 samples in total
+int soak_warmup = 10; // % of the cycles left out of the slopes
+double max_rss_slope = 8.0; // kB per 1000 cycles
+double max_fd_slope = 0.01; // per 1000 cycles
+double max_handle_slope = 0.01;
+double max_cache_slope = 8.0; // kB per 1000 cycles
+const char* soak_workdir = NULL;
+const char* soak_csv = NULL;
+bool soak_keep = false;
+char** soak_extra = NULL;
+int soak_extra_count = 0;
+tree_spec soak_spec = { 200, 2000, 5, 64, 4096, true, 42 };
+
+uv_loop_t soak_loop;
+uv_timer_t soak_step;
+watched_repo* soak_repo = NULL;
+tree_info soak_tree;
+char soak_root[4096];
+uint64_t soak_rng;
+int soak_state = SOAK_WAIT_COMMIT;
+unsigned long soak_done = 0; // completed cycles
+bool soak_started = false; // the initial commit is done
+soak_sample* soak_samples = NULL;
+size_t soak_sample_count = 0;
+
+void soak_usage(const char* name)
+{
+    printf("Usage: %s [--cycles count] [--writes files_per_cycle] "
+           "[--dir-churn cycles]\n"
+           "    [--dirs count] [--files count] [--sample-every cycles] "
+           "[--warmup percent]\n"
+           "    [--max-rss-slope kB_per_1k_cycles] "
+           "[--max-fd-slope fds_per_1k_cycles]\n"
+           "    [--max-handle-slope handles_per_1k_cycles] "
+           "[--max-cache-slope kB_per_1k_cycles]\n"
+           "    [--workdir path] [--keep on|off] [--csv path/to/samples.csv]\n"
+           "    [-- gwatch_args...]\n", name);
+}
+
+bool soak_number(const char* value, double min, double max, double* out)
+{
+    char* end = NULL;
+    double v = strtod(value, &end);
+    if (end == value || *end != '\0' || v < min || v > max)
+        return false;
+
+    *out = v;
+    return true;
+}
+
+bool soak_pair(const char* name, const char* value)
+{
+    if (strcmp(name, "--workdir") == 0)
+        soak_workdir = value;
+    else if (strcmp(name, "--csv") == 0)
+        soak_csv = value;
+    else if (strcmp(name, "--keep") == 0)
+    {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)
+            return false;
+        soak_keep = strcmp(value, "on") == 0;
+    }
+    else if (strcmp(name, "--max-rss-slope") == 0)
+        return soak_number(value, 0, 1e12, &max_rss_slope);
+    else if (strcmp(name, "--max-fd-slope") == 0)
+        return soak_number(value, 0, 1e12, &max_fd_slope);
+    else if (strcmp(name, "--max-handle-slope") == 0)
+        return soak_number(value, 0, 1e12, &max_handle_slope);
+    else if (strcmp(name, "--max-cache-slope") == 0)
+        return soak_number(value, 0, 1e12, &max_cache_slope);
+    else
+    {
+        char* end = NULL;
+        long int n = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || n < 0 || n > 1000000000L)
+            return false;
+
+        if (strcmp(name, "--cycles") == 0 && n >= 1)
+            soak_cycles = (unsigned long)n;
+        else if (strcmp(name, "--writes") == 0 && n >= 1)
+            soak_writes = (int)n;
+        else if (strcmp(name, "--dir-churn") == 0)
+            soak_dir_churn = (int)n;
+        else if (strcmp(name, "--dirs") == 0 && n >= 1)
+            soak_spec.dirs = (int)n;
+        else if (strcmp(name, "--files") == 0 && n >= 1)
+            soak_spec.files = (int)n;
+        else if (strcmp(name, "--sample-every") == 0 && n >= 1)
+            soak_sample_every = (unsigned long)n;
+        else if (strcmp(name, "--warmup") == 0 && n <= 90)
+            soak_warmup = (int)n;
+        else
+            return false;
+    }
+
+    return true;
+}
+
+int count_fds()
+{
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir)
+        return -1;
+
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+            ++count;
+    }
+    closedir(dir);
+
+    // not counting the one of the directory itself
+    return count - 1;
+}
+
+void count_handle(uv_handle_t* handle, void* arg)
+{
+    (void)handle;
+    ++*(int*)arg;
+}
+
+void take_sample()
+{
+    soak_sample s;
+    size_t rss = 0;
+    ssize_t cached = 0;
+    ssize_t allowed = 0;
+    int handles = 0;
+
+    uv_resident_set_memory(&rss);
+    git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &cached, &allowed);
+    uv_walk(&soak_loop, count_handle, &handles);
+
+    s.cycle = soak_done;
+    s.rss_kb = (double)rss / 1024.0;
+    s.fds = count_fds();
+    s.handles = handles;
+    s.cache_kb = (double)cached / 1024.0;
+
+    soak_samples = realloc(soak_samples,
+            (soak_sample_count + 1) * sizeof(soak_sample));
+    soak_samples[soak_sample_count++] = s;
+}
+
+void write_cycle()
+{
+    char path[8192];
+
+    for (int i = 0; i < soak_writes; ++i)
+    {
+        const char* rel = soak_tree.files[bench_random(&soak_rng) %
+            (uint64_t)soak_tree.file_count];
+        snprintf(path, sizeof(path), "%s/%s", soak_root, rel);
+        write_random_file(path, tree_pick_size(&soak_spec, &soak_rng),
+                &soak_rng);
+    }
+
+    // a new folder gets a watch and the previous one loses its watch
+    if (soak_dir_churn > 0 && soak_done % (unsigned long)soak_dir_churn == 0)
+    {
+        unsigned long n = soak_done / (unsigned long)soak_dir_churn;
+        snprintf(path, sizeof(path), "%s/churn/c%lu", soak_root, n);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/churn/c%lu/f.txt", soak_root, n);
+        write_random_file(path, 64, &soak_rng);
+
+        if (n > 0)
+        {
+            snprintf(path, sizeof(path), "%s/churn/c%lu/f.txt", soak_root,
+                    n - 1);
+            remove(path);
+            snprintf(path, sizeof(path), "%s/churn/c%lu", soak_root, n - 1);
+            remove(path);
+        }
+    }
+}
+
+void soak_shutdown_done()
+{
+    uv_stop(&soak_loop);
+}
+
+void step_cb(uv_timer_t* handle)
+{
+    (void)handle;
+
+    switch (soak_state)
+    {
+        case SOAK_WAIT_COMMIT:
+            if (soak_repo->committing)
+                return;
+
+            if (soak_started)
+                ++soak_done;
+            soak_started = true;
+            if (soak_done % soak_sample_every == 0)
+                take_sample();
+
+            if (soak_done >= soak_cycles)
+            {
+                uv_timer_stop(&soak_step);
+                fs_listener_shutdown(soak_shutdown_done);
+                return;
+            }
+
+            write_cycle();
+            soak_state = SOAK_SETTLE;
+            break;
+        case SOAK_SETTLE:
+        default:
+            // the events of the writes were read meanwhile
+            fs_listener_flush(soak_repo);
+            soak_state = SOAK_WAIT_COMMIT;
+            break;
+    }
+}
+
+enum
+{
+    SOAK_RSS,
+    SOAK_FDS,
+    SOAK_HANDLES,
+    SOAK_CACHE,
+    SOAK_METRIC_COUNT
+};
+
+const char* soak_metric_names[SOAK_METRIC_COUNT] = {
+    "RSS (kB)", "open fds", "libuv handles", "libgit2 cache (kB)"
+};
+
+double sample_value(const soak_sample* s, int metric)
+{
+    switch (metric)
+    {
+        case SOAK_RSS:
+            return s->rss_kb;
+        case SOAK_FDS:
+            return s->fds;
+        case SOAK_HANDLES:
+            return s->handles;
+        case SOAK_CACHE:
+        default:
+            return s->cache_kb;
+    }
+}
+
+// least squares over the samples after the warmup, per 1000 cycles
+double growth_slope(int metric)
+{
+    unsigned long warmup = soak_cycles * (unsigned long)soak_warmup / 100;
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+    for (size_t i = 0; i < soak_sample_count; ++i)
+    {
+        const soak_sample* s = &soak_samples[i];
+        if (s->cycle < warmup)
+            continue;
+
+        double x = (double)s->cycle / 1000.0;
+        double y = sample_value(s, metric);
+        n += 1;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    double d = n * sxx - sx * sx;
+    return n < 2 || d <= 0 ? 0.0 : (n * sxy - sx * sy) / d;
+}
+
+bool report()
+{
+    double limits[SOAK_METRIC_COUNT] = {
+        max_rss_slope, max_fd_slope, max_handle_slope, max_cache_slope
+    };
+    bool ok = true;
+
+    fprintf(stderr, "%lu cycles, %zu samples\n", soak_done,
+            soak_sample_count);
+    fprintf(stderr, "%-20s %12s %12s %14s %10s\n", "", "first", "last",
+            "slope/1k", "limit");
+    for (int m = 0; m < SOAK_METRIC_COUNT; ++m)
+    {
+        double first = soak_sample_count ?
+            sample_value(&soak_samples[0], m) : 0.0;
+        double last = soak_sample_count ?
+            sample_value(&soak_samples[soak_sample_count - 1], m) : 0.0;
+        double growth = growth_slope(m);
+        bool within = growth <= limits[m];
+
+        fprintf(stderr, "%-20s %12.1f %12.1f %14.4f %10.4f%s\n",
+                soak_metric_names[m], first, last, growth, limits[m],
+                within ? "" : "  EXCEEDED");
+        ok = ok && within;
+    }
+
+    if (soak_csv)
+    {
+        FILE* f = fopen(soak_csv, "w");
+        if (!f)
+        {
+            fprintf(stderr, "Cannot write %s\n", soak_csv);
+            return false;
+        }
+
+        fprintf(f, "cycle,rss_kb,fds,handles,cache_kb\n");
+        for (size_t i = 0; i < soak_sample_count; ++i)
+        {
+            const soak_sample* s = &soak_samples[i];
+            fprintf(f, "%lu,%.0f,%.0f,%.0f,%.0f\n", s->cycle, s->rss_kb,
+                    s->fds, s->handles, s->cache_kb);
+        }
+        fclose(f);
+    }
+
+    return ok;
+}
+
+int soak_remove_cb(const char* path, const struct stat* sb, int type,
+        struct FTW* ftw)
+{
+    (void)sb;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+void soak_close_handle(uv_handle_t* handle, void* arg)
+{
+    (void)arg;
+    if (!uv_is_closing(handle))
+        uv_close(handle, NULL);
+}
+
+int main(int argc, char* argv[])
+{
+    int i = 1;
+    for (; i < argc && strcmp(argv[i], "--") != 0; i += 2)
+    {
+        if (i + 1 >= argc || !soak_pair(argv[i], argv[i+1]))
+        {
+            soak_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // commits are flushed right away, the timer never fires; without a
+    // memory budget libgit2's cache grows up to 256MB and hides any leak
+    char** gwatch_argv = malloc((size_t)(argc + 8) * sizeof(char*));
+    int gwatch_argc = 0;
+    bool budget_given = false;
+    gwatch_argv[gwatch_argc++] = "gwatch";
+    gwatch_argv[gwatch_argc++] = "-t";
+    gwatch_argv[gwatch_argc++] = "100000";
+    gwatch_argv[gwatch_argc++] = "--workers";
+    gwatch_argv[gwatch_argc++] = "1";
+    for (++i; i < argc; ++i)
+    {
+        budget_given = budget_given || strcmp(argv[i], "--mem-budget") == 0;
+        gwatch_argv[gwatch_argc++] = argv[i];
+    }
+    if (!budget_given)
+    {
+        gwatch_argv[gwatch_argc++] = "--mem-budget";
+        gwatch_argv[gwatch_argc++] = "64";
+    }
+    gwatch_argv[gwatch_argc] = NULL;
+
+    bool parsed = parse_args(gwatch_argc, gwatch_argv);
+    free(gwatch_argv);
+    if (!parsed)
+        return -1;
+    if (soak_sample_every == 0)
+        soak_sample_every = soak_cycles >= 200 ? soak_cycles / 200 : 1;
+
+    uv_fs_t req;
+    const char* tmp = soak_workdir ? soak_workdir : getenv("TMPDIR");
+    snprintf(soak_root, sizeof(soak_root), "%s/gwatch_soak_XXXXXX",
+            tmp ? tmp : "/tmp");
+    if (uv_fs_mkdtemp(NULL, &req, soak_root, NULL) < 0)
+    {
+        fprintf(stderr, "Cannot create a directory in %s\n",
+                tmp ? tmp : "/tmp");
+        return -1;
+    }
+    snprintf(soak_root, sizeof(soak_root), "%s", req.path);
+    uv_fs_req_cleanup(&req);
+
+    git_libgit2_init();
+
+    char path[8192];
+    git_repository* git_repo = NULL;
+    snprintf(path, sizeof(path), "%s/churn", soak_root);
+    if (!tree_generate(soak_root, &soak_spec, &soak_tree) ||
+            mkdir(path, 0755) < 0 ||
+            git_repository_init(&git_repo, soak_root, false) < 0)
+    {
+        fprintf(stderr, "Cannot generate the tree in %s\n", soak_root);
+        return -1;
+    }
+    git_repository_free(git_repo);
+    soak_rng = soak_spec.seed + 1;
+
+    // gwatch's own log goes to stdout, the report to stderr
+    logs_start(false);
+    uv_loop_init(&soak_loop);
+    commit_worker_start(&soak_loop, get_workers());
+    fs_listener_init(&soak_loop, commit);
+    mem_governor_start(&soak_loop);
+
+    soak_repo = repos_add(soak_root);
+    fs_listener_add(soak_repo, true);
+
+    uv_timer_init(&soak_loop, &soak_step);
+    uv_timer_start(&soak_step, step_cb, STEP_MS, STEP_MS);
+    uv_run(&soak_loop, UV_RUN_DEFAULT);
+
+    commit_worker_stop();
+    uv_walk(&soak_loop, soak_close_handle, NULL);
+    uv_run(&soak_loop, UV_RUN_DEFAULT);
+    uv_loop_close(&soak_loop);
+    repos_free();
+    logs_stop();
+
+    bool ok = report();
+
+    tree_info_free(&soak_tree);
+    free(soak_samples);
+    git_libgit2_shutdown();
+
+    if (!soak_keep)
+        nftw(soak_root, soak_remove_cb, 64, FTW_DEPTH | FTW_PHYS);
+
+    return ok ? 0 : -1;
+}
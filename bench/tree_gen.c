@@ -0,0 +1,180 @@
+#include "tree_gen.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define WRITE_CHUNK (64 * 1024)
+#define PARETO_ALPHA 1.2
+
+char* copy_string(const char* str)
+{
+    size_t len = strlen(str);
+    char* copy = malloc(len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+// xorshift64*, the same seed always gives the same tree
+uint64_t bench_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+size_t tree_pick_size(const tree_spec* spec, uint64_t* rng)
+{
+    if (spec->size_max <= spec->size_min)
+        return spec->size_min;
+
+    if (!spec->pareto)
+        return spec->size_min +
+            (size_t)(bench_random(rng) % (spec->size_max - spec->size_min + 1));
+
+    // most files are small, a few are large, like in real source trees
+    double u = ((double)(bench_random(rng) >> 11) + 1.0) / 9007199254740993.0;
+    double size = (double)(spec->size_min ? spec->size_min : 1) /
+        pow(u, 1.0 / PARETO_ALPHA);
+    return size > (double)spec->size_max ? spec->size_max : (size_t)size;
+}
+
+// printable content, compressible about as well as text
+bool write_random_file(const char* path, size_t size, uint64_t* rng)
+{
+    static const char alphabet[] =
+        "abcdefghijklmnopqrstuvwxyz     \n0123456789{}();=";
+    char buf[WRITE_CHUNK];
+
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+
+    while (size > 0)
+    {
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        for (size_t i = 0; i < n; i += 8)
+        {
+            uint64_t r = bench_random(rng);
+            for (size_t j = i; j < i + 8 && j < n; ++j, r >>= 8)
+                buf[j] = alphabet[(r & 0xff) % (sizeof(alphabet) - 1)];
+        }
+        fwrite(buf, 1, n, f);
+        size -= n;
+    }
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+void tree_add_file(tree_info* info, const char* path)
+{
+    info->files = realloc(info->files,
+            (size_t)(info->file_count + 1) * sizeof(char*));
+    info->files[info->file_count++] = copy_string(path);
+}
+
+void add_dir(tree_info* info, const char* path)
+{
+    info->dirs = realloc(info->dirs,
+            (size_t)(info->dir_count + 1) * sizeof(char*));
+    info->dirs[info->dir_count++] = copy_string(path);
+}
+
+bool tree_generate(const char* root, const tree_spec* spec, tree_info* info)
+{
+    char rel[2048];
+    char path[4096];
+    uint64_t rng = spec->seed ? spec->seed : 1;
+    int* depths = malloc((size_t)(spec->dirs > 0 ? spec->dirs : 1) * sizeof(int));
+
+    memset(info, 0, sizeof(*info));
+    add_dir(info, "");
+    depths[0] = 0;
+
+    // every directory hangs below a random one that is not at the maximum
+    // depth yet
+    for (int i = 1; i < spec->dirs; ++i)
+    {
+        int parent;
+        do
+            parent = (int)(bench_random(&rng) % (uint64_t)info->dir_count);
+        while (depths[parent] >= spec->depth && spec->depth > 0);
+
+        const char* parent_path = info->dirs[parent];
+        if (parent_path[0])
+            snprintf(rel, sizeof(rel), "%s/d%d", parent_path, i);
+        else
+            snprintf(rel, sizeof(rel), "d%d", i);
+
+        snprintf(path, sizeof(path), "%s/%s", root, rel);
+        if (mkdir(path, 0755) < 0)
+        {
+            free(depths);
+            return false;
+        }
+
+        depths[info->dir_count] = depths[parent] + 1;
+        add_dir(info, rel);
+    }
+    free(depths);
+
+    for (int i = 0; i < spec->files; ++i)
+    {
+        const char* dir = info->dirs[bench_random(&rng) % (uint64_t)info->dir_count];
+        if (dir[0])
+            snprintf(rel, sizeof(rel), "%s/f%d.txt", dir, i);
+        else
+            snprintf(rel, sizeof(rel), "f%d.txt", i);
+
+        size_t size = tree_pick_size(spec, &rng);
+        snprintf(path, sizeof(path), "%s/%s", root, rel);
+        if (!write_random_file(path, size, &rng))
+            return false;
+
+        tree_add_file(info, rel);
+        info->bytes += size;
+    }
+
+    return true;
+}
+
+char* replace_prefix(char* path, const char* from, const char* to)
+{
+    size_t from_len = strlen(from);
+    if (strncmp(path, from, from_len) != 0 ||
+            (path[from_len] != '\0' && path[from_len] != '/'))
+        return path;
+
+    size_t to_len = strlen(to);
+    size_t rest = strlen(path + from_len);
+    char* renamed = malloc(to_len + rest + 1);
+    memcpy(renamed, to, to_len);
+    memcpy(renamed + to_len, path + from_len, rest + 1);
+    free(path);
+    return renamed;
+}
+
+void tree_rename_dir(tree_info* info, const char* from, const char* to)
+{
+    for (int i = 0; i < info->dir_count; ++i)
+        info->dirs[i] = replace_prefix(info->dirs[i], from, to);
+    for (int i = 0; i < info->file_count; ++i)
+        info->files[i] = replace_prefix(info->files[i], from, to);
+}
+
+void tree_info_free(tree_info* info)
+{
+    for (int i = 0; i < info->dir_count; ++i)
+        free(info->dirs[i]);
+    for (int i = 0; i < info->file_count; ++i)
+        free(info->files[i]);
+    free(info->dirs);
+    free(info->files);
+    memset(info, 0, sizeof(*info));
+}
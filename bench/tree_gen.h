@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct tree_spec
+{
+    int dirs; // including the root
+    int files;
+    int depth; // of the deepest directory, the root is at depth 0
+    size_t size_min; // bytes
+    size_t size_max;
+    bool pareto; // heavy-tailed sizes instead of uniform ones
+    uint64_t seed;
+} tree_spec;
+
+// paths are relative to the root of the tree
+typedef struct tree_info
+{
+    char** dirs;
+    int dir_count;
+    char** files;
+    int file_count;
+    uint64_t bytes;
+} tree_info;
+
+uint64_t bench_random(uint64_t* state);
+size_t tree_pick_size(const tree_spec* spec, uint64_t* rng);
+bool write_random_file(const char* path, size_t size, uint64_t* rng);
+bool tree_generate(const char* root, const tree_spec* spec, tree_info* info);
+void tree_add_file(tree_info* info, const char* path);
+void tree_rename_dir(tree_info* info, const char* from, const char* to);
+void tree_info_free(tree_info* info);
@@ -0,0 +1,234 @@
+#include "commit_worker.h"
+#include "args.h"
+#include "logs.h"
+#include "thread_oper.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// repositories whose commits usually take longer than this are heavy, they
+// never occupy all of the workers so that small repositories keep moving
+#define HEAVY_JOB 2000000000u // ns
+#define MAX_WORKERS 64
+
+struct commit_job
+{
+    void(*work)(void*);
+    void(*done)(void*);
+    void* data;
+    commit_queue* queue;
+    uint64_t submitted; // ns
+    struct commit_job* next;
+};
+typedef struct commit_job commit_job;
+
+uv_thread_t worker_threads[MAX_WORKERS];
+int worker_count = 0;
+int heavy_running = 0;
+uv_mutex_t worker_mutex;
+uv_cond_t worker_cond;
+uv_async_t worker_async;
+bool worker_quit = false;
+
+// everything below is guarded by worker_mutex
+commit_queue* ready_head = NULL;
+commit_queue* ready_tail = NULL;
+commit_job* finished_head = NULL;
+commit_job* finished_tail = NULL;
+
+void append_job(commit_job** head, commit_job** tail, commit_job* job)
+{
+    job->next = NULL;
+    if (*tail)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+}
+
+void make_ready(commit_queue* queue)
+{
+    if (queue->ready || queue->busy || !queue->head)
+        return;
+
+    queue->ready = true;
+    queue->next_ready = NULL;
+    if (ready_tail)
+        ready_tail->next_ready = queue;
+    else
+        ready_head = queue;
+    ready_tail = queue;
+}
+
+bool is_heavy(const commit_queue* queue)
+{
+    return worker_count > 1 && queue->avg_service > HEAVY_JOB;
+}
+
+commit_queue* take_ready()
+{
+    commit_queue* prev = NULL;
+    for (commit_queue* it = ready_head; it; prev = it, it = it->next_ready)
+    {
+        if (is_heavy(it) && heavy_running >= worker_count - 1)
+            continue;
+
+        if (prev)
+            prev->next_ready = it->next_ready;
+        else
+            ready_head = it->next_ready;
+        if (ready_tail == it)
+            ready_tail = prev;
+
+        it->ready = false;
+        return it;
+    }
+    return NULL;
+}
+
+void apply_worker_priority()
+{
+    // background mode on Windows resets the thread priority, it goes first
+    if (get_io_idle() && !thread_set_io_idle())
+        plog("Cannot lower the IO priority of the commit thread");
+
+    int priority = get_cpu_priority();
+    if (priority != CPU_PRIORITY_NORMAL && !thread_set_cpu_priority(priority))
+        plog("Cannot lower the CPU priority of the commit thread");
+}
+
+void record_job(commit_queue* queue, uint64_t wait, uint64_t service)
+{
+    commit_queue_stats* stats = &queue->stats;
+    ++stats->jobs;
+    stats->wait_total += wait;
+    stats->service_total += service;
+    if (wait > stats->wait_max)
+        stats->wait_max = wait;
+    if (service > stats->service_max)
+        stats->service_max = service;
+
+    queue->avg_service = queue->avg_service
+        ? (queue->avg_service * 3 + service) / 4
+        : service;
+}
+
+void worker_main(void* arg)
+{
+    (void)arg;
+
+    apply_worker_priority();
+
+    uv_mutex_lock(&worker_mutex);
+    while (true)
+    {
+        commit_queue* queue;
+        while (!(queue = take_ready()) && !worker_quit)
+            uv_cond_wait(&worker_cond, &worker_mutex);
+
+        if (!queue)
+            break;
+
+        commit_job* job = queue->head;
+        queue->head = job->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        queue->busy = true;
+
+        bool heavy = is_heavy(queue);
+        if (heavy)
+            ++heavy_running;
+
+        uv_mutex_unlock(&worker_mutex);
+        uint64_t start = uv_hrtime();
+        job->work(job->data);
+        uint64_t end = uv_hrtime();
+        uv_mutex_lock(&worker_mutex);
+
+        if (heavy)
+            --heavy_running;
+
+        record_job(queue, start - job->submitted, end - start);
+        queue->busy = false;
+        make_ready(queue);
+        uv_cond_broadcast(&worker_cond);
+
+        append_job(&finished_head, &finished_tail, job);
+        uv_async_send(&worker_async);
+    }
+    uv_mutex_unlock(&worker_mutex);
+}
+
+void finished_cb(uv_async_t* handle)
+{
+    (void)handle;
+
+    uv_mutex_lock(&worker_mutex);
+    commit_job* it = finished_head;
+    finished_head = finished_tail = NULL;
+    uv_mutex_unlock(&worker_mutex);
+
+    while (it)
+    {
+        commit_job* temp = it;
+        it = it->next;
+        if (temp->done)
+            temp->done(temp->data);
+        free(temp);
+    }
+}
+
+void commit_worker_start(uv_loop_t* loop, int workers)
+{
+    uv_mutex_init(&worker_mutex);
+    uv_cond_init(&worker_cond);
+    uv_async_init(loop, &worker_async, finished_cb);
+    worker_quit = false;
+
+    worker_count = workers < MAX_WORKERS ? workers : MAX_WORKERS;
+    for (int i = 0; i < worker_count; ++i)
+        uv_thread_create(&worker_threads[i], worker_main, NULL);
+}
+
+void commit_queue_init(commit_queue* queue)
+{
+    memset(queue, 0, sizeof(commit_queue));
+}
+
+void commit_worker_submit(commit_queue* queue, void(*work)(void*),
+        void(*done)(void*), void* data)
+{
+    commit_job* job = malloc(sizeof(commit_job));
+    job->work = work;
+    job->done = done;
+    job->data = data;
+    job->queue = queue;
+    job->submitted = uv_hrtime();
+
+    uv_mutex_lock(&worker_mutex);
+    append_job(&queue->head, &queue->tail, job);
+    make_ready(queue);
+    uv_cond_signal(&worker_cond);
+    uv_mutex_unlock(&worker_mutex);
+}
+
+void commit_queue_get_stats(commit_queue* queue, commit_queue_stats* stats)
+{
+    uv_mutex_lock(&worker_mutex);
+    *stats = queue->stats;
+    uv_mutex_unlock(&worker_mutex);
+}
+
+void commit_worker_stop()
+{
+    uv_mutex_lock(&worker_mutex);
+    worker_quit = true;
+    uv_cond_broadcast(&worker_cond);
+    uv_mutex_unlock(&worker_mutex);
+
+    for (int i = 0; i < worker_count; ++i)
+        uv_thread_join(&worker_threads[i]);
+
+    finished_cb(&worker_async);
+    uv_close((uv_handle_t*)&worker_async, NULL);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct commit_queue_stats
+{
+    unsigned long jobs;
+    uint64_t wait_total; // ns
+    uint64_t wait_max;
+    uint64_t service_total;
+    uint64_t service_max;
+} commit_queue_stats;
+
+struct commit_job;
+
+// jobs of one queue run one at a time and in order, queues are served
+// round-robin by the worker threads
+typedef struct commit_queue
+{
+    struct commit_job* head;
+    struct commit_job* tail;
+    struct commit_queue* next_ready;
+    bool busy;
+    bool ready;
+    uint64_t avg_service; // ns, moving average
+    commit_queue_stats stats;
+} commit_queue;
+
+void commit_worker_start(uv_loop_t* loop, int workers);
+void commit_queue_init(commit_queue* queue);
+void commit_worker_submit(commit_queue* queue, void(*work)(void*),
+        void(*done)(void*), void* data);
+void commit_queue_get_stats(commit_queue* queue, commit_queue_stats* stats);
+void commit_worker_stop();
@@ -0,0 +1,262 @@
+#include "control.h"
+#include "fs_listener.h"
+#include "git.h"
+#include "logs.h"
+#include "repos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define CONTROL_LINE_MAX 4096
+
+typedef struct control_client
+{
+    uv_pipe_t pipe;
+    char buf[CONTROL_LINE_MAX];
+    size_t len;
+} control_client;
+
+typedef struct control_reply
+{
+    uv_write_t req;
+    char text[256];
+} control_reply;
+
+uv_loop_t* loop_control;
+uv_pipe_t control_server;
+bool all_paused = false; // repositories added later start paused as well
+
+void reply_cb(uv_write_t* req, int status)
+{
+    (void)status;
+    free(req->data);
+}
+
+void reply(control_client* client, const char* text)
+{
+    control_reply* r = malloc(sizeof(control_reply));
+    size_t len = strlen(text);
+    if (len > sizeof(r->text) - 1)
+        len = sizeof(r->text) - 1;
+    memcpy(r->text, text, len);
+    r->text[len++] = '\n';
+    r->req.data = r;
+
+    uv_buf_t buf = uv_buf_init(r->text, (unsigned int)len);
+    if (uv_write(&r->req, (uv_stream_t*)&client->pipe, &buf, 1, reply_cb) < 0)
+        free(r);
+}
+
+typedef void(*repo_command)(watched_repo* repo);
+
+void reply_error(control_client* client, const char* what, const char* arg)
+{
+    char text[256];
+    snprintf(text, sizeof(text), "error: %s %s", what, arg);
+    reply(client, text);
+}
+
+void for_repos(control_client* client, const char* arg, repo_command command)
+{
+    if (arg)
+    {
+        watched_repo* repo = repos_find(arg);
+        if (!repo || repo->removed)
+        {
+            reply_error(client, "not watched:", arg);
+            return;
+        }
+        command(repo);
+    }
+    else
+    {
+        for (watched_repo* it = repos_first(); it; it = it->next)
+        {
+            if (!it->removed)
+                command(it);
+        }
+    }
+    reply(client, "ok");
+}
+
+void reply_stats(control_client* client, watched_repo* repo)
+{
+    commit_queue_stats stats;
+    commit_queue_get_stats(&repo->queue, &stats);
+
+    double jobs = stats.jobs ? (double)stats.jobs : 1.0;
+    char text[256];
+    snprintf(text, sizeof(text), "%.160s commits=%lu wait_avg=%.1fms "
+            "wait_max=%.1fms service_avg=%.1fms service_max=%.1fms",
+            repo->path, stats.jobs, (double)stats.wait_total / jobs / 1e6,
+            (double)stats.wait_max / 1e6,
+            (double)stats.service_total / jobs / 1e6,
+            (double)stats.service_max / 1e6);
+    reply(client, text);
+}
+
+void execute(control_client* client, char* line)
+{
+    char* arg = strchr(line, ' ');
+    if (arg)
+    {
+        *arg++ = '\0';
+        if (*arg == '\0')
+            arg = NULL;
+    }
+
+    if (strcmp(line, "add") == 0 && arg)
+    {
+        watched_repo* repo = repos_find(arg);
+        if (repo && !repo->removed)
+        {
+            reply_error(client, "already watched:", arg);
+            return;
+        }
+
+        // a removed repository stays listed until its last commit is done,
+        // a second one for the same folder would race with it
+        if (repo)
+        {
+            reply_error(client, "busy, still being removed:", arg);
+            return;
+        }
+
+        pflog("Adding %s", arg);
+        repo = repos_add(arg);
+        repo->paused = all_paused;
+        fs_listener_add(repo, check_if_valid_git_repo(repo->path));
+        reply(client, "ok");
+    }
+    else if (strcmp(line, "remove") == 0 && arg)
+    {
+        pflog("Removing %s", arg);
+        for_repos(client, arg, fs_listener_remove);
+    }
+    else if (strcmp(line, "stats") == 0)
+    {
+        for (watched_repo* it = repos_first(); it; it = it->next)
+        {
+            if (!it->removed && (!arg || it == repos_find(arg)))
+                reply_stats(client, it);
+        }
+        reply(client, "ok");
+    }
+    else if (strcmp(line, "flush") == 0)
+    {
+        for_repos(client, arg, fs_listener_flush);
+    }
+    else if (strcmp(line, "pause") == 0)
+    {
+        if (!arg)
+            all_paused = true;
+        for_repos(client, arg, fs_listener_pause);
+    }
+    else if (strcmp(line, "resume") == 0)
+    {
+        if (!arg)
+            all_paused = false;
+        for_repos(client, arg, fs_listener_resume);
+    }
+    else
+    {
+        reply_error(client, "unknown command:", line);
+    }
+}
+
+void client_close_cb(uv_handle_t* handle)
+{
+    free(handle->data);
+}
+
+void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+{
+    (void)suggested_size;
+    control_client* client = handle->data;
+    *buf = uv_buf_init(client->buf + client->len,
+            (unsigned int)(sizeof(client->buf) - client->len));
+}
+
+void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    (void)buf;
+    control_client* client = stream->data;
+
+    if (nread < 0)
+    {
+        uv_close((uv_handle_t*)stream, client_close_cb);
+        return;
+    }
+
+    client->len += (size_t)nread;
+
+    char* start = client->buf;
+    char* end;
+    while ((end = memchr(start, '\n', client->len - (size_t)(start - client->buf))))
+    {
+        *end = '\0';
+        if (end > start && end[-1] == '\r')
+            end[-1] = '\0';
+        if (*start)
+            execute(client, start);
+        start = end + 1;
+    }
+
+    client->len -= (size_t)(start - client->buf);
+    memmove(client->buf, start, client->len);
+
+    if (client->len == sizeof(client->buf))
+    {
+        reply(client, "error: line too long");
+        client->len = 0;
+    }
+}
+
+void connection_cb(uv_stream_t* server, int status)
+{
+    if (status < 0)
+        return;
+
+    control_client* client = malloc(sizeof(control_client));
+    client->len = 0;
+    uv_pipe_init(loop_control, &client->pipe, 0);
+    client->pipe.data = client;
+
+    if (uv_accept(server, (uv_stream_t*)&client->pipe) < 0)
+    {
+        uv_close((uv_handle_t*)&client->pipe, client_close_cb);
+        return;
+    }
+
+    uv_read_start((uv_stream_t*)&client->pipe, alloc_cb, read_cb);
+}
+
+bool control_start(uv_loop_t* loop, const char* path)
+{
+    loop_control = loop;
+    uv_pipe_init(loop, &control_server, 0);
+
+#ifndef WIN32
+    // a socket left behind by a previous instance would make bind fail
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        remove(path);
+#endif
+
+    int error = uv_pipe_bind(&control_server, path);
+    if (error == 0)
+        error = uv_listen((uv_stream_t*)&control_server, 16, connection_cb);
+
+    if (error < 0)
+    {
+        pflog("Cannot listen on control socket %s, %s", path,
+                uv_strerror(error));
+        uv_close((uv_handle_t*)&control_server, NULL);
+        return false;
+    }
+
+    pflog("Listening for commands on %s", path);
+    return true;
+}
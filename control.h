@@ -0,0 +1,7 @@
+#pragma once
+
+#include <uv.h>
+
+#include <stdbool.h>
+
+bool control_start(uv_loop_t* loop, const char* path);
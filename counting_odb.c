@@ -0,0 +1,155 @@
+#include "counting_odb.h"
+#include "metrics.h"
+
+#include <git2/sys/odb_backend.h>
+#include <uv.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// above the loose (1) and packed (2) backends, so writes come here first
+#define COUNTING_PRIORITY 10
+
+typedef struct counting_backend
+{
+    git_odb_backend parent;
+    git_odb_backend* loose;
+    char* objects_dir;
+    commit_counts* counts;
+} counting_backend;
+
+typedef struct counting_stream
+{
+    git_odb_stream parent;
+    git_odb_stream* inner;
+} counting_stream;
+
+void counting_count_object(counting_backend* backend, const git_oid* oid)
+{
+    char hex[GIT_OID_HEXSZ + 1];
+    char path[2048];
+    uv_fs_t req;
+
+    git_oid_tostr(hex, sizeof(hex), oid);
+    snprintf(path, sizeof(path), "%s/%.2s/%s", backend->objects_dir, hex,
+            hex + 2);
+
+    if (uv_fs_stat(NULL, &req, path, NULL) == 0)
+    {
+        metrics_add(METRIC_BYTES_WRITTEN, req.statbuf.st_size);
+        backend->counts->bytes_written += req.statbuf.st_size;
+    }
+    uv_fs_req_cleanup(&req);
+    metrics_add(METRIC_OBJECTS_WRITTEN, 1);
+    ++backend->counts->objects_written;
+}
+
+int counting_write(git_odb_backend* b, const git_oid* oid, const void* data,
+        size_t len, git_otype type)
+{
+    counting_backend* backend = (counting_backend*)b;
+    int error = backend->loose->write(backend->loose, oid, data, len, type);
+    if (error == 0)
+        counting_count_object(backend, oid);
+    return error;
+}
+
+int counting_stream_write(git_odb_stream* s, const char* buffer, size_t len)
+{
+    counting_stream* stream = (counting_stream*)s;
+    return stream->inner->write(stream->inner, buffer, len);
+}
+
+int counting_stream_finalize(git_odb_stream* s, const git_oid* oid)
+{
+    counting_stream* stream = (counting_stream*)s;
+    int error = stream->inner->finalize_write(stream->inner, oid);
+
+    if (error == 0)
+        counting_count_object((counting_backend*)s->backend, oid);
+    return error;
+}
+
+void counting_stream_free(git_odb_stream* s)
+{
+    counting_stream* stream = (counting_stream*)s;
+    stream->inner->free(stream->inner);
+    free(stream);
+}
+
+int counting_writestream(git_odb_stream** out, git_odb_backend* b,
+        git_off_t size, git_otype type)
+{
+    counting_backend* backend = (counting_backend*)b;
+    git_odb_stream* inner;
+
+    int error = backend->loose->writestream(&inner, backend->loose, size, type);
+    if (error < 0)
+        return error;
+
+    counting_stream* stream = calloc(1, sizeof(counting_stream));
+    stream->parent.backend = b;
+    stream->parent.mode = GIT_STREAM_WRONLY;
+    stream->parent.write = counting_stream_write;
+    stream->parent.finalize_write = counting_stream_finalize;
+    stream->parent.free = counting_stream_free;
+    stream->inner = inner;
+
+    *out = &stream->parent;
+    return 0;
+}
+
+int counting_foreach(git_odb_backend* b, git_odb_foreach_cb cb, void* payload)
+{
+    // the objects are listed by the regular loose backend already
+    (void)b;
+    (void)cb;
+    (void)payload;
+    return 0;
+}
+
+void counting_free(git_odb_backend* b)
+{
+    counting_backend* backend = (counting_backend*)b;
+    backend->loose->free(backend->loose);
+    free(backend->objects_dir);
+    free(backend);
+}
+
+bool counting_odb_attach(git_repository* repo, commit_counts* counts)
+{
+    git_odb* odb = NULL;
+    counting_backend* backend = calloc(1, sizeof(counting_backend));
+    backend->counts = counts;
+
+    size_t len = strlen(git_repository_path(repo));
+    backend->objects_dir = malloc(len + sizeof("objects"));
+    memcpy(backend->objects_dir, git_repository_path(repo), len);
+    memcpy(backend->objects_dir + len, "objects", sizeof("objects"));
+
+    // reads are left to the backends libgit2 sets up itself
+    if (git_odb_init_backend(&backend->parent, GIT_ODB_BACKEND_VERSION) < 0 ||
+            git_odb_backend_loose(&backend->loose, backend->objects_dir,
+                -1, 0, 0, 0) < 0)
+    {
+        free(backend->objects_dir);
+        free(backend);
+        return false;
+    }
+    backend->parent.write = counting_write;
+    backend->parent.writestream = counting_writestream;
+    backend->parent.foreach = counting_foreach;
+    backend->parent.free = counting_free;
+
+    if (git_repository_odb(&odb, repo) < 0 ||
+            git_odb_add_backend(odb, &backend->parent, COUNTING_PRIORITY) < 0)
+    {
+        git_odb_free(odb);
+        counting_free(&backend->parent);
+        return false;
+    }
+
+    git_odb_free(odb);
+    return true;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <git2.h>
+
+#include <stdbool.h>
+
+// routes the object writes of repo through a backend that reports the bytes
+// and objects written to the metrics and adds them to counts
+bool counting_odb_attach(git_repository* repo, commit_counts* counts);
@@ -0,0 +1,159 @@
+#include "delta_pack.h"
+#include "args.h"
+
+#include <uv.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// versions per pack; each pack holds one of them in full
+#define DELTA_PACK_VERSIONS 16
+
+// the objects of a pack are loaded while deltas are searched, at most this
+// much of them, or half of --mem-budget
+#define DELTA_PACK_BYTES (1024ull * 1024 * 1024)
+
+void delta_pack_init(delta_pack* pack)
+{
+    memset(pack, 0, sizeof(delta_pack));
+}
+
+void delta_pack_clear(delta_pack* pack)
+{
+    for (size_t i = 0; i < pack->count; ++i)
+        free(pack->entries[i].path);
+    pack->count = 0;
+    pack->bytes = 0;
+}
+
+void delta_pack_free(delta_pack* pack)
+{
+    delta_pack_clear(pack);
+    free(pack->entries);
+    delta_pack_init(pack);
+}
+
+void delta_pack_add(delta_pack* pack, const char* path, const git_oid* id,
+        uint64_t size)
+{
+    // e.g. a file changed back to an earlier version
+    for (size_t i = 0; i < pack->count; ++i)
+    {
+        if (git_oid_equal(&pack->entries[i].id, id))
+            return;
+    }
+
+    if (pack->count == pack->capacity)
+    {
+        pack->capacity = pack->capacity ? pack->capacity * 2 : 8;
+        pack->entries = realloc(pack->entries,
+                pack->capacity * sizeof(delta_pack_entry));
+    }
+
+    delta_pack_entry* entry = &pack->entries[pack->count++];
+    size_t len = strlen(path);
+    entry->path = malloc(len + 1);
+    memcpy(entry->path, path, len + 1);
+    git_oid_cpy(&entry->id, id);
+    entry->size = size;
+    pack->bytes += size;
+}
+
+bool delta_pack_ready(const delta_pack* pack)
+{
+    uint64_t limit = DELTA_PACK_BYTES;
+    uint64_t budget = (uint64_t)get_mem_budget() * 1024 * 1024 / 2;
+    if (budget > 0 && budget < limit)
+        limit = budget;
+
+    return pack->count >= DELTA_PACK_VERSIONS ||
+        (pack->count > 1 && pack->bytes >= limit);
+}
+
+void loose_object_path(const char* objects_dir, const git_oid* id, char* buf,
+        size_t size)
+{
+    char hex[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(hex, sizeof(hex), id);
+    snprintf(buf, size, "%s/%.2s/%s", objects_dir, hex, hex + 2);
+}
+
+bool file_exists(const char* path, uint64_t* size)
+{
+    uv_fs_t req;
+    int error = uv_fs_stat(NULL, &req, path, NULL);
+    if (error == 0 && size)
+        *size = req.statbuf.st_size;
+    uv_fs_req_cleanup(&req);
+    return error == 0;
+}
+
+bool delta_pack_write(delta_pack* pack, git_repository* repo,
+        size_t* objects, uint64_t* pack_size)
+{
+    char objects_dir[1024];
+    char pack_dir[1536];
+    char path[2048];
+    snprintf(objects_dir, sizeof(objects_dir), "%sobjects",
+            git_repository_path(repo));
+    snprintf(pack_dir, sizeof(pack_dir), "%s/pack", objects_dir);
+
+    *objects = 0;
+    *pack_size = 0;
+
+    git_packbuilder* pb = NULL;
+    if (git_packbuilder_new(&pb, repo) < 0)
+    {
+        delta_pack_clear(pack);
+        return false;
+    }
+
+    // objects packed in the meantime, e.g. by git gc, are left out
+    bool ok = true;
+    for (size_t i = 0; ok && i < pack->count; ++i)
+    {
+        loose_object_path(objects_dir, &pack->entries[i].id, path,
+                sizeof(path));
+        if (!file_exists(path, NULL))
+            pack->entries[i].size = 0;
+        else if (git_packbuilder_insert(pb, &pack->entries[i].id,
+                    pack->entries[i].path) < 0)
+            ok = false;
+        else
+            ++*objects;
+    }
+
+    if (ok && *objects > 0)
+        ok = git_packbuilder_write(pb, pack_dir, 0, NULL, NULL) == 0;
+
+    if (ok && *objects > 0)
+    {
+        char hex[GIT_OID_HEXSZ + 1];
+        git_oid_tostr(hex, sizeof(hex), git_packbuilder_hash(pb));
+        snprintf(path, sizeof(path), "%s/pack-%s.pack", pack_dir, hex);
+        file_exists(path, pack_size);
+
+        // the pack is in place with its index, so the loose copies can go
+        git_odb* odb = NULL;
+        if (git_repository_odb(&odb, repo) == 0)
+            git_odb_refresh(odb);
+        git_odb_free(odb);
+
+        for (size_t i = 0; i < pack->count; ++i)
+        {
+            if (pack->entries[i].size == 0)
+                continue;
+
+            uv_fs_t req;
+            loose_object_path(objects_dir, &pack->entries[i].id, path,
+                    sizeof(path));
+            uv_fs_unlink(NULL, &req, path, NULL);
+            uv_fs_req_cleanup(&req);
+        }
+    }
+
+    git_packbuilder_free(pb);
+    delta_pack_clear(pack);
+    return ok;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <git2.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// files at least this large are packed, smaller ones are left loose
+#define DELTA_MIN_SIZE (1024 * 1024)
+
+typedef struct delta_pack_entry
+{
+    git_oid id;
+    char* path; // groups the versions of one file in the pack
+    uint64_t size;
+} delta_pack_entry;
+
+// the large blobs written since the last pack; a delta can only refer to an
+// object of the same pack, so versions are collected until a pack of them
+// stores all but one as deltas against each other, instead of one zlib
+// stream per version in a loose object
+typedef struct delta_pack
+{
+    delta_pack_entry* entries;
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;
+} delta_pack;
+
+void delta_pack_init(delta_pack* pack);
+void delta_pack_free(delta_pack* pack);
+
+void delta_pack_add(delta_pack* pack, const char* path, const git_oid* id,
+        uint64_t size);
+
+// enough versions, or as many bytes as the pack should load at once
+bool delta_pack_ready(const delta_pack* pack);
+
+// writes the blobs that are still loose to a new pack and removes their
+// loose objects; the list is emptied either way
+bool delta_pack_write(delta_pack* pack, git_repository* repo,
+        size_t* objects, uint64_t* pack_size);
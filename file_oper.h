@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// a file mapped read-write and shared, so that its content survives the
+// process even if it is killed
+typedef struct mapped_file
+{
+    void* data;
+    size_t size;
+    void* handle; // platform specific
+} mapped_file;
+
+// the file is created if needed and extended to at least min_size bytes
+bool file_map_open(mapped_file* file, const char* path, size_t min_size);
+// the file and its mapping grow or shrink to size bytes; on failure the old
+// mapping stays in place, the file may be left longer than it
+bool file_map_resize(mapped_file* file, size_t size);
+void file_map_close(mapped_file* file);
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+
+#include "file_oper.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool file_map_open(mapped_file* file, const char* path, size_t min_size)
+{
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    file->handle = (void*)(intptr_t)fd;
+    file->data = NULL;
+    file->size = 0;
+
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size < min_size)
+    {
+        if (ftruncate(fd, (off_t)min_size) < 0)
+        {
+            close(fd);
+            return false;
+        }
+        size = min_size;
+    }
+
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    file->data = data;
+    file->size = size;
+    return true;
+}
+
+bool file_map_resize(mapped_file* file, size_t size)
+{
+    int fd = (int)(intptr_t)file->handle;
+    bool grow = size > file->size;
+
+    // pages of the mapping past the end of the file would fault, so the file
+    // grows before the mapping and shrinks after it
+    if (grow && ftruncate(fd, (off_t)size) < 0)
+        return false;
+
+    void* data = mremap(file->data, file->size, size, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED)
+        return false;
+
+    file->data = data;
+    file->size = size;
+
+    // the mapping is already smaller, a file left longer does no harm
+    if (!grow)
+    {
+        int error = ftruncate(fd, (off_t)size);
+        (void)error;
+    }
+    return true;
+}
+
+void file_map_close(mapped_file* file)
+{
+    if (!file->data)
+        return;
+
+    munmap(file->data, file->size);
+    close((int)(intptr_t)file->handle);
+    file->data = NULL;
+    file->size = 0;
+}
@@ -0,0 +1,99 @@
+#include "file_oper.h"
+
+#include <stdlib.h>
+#include <windows.h>
+
+typedef struct win_mapping
+{
+    HANDLE file;
+    HANDLE mapping;
+} win_mapping;
+
+bool map_view(mapped_file* file, size_t size)
+{
+    win_mapping* wm = file->handle;
+
+    wm->mapping = CreateFileMapping(wm->file, NULL, PAGE_READWRITE,
+            (DWORD)((unsigned long long)size >> 32), (DWORD)size, NULL);
+    if (!wm->mapping)
+        return false;
+
+    file->data = MapViewOfFile(wm->mapping, FILE_MAP_WRITE, 0, 0, size);
+    if (!file->data)
+    {
+        CloseHandle(wm->mapping);
+        return false;
+    }
+
+    file->size = size;
+    return true;
+}
+
+bool file_map_open(mapped_file* file, const char* path, size_t min_size)
+{
+    LARGE_INTEGER size;
+    win_mapping* wm = malloc(sizeof(win_mapping));
+
+    wm->file = CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    file->handle = wm;
+    file->data = NULL;
+    file->size = 0;
+
+    if (wm->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(wm->file, &size))
+    {
+        if (wm->file != INVALID_HANDLE_VALUE)
+            CloseHandle(wm->file);
+        free(wm);
+        file->handle = NULL;
+        return false;
+    }
+
+    // a mapping larger than the file extends it
+    size_t map_size = (size_t)size.QuadPart;
+    if (map_size < min_size)
+        map_size = min_size;
+
+    if (!map_view(file, map_size))
+    {
+        CloseHandle(wm->file);
+        free(wm);
+        file->handle = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool file_map_resize(mapped_file* file, size_t size)
+{
+    win_mapping* wm = file->handle;
+    HANDLE old_mapping = wm->mapping;
+    void* old_data = file->data;
+
+    // the new view is mapped while the old one is still there to fall back on
+    if (!map_view(file, size))
+    {
+        wm->mapping = old_mapping;
+        file->data = old_data;
+        return false;
+    }
+
+    UnmapViewOfFile(old_data);
+    CloseHandle(old_mapping);
+    return true;
+}
+
+void file_map_close(mapped_file* file)
+{
+    win_mapping* wm = file->handle;
+    if (!wm)
+        return;
+
+    UnmapViewOfFile(file->data);
+    CloseHandle(wm->mapping);
+    CloseHandle(wm->file);
+    free(wm);
+    file->handle = NULL;
+    file->data = NULL;
+    file->size = 0;
+}
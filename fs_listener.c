@@ -1,81 +1,441 @@
 #include "fs_listener.h"
 #include "fs_oper.h"
+#include "fs_poll.h"
 #include "args.h"
+#include "commit_worker.h"
+#include "git.h"
 #include "logs.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "state.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 uv_loop_t* loop_fs;
-uv_timer_t low_pass_timer;
-uv_timer_t retry_timer;
-void(*cb)() = NULL;
+void(*cb)(watched_repo*) = NULL;
+bool shutting_down = false;
+void(*shutdown_cb)(void) = NULL;
 
-void fs_cb(uv_fs_event_t* handle, const char* filename, int events, int status);
+void fs_cb(watched_repo* repo, const char* path, int events);
 void lp_cb(uv_timer_t* handle);
-void start_retry_timer();
+void retry_cb(uv_timer_t* handle);
+void start_lp_timer(watched_repo* repo);
+void start_retry_timer(watched_repo* repo);
+void commit_now(watched_repo* repo);
+void stop_watcher(watched_repo* repo);
+bool start_save(watched_repo* repo, bool force);
+void check_shutdown();
 
-void fs_listener_start(uv_loop_t* loop, void(*callback)())
+void fs_listener_init(uv_loop_t* loop, void(*callback)(watched_repo*))
 {
     loop_fs = loop;
     cb = callback;
+}
+
+void commit_work(void* data)
+{
+    cb((watched_repo*)data);
+}
+
+void timer_close_cb(uv_handle_t* handle)
+{
+    watched_repo* repo = handle->data;
+    if (--repo->open_timers == 0)
+        repos_remove(repo);
+}
+
+void finish_remove(watched_repo* repo)
+{
+    uv_close((uv_handle_t*)&repo->low_pass_timer, timer_close_cb);
+    uv_close((uv_handle_t*)&repo->retry_timer, timer_close_cb);
+}
+
+void save_work(void* data)
+{
+    watched_repo* repo = data;
+
+    if (open_git_repo(repo) && !state_save(repo->git_repo, repo->git_dir,
+                repo->save_dirs, repo->save_dir_count))
+        pflog("%s: cannot save the warm start state", repo->path);
+
+    state_free_dirs(repo->save_dirs, repo->save_dir_count);
+    repo->save_dirs = NULL;
+    repo->save_dir_count = 0;
+}
+
+void save_done(void* data)
+{
+    watched_repo* repo = data;
+    repo->saving = false;
+
+    if (repo->removed && !repo->committing)
+        finish_remove(repo);
 
-    if (dir_exists(get_repo_path()))
+    if (shutting_down)
+        check_shutdown();
+}
+
+// the state is only written while nothing is pending, so that anything that
+// changes later is visible either in the directory mtimes or in file stats
+bool start_save(watched_repo* repo, bool force)
+{
+    // the poller keeps no directory state between runs
+    if (!get_warm_start() || get_poll_interval() > 0 || repo_busy(repo) ||
+            repo->removed || repo->full_scan || repo->dirty.count > 0 ||
+            !repo->watch_data)
+        return false;
+
+    uint64_t now = uv_now(loop_fs);
+    if (!force && repo->last_save != 0 &&
+            now - repo->last_save < STATE_SAVE_INTERVAL)
+        return false;
+
+    repo->save_dirs = fs_listener_snapshot_impl(repo, &repo->save_dir_count);
+    if (!repo->save_dirs)
+        return false;
+
+    repo->last_save = now;
+    repo->saving = true;
+    commit_worker_submit(&repo->queue, save_work, save_done, repo);
+    return true;
+}
+
+void check_shutdown()
+{
+    for (watched_repo* it = repos_first(); it; it = it->next)
     {
-        fs_listener_start_impl(loop_fs, fs_cb);
+        if (repo_busy(it))
+            return;
+    }
+
+    void(*done)(void) = shutdown_cb;
+    shutdown_cb = NULL;
+    if (done)
+        done();
+}
+
+void commit_done(void* data)
+{
+    watched_repo* repo = data;
+
+    path_map_clear(&repo->commit_paths);
+    repo->committing = false;
+    pressure_budget_init(&repo->pressure);
+
+    bool failed = repo->commit_result == COMMIT_FAILED;
+
+    // the journal only had the previous run, the rest of the tree follows
+    if (repo->scan_after_replay && !failed)
+    {
+        repo->full_scan = true;
+        path_map_clear(&repo->dirty);
+    }
+    repo->scan_after_replay = false;
+
+    // only the paths that arrived during the commit are still pending
+    if (!failed)
+        journal_compact(&repo->journal,
+                repo->committed_tree_valid ? &repo->committed_tree : NULL,
+                &repo->dirty, repo->full_scan);
+
+    // the paths of a failed commit are gone, the retry has to look everywhere
+    if (failed)
+    {
+        repo->full_scan = true;
+        path_map_clear(&repo->dirty);
+    }
+
+    if (repo->removed)
+    {
+        if (!repo->saving)
+            finish_remove(repo);
+    }
+    else if (shutting_down)
+    {
+        if (!failed)
+            start_save(repo, true);
+    }
+    else if (repo->flush_requested)
+    {
+        repo->flush_requested = false;
+        commit_now(repo);
+    }
+    else if (!repo->paused && (repo->full_scan || repo->dirty.count > 0))
+    {
+        start_lp_timer(repo);
+    }
+    else if (!failed)
+    {
+        start_save(repo, false);
+    }
+
+    if (shutting_down)
+        check_shutdown();
+}
+
+void schedule_commit(watched_repo* repo)
+{
+    if (repo->committing)
+        return;
+
+    // under IO/CPU pressure the commit waits on the timer, not on a thread
+    unsigned int wait = pressure_defer(&repo->pressure);
+    if (wait > 0)
+    {
+        uv_timer_start(&repo->low_pass_timer, lp_cb, wait, 0);
+        return;
+    }
+
+    // the commit thread takes over the dirty set, new events go to a fresh one
+    path_map_swap(&repo->dirty, &repo->commit_paths);
+    repo->commit_full_scan = repo->full_scan;
+    repo->full_scan = false;
+    repo->committing = true;
+
+    commit_worker_submit(&repo->queue, commit_work, commit_done, repo);
+}
+
+bool start_warm(watched_repo* repo, size_t journaled)
+{
+    warm_state* state = state_load(repo->git_dir);
+    if (!state)
+        return false;
+
+    if (!fs_listener_warm_start_impl(loop_fs, repo, fs_cb, state,
+                &repo->dirty))
+    {
+        state_free(state);
+        return false;
+    }
+
+    pflog("%s: warm start, %u directories watched, %u new paths",
+            repo->path, repo->watched_dirs,
+            (unsigned)(repo->dirty.count - journaled));
+
+    // the commit thread checks the recorded files against the disk
+    state_free(repo->warm_state);
+    repo->warm_state = state;
+    return true;
+}
+
+// the watcher of the platform, or the poller with --poll
+void start_watcher(watched_repo* repo)
+{
+    if (get_poll_interval() > 0)
+        fs_poll_start(loop_fs, repo, fs_cb, (uint64_t)get_poll_interval());
+    else
+        fs_listener_start_impl(loop_fs, repo, fs_cb);
+}
+
+void stop_watcher(watched_repo* repo)
+{
+    if (get_poll_interval() > 0)
+        fs_poll_stop(repo);
+    else
+        fs_listener_stop_impl(repo);
+}
+
+void start_watching(watched_repo* repo, bool initial_commit)
+{
+    // e.g. a folder that only became a repository after it was added
+    if (!repo->git_dir_found && !repo_busy(repo))
+        repo_find_git_dir(repo);
+
+    // kept also without the warm start, a crash loses no pending paths
+    journal_open(&repo->journal, repo->git_dir);
+
+    // paths pending when the previous run died, the commit thread commits
+    // them first if HEAD still matches the journal
+    size_t journaled = 0;
+    if (initial_commit)
+    {
+        repo->journal_replay = journal_recover(&repo->journal,
+                &repo->journal_base, &repo->dirty);
+        journaled = repo->journal_replay ? repo->dirty.count : 0;
+        repo->scan_after_replay = repo->journal_replay;
+        if (journaled > 0)
+            pflog("%s: %u journaled paths", repo->path, (unsigned)journaled);
+    }
+
+    bool warm = initial_commit && get_warm_start() &&
+        get_poll_interval() <= 0 && start_warm(repo, journaled);
+    if (!warm)
+        start_watcher(repo);
+
+    // without the state or the journal nothing tells what changed
+    if (initial_commit)
+    {
+        repo->full_scan = (!warm && !repo->journal_replay) ||
+            repo->dirty.count > DIRTY_SET_LIMIT;
+        if (repo->full_scan)
+            path_map_clear(&repo->dirty);
+    }
+
+    if (initial_commit && !repo->paused)
+        schedule_commit(repo);
+}
+
+void fs_listener_add(watched_repo* repo, bool initial_commit)
+{
+    uv_timer_init(loop_fs, &repo->low_pass_timer);
+    repo->low_pass_timer.data = repo;
+    uv_timer_init(loop_fs, &repo->retry_timer);
+    repo->retry_timer.data = repo;
+    repo->open_timers = 2;
+
+    if (dir_exists(repo->path))
+    {
+        start_watching(repo, initial_commit);
     }
     else
     {
-        start_retry_timer();
+        start_retry_timer(repo);
+    }
+}
+
+void fs_listener_remove(watched_repo* repo)
+{
+    uv_timer_stop(&repo->low_pass_timer);
+    uv_timer_stop(&repo->retry_timer);
+    stop_watcher(repo);
+    repo->removed = true;
+
+    // a running job still uses the repository, it is released afterwards
+    if (!repo_busy(repo))
+        finish_remove(repo);
+}
+
+void fs_listener_shutdown(void(*done)(void))
+{
+    shutting_down = true;
+    shutdown_cb = done;
+
+    // jobs in flight finish first, every repository with nothing pending
+    // saves its state on the way out
+    for (watched_repo* it = repos_first(); it; it = it->next)
+    {
+        uv_timer_stop(&it->low_pass_timer);
+        uv_timer_stop(&it->retry_timer);
+        it->flush_requested = false;
+        start_save(it, true);
     }
+
+    check_shutdown();
 }
 
-void fs_listener_stop(uv_fs_event_t* handle)
+void fs_listener_flush(watched_repo* repo)
 {
-    fs_listener_stop_impl(handle);
+    if (repo->committing)
+    {
+        repo->flush_requested = true;
+        return;
+    }
+
+    uv_timer_stop(&repo->low_pass_timer);
+    commit_now(repo);
+}
+
+void fs_listener_pause(watched_repo* repo)
+{
+    repo->paused = true;
+    uv_timer_stop(&repo->low_pass_timer);
+}
+
+void fs_listener_resume(watched_repo* repo)
+{
+    repo->paused = false;
+
+    if (!repo->committing && (repo->full_scan || repo->dirty.count > 0))
+        start_lp_timer(repo);
 }
 
 void lp_cb(uv_timer_t* handle)
 {
-    uv_timer_stop(handle);
-    uv_close((uv_handle_t*)handle, NULL);
-    cb();
-    fs_listener_start(loop_fs, cb);
+    commit_now(handle->data);
+}
+
+void commit_now(watched_repo* repo)
+{
+    if (!dir_exists(repo->path))
+    {
+        pflog("%s does not exist anymore", repo->path);
+        stop_watcher(repo);
+        start_retry_timer(repo);
+        return;
+    }
+
+    schedule_commit(repo);
 }
 
 void retry_cb(uv_timer_t* handle)
 {
-    uv_timer_stop(handle);
-    uv_close((uv_handle_t*)handle, NULL);
-    if (dir_exists(get_repo_path()))
+    watched_repo* repo = handle->data;
+
+    if (dir_exists(repo->path))
     {
-        cb();
+        uv_timer_stop(handle);
+        start_watching(repo, true);
     }
-    fs_listener_start(loop_fs, cb);
 }
 
-void start_lp_timer()
+void start_lp_timer(watched_repo* repo)
 {
-    uv_timer_init(loop_fs, &low_pass_timer);
-    uv_timer_start(&low_pass_timer, lp_cb, (uint64_t)get_timeout()*1000, 0);
+    uv_timer_start(&repo->low_pass_timer, lp_cb,
+            (uint64_t)get_timeout()*1000, 0);
 }
 
-void start_retry_timer()
+void start_retry_timer(watched_repo* repo)
 {
-    uv_timer_init(loop_fs, &retry_timer);
-    uv_timer_start(&retry_timer, retry_cb, (uint64_t)get_timeout()*1000, 0);
+    uint64_t timeout = (uint64_t)get_timeout()*1000;
+    uv_timer_start(&repo->retry_timer, retry_cb, timeout, timeout);
 }
 
-void fs_cb(uv_fs_event_t* handle, const char* filename, int events, int status)
+bool is_git_dir(const char* path)
 {
-    (void)status;
+    return strncmp(path, ".git", 4) == 0 && (path[4] == '\0' || path[4] == '/');
+}
+
+void mark_dirty(watched_repo* repo, const char* path)
+{
+    if (repo->full_scan)
+    {
+        metrics_add(METRIC_EVENTS_DROPPED, 1);
+        return;
+    }
+
+    if (path[0] == '\0' || repo->dirty.count >= DIRTY_SET_LIMIT)
+    {
+        metrics_add(METRIC_EVENTS_DROPPED, 1);
+        repo->full_scan = true;
+        path_map_clear(&repo->dirty);
+        journal_mark_full_scan(&repo->journal);
+        return;
+    }
+
+    if (path_map_add(&repo->dirty, path, NULL))
+        journal_append(&repo->journal, path);
+}
+
+void fs_cb(watched_repo* repo, const char* path, int events)
+{
+    metrics_add(METRIC_EVENTS, 1);
+
+    if (is_git_dir(path))
+        return;
+
+    if (recorder_enabled())
+        recorder_event(loop_fs, repo->path, path, events);
 
     if (events & UV_CHANGE)
-        pflog("File changed - %s", filename);
+        pflog("File changed - %s/%s", repo->path, path);
 
     if (events & UV_RENAME)
-        pflog("File (re)moved - %s", filename);
+        pflog("File (re)moved - %s/%s", repo->path, path);
+
+    mark_dirty(repo, path);
 
-    fs_listener_stop(handle);
-    start_lp_timer();
+    if (!repo->committing && !repo->paused && !shutting_down &&
+            !uv_is_active((uv_handle_t*)&repo->low_pass_timer))
+        start_lp_timer(repo);
 }
@@ -1,5 +1,13 @@
 #pragma once
 
+#include "repos.h"
+
 #include <uv.h>
 
-void fs_listener_start(uv_loop_t* loop, void(*callback)());
+void fs_listener_init(uv_loop_t* loop, void(*callback)(watched_repo*));
+void fs_listener_add(watched_repo* repo, bool initial_commit);
+void fs_listener_remove(watched_repo* repo);
+void fs_listener_flush(watched_repo* repo);
+void fs_listener_pause(watched_repo* repo);
+void fs_listener_resume(watched_repo* repo);
+void fs_listener_shutdown(void(*done)(void));
@@ -1,10 +1,25 @@
 #pragma once
 
+#include "repos.h"
+#include "state.h"
+
 #include <uv.h>
 
 #include <stdbool.h>
 
+// path is relative to the repository root and uses '/' as the separator
+typedef void(*fs_event_cb)(watched_repo* repo, const char* path, int events);
+
 bool dir_exists(const char* path);
-void fs_listener_start_impl(uv_loop_t* loop, void(*fs_cb)(
-        uv_fs_event_t* handle, const char* filename, int events, int status));
-void fs_listener_stop_impl(uv_fs_event_t* handle);
+void fs_listener_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb);
+void fs_listener_stop_impl(watched_repo* repo);
+
+// registers the watches recorded in state and re-reads only the directories
+// whose mtime changed, new entries are added to dirty; returns false when the
+// backend cannot do that and fs_listener_start_impl has to be used instead
+bool fs_listener_warm_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb, const warm_state* state, path_map* dirty);
+
+// the watched directories with their current mtimes, NULL if not supported
+warm_dir* fs_listener_snapshot_impl(watched_repo* repo, size_t* count);
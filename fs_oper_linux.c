@@ -1,24 +1,42 @@
 #include "fs_oper.h"
 #include "args.h"
-#include "lib/libuv/include/uv.h"
+#include "fs_poll.h"
+#include "logs.h"
 
 #include <dirent.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
 struct fs_event_req_node
 {
     uv_fs_event_t fs_event_req;
-    struct fs_event_req_node* next;
+    char* path; // as passed to inotify
+    const char* rel; // points into path, relative to the repository root
+    watched_repo* repo;
+    uint64_t last_active; // loop time of the last event
 };
 typedef struct fs_event_req_node fs_event_req_node;
-fs_event_req_node* fs_event_req_head = NULL;
-fs_event_req_node* fs_event_req_tail = NULL;
-bool free_on_next_add = false;
 
-void free_list();
+typedef struct repo_watches
+{
+    uv_loop_t* loop;
+    fs_event_cb cb;
+    path_map dirs; // relative directory path -> fs_event_req_node
+    fs_poller* cold; // demoted directories, NULL without --cold-after
+    uv_timer_t* demote_timer;
+} repo_watches;
+
+#define RACY_DIR_SECONDS 2
+#define COLD_POLL_INTERVAL 1000 // ms, backs off for directories that stay cold
+#define DEMOTE_CHECK_MAX 60000 // ms
+
+bool watch_limit_logged = false;
+
+void linux_fs_cb(uv_fs_event_t* handle, const char* filename, int events,
+        int status);
 
 bool dir_exists(const char* path)
 {
@@ -32,91 +50,460 @@ bool dir_exists(const char* path)
     return result;
 }
 
-fs_event_req_node* add_to_list()
+void join_path(char* buf, size_t size, const char* dir, const char* name)
+{
+    if (dir[0] == '\0')
+        snprintf(buf, size, "%s", name);
+    else
+        snprintf(buf, size, "%s/%s", dir, name);
+}
+
+void close_cb(uv_handle_t* handle)
+{
+    fs_event_req_node* node = handle->data;
+    free(node->path);
+    free(node);
+}
+
+void close_node(fs_event_req_node* node)
 {
-    if (free_on_next_add)
+    uv_fs_event_stop(&node->fs_event_req);
+    uv_close((uv_handle_t*)(&node->fs_event_req), close_cb);
+}
+
+fs_event_req_node* add_watch(watched_repo* repo, const char* rel)
+{
+    repo_watches* ws = repo->watch_data;
+    fs_event_req_node* node = malloc(sizeof(fs_event_req_node));
+
+    size_t root_len = strlen(repo->path);
+    size_t rel_len = strlen(rel);
+    node->path = malloc(root_len + rel_len + 2);
+    memcpy(node->path, repo->path, root_len);
+    if (rel_len > 0)
     {
-        free_list();
-        free_on_next_add = false;
+        node->path[root_len] = '/';
+        memcpy(node->path + root_len + 1, rel, rel_len + 1);
+        node->rel = node->path + root_len + 1;
     }
+    else
+    {
+        node->path[root_len] = '\0';
+        node->rel = node->path + root_len;
+    }
+    node->repo = repo;
+    node->last_active = uv_now(ws->loop);
+
+    uv_fs_event_init(ws->loop, &node->fs_event_req);
+    node->fs_event_req.data = node;
+
+    int error = uv_fs_event_start(&node->fs_event_req, linux_fs_cb,
+            node->path, 0);
+    if (error < 0)
+    {
+        // a directory may vanish before it is watched, that is not an error
+        if (error != UV_ENOENT && !watch_limit_logged)
+            pflog("Cannot watch %s, %s", node->path, uv_strerror(error));
+        watch_limit_logged = true;
+        uv_close((uv_handle_t*)(&node->fs_event_req), close_cb);
+        return NULL;
+    }
+
+    path_map_add(&ws->dirs, node->rel, node);
+    repo->watched_dirs = (unsigned int)ws->dirs.count;
+    return node;
+}
+
+void listen_dirs_recursively(watched_repo* repo, const char* rel)
+{
+    DIR* dir;
+    struct dirent* entry;
+    fs_event_req_node* node = add_watch(repo, rel);
+
+    if (!node || !(dir = opendir(node->path)))
+        return;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN)
+        {
+            char path[2048];
+            if (strcmp(entry->d_name, ".") == 0 ||
+                    strcmp(entry->d_name, "..") == 0 ||
+                    strcmp(entry->d_name, ".git") == 0)
+                continue;
+
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                join_path(path, sizeof(path), node->path, entry->d_name);
+                if (!dir_exists(path))
+                    continue;
+            }
+
+            join_path(path, sizeof(path), rel, entry->d_name);
+            listen_dirs_recursively(repo, path);
+        }
+    }
+
+    closedir(dir);
+}
+
+void unwatch_subtree(watched_repo* repo, const char* rel)
+{
+    repo_watches* ws = repo->watch_data;
+    size_t rel_len = strlen(rel);
+    size_t count = 0;
+    fs_event_req_node** doomed = malloc(ws->dirs.count * sizeof(void*));
+
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (path_map_next(&ws->dirs, &it, &path, &value))
+    {
+        if (strncmp(path, rel, rel_len) == 0 &&
+                (rel_len == 0 || path[rel_len] == '\0' || path[rel_len] == '/'))
+            doomed[count++] = value;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        path_map_remove(&ws->dirs, doomed[i]->rel);
+        close_node(doomed[i]);
+    }
+
+    free(doomed);
+    repo->watched_dirs = (unsigned int)ws->dirs.count;
+
+    if (ws->cold)
+        fs_poller_remove(ws->cold, rel, true);
+}
+
+void update_watches(watched_repo* repo, const char* rel)
+{
+    repo_watches* ws = repo->watch_data;
+    char path[2048];
+    join_path(path, sizeof(path), repo->path, rel);
+
+    const char* name = strrchr(rel, '/');
+    name = name ? name + 1 : rel;
+    if (strcmp(name, ".git") == 0)
+        return;
+
+    bool watched = path_map_contains(&ws->dirs, rel) ||
+        (ws->cold && fs_poller_contains(ws->cold, rel));
+    if (dir_exists(path))
+    {
+        if (!watched)
+            listen_dirs_recursively(repo, rel);
+    }
+    else if (watched)
+    {
+        unwatch_subtree(repo, rel);
+    }
+}
+
+void linux_fs_cb(uv_fs_event_t* handle, const char* filename, int events,
+        int status)
+{
+    fs_event_req_node* node = handle->data;
+    watched_repo* repo = node->repo;
+    repo_watches* ws = repo->watch_data;
+    char rel[2048];
+
+    if (status < 0 || !filename)
+        return;
 
-    if (fs_event_req_head == NULL)
+    node->last_active = uv_now(ws->loop);
+
+    if (events & UV_RENAME)
     {
-        fs_event_req_head = fs_event_req_tail = malloc(sizeof(fs_event_req_node));
-        fs_event_req_head->next = NULL;
+        // for IN_DELETE_SELF and IN_MOVE_SELF libuv reports the basename of
+        // the watched directory itself
+        const char* base = strrchr(node->path, '/');
+        base = base ? base + 1 : node->path;
+        if (strcmp(filename, base) == 0 && !dir_exists(node->path))
+        {
+            snprintf(rel, sizeof(rel), "%s", node->rel);
+            unwatch_subtree(repo, rel);
+            ws->cb(repo, rel, events);
+            return;
+        }
     }
+
+    join_path(rel, sizeof(rel), node->rel, filename);
+
+    if (events & UV_RENAME)
+        update_watches(repo, rel);
+
+    ws->cb(repo, rel, events);
+}
+
+// a change found by the sweep of a cold directory brings its watch back
+void promote(watched_repo* repo, const char* rel)
+{
+    repo_watches* ws = repo->watch_data;
+    char copy[2048];
+    snprintf(copy, sizeof(copy), "%s", rel);
+
+    fs_poller_remove(ws->cold, copy, false);
+
+    // whatever changed between the poll and the new watch
+    if (add_watch(repo, copy) && copy[0] != '\0')
+        ws->cb(repo, copy, UV_CHANGE);
+}
+
+void cold_cb(watched_repo* repo, const char* path, int events)
+{
+    repo_watches* ws = repo->watch_data;
+    char parent[2048];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char* slash = strrchr(parent, '/');
+    if (slash)
+        *slash = '\0';
     else
+        parent[0] = '\0';
+
+    // the sweep reports the entries of a directory, or the directory itself
+    // when it changed before the first sweep
+    if (fs_poller_contains(ws->cold, path))
+        promote(repo, path);
+    else if (path[0] != '\0' && fs_poller_contains(ws->cold, parent))
+        promote(repo, parent);
+
+    if (events & UV_RENAME)
+        update_watches(repo, path);
+
+    ws->cb(repo, path, events);
+}
+
+// directories without events for --cold-after seconds lose their watch and
+// are swept for changes instead, so that the number of watches follows the
+// directories that are actually in use
+void demote_cb(uv_timer_t* handle)
+{
+    watched_repo* repo = handle->data;
+    repo_watches* ws = repo->watch_data;
+    uint64_t now = uv_now(ws->loop);
+    uint64_t idle = (uint64_t)get_cold_after() * 1000;
+    size_t count = 0;
+    fs_event_req_node** doomed = malloc((ws->dirs.count + 1) * sizeof(void*));
+
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (path_map_next(&ws->dirs, &it, &path, &value))
     {
-        fs_event_req_tail->next = malloc(sizeof(fs_event_req_node));
-        fs_event_req_tail = fs_event_req_tail->next;
-        fs_event_req_tail->next = NULL;
+        fs_event_req_node* node = value;
+        if (now - node->last_active >= idle)
+            doomed[count++] = node;
     }
 
-    return fs_event_req_tail;
+    // changes made while the last events are still queued show up as newer
+    // than since in the first sweep
+    int64_t since = ((int64_t)time(NULL) - 1) * 1000000000;
+    for (size_t i = 0; i < count; ++i)
+    {
+        fs_poller_add(ws->cold, doomed[i]->rel, since);
+        path_map_remove(&ws->dirs, doomed[i]->rel);
+        close_node(doomed[i]);
+    }
+
+    free(doomed);
+    repo->watched_dirs = (unsigned int)ws->dirs.count;
+
+    if (count > 0)
+        pflog("%s: %u directories demoted, %u watched, %u swept", repo->path,
+                (unsigned)count, repo->watched_dirs,
+                (unsigned)fs_poller_count(ws->cold));
 }
 
-void free_list()
+void demote_timer_close_cb(uv_handle_t* handle)
 {
-    fs_event_req_node* it = fs_event_req_head;
-    while (it)
+    free(handle);
+}
+
+void init_watches(uv_loop_t* loop, watched_repo* repo, fs_event_cb cb)
+{
+    repo_watches* ws = malloc(sizeof(repo_watches));
+    ws->loop = loop;
+    ws->cb = cb;
+    path_map_init(&ws->dirs);
+    ws->cold = NULL;
+    ws->demote_timer = NULL;
+    repo->watch_data = ws;
+
+    if (get_cold_after() > 0)
     {
-        fs_event_req_node* temp = it;
-        it = it->next;
-        free(temp);
+        uint64_t idle = (uint64_t)get_cold_after() * 1000;
+        uint64_t check = idle / 2 < DEMOTE_CHECK_MAX ? idle / 2 : DEMOTE_CHECK_MAX;
+        if (check == 0)
+            check = 1;
+
+        ws->cold = fs_poller_new(loop, repo, cold_cb, COLD_POLL_INTERVAL, false);
+        ws->demote_timer = malloc(sizeof(uv_timer_t));
+        uv_timer_init(loop, ws->demote_timer);
+        ws->demote_timer->data = repo;
+        uv_timer_start(ws->demote_timer, demote_cb, check, check);
     }
-    fs_event_req_head = fs_event_req_tail = NULL;
 }
 
-void listen_dirs_recursively(uv_loop_t* loop, void(*fs_cb)(
-        uv_fs_event_t* handle, const char* filename, int events, int status),
-        const char *name)
+void fs_listener_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb)
+{
+    init_watches(loop, repo, cb);
+    listen_dirs_recursively(repo, "");
+}
+
+bool stat_path(const char* path, uv_stat_t* st)
+{
+    uv_fs_t req;
+    int error = uv_fs_stat(NULL, &req, path, NULL);
+    if (error == 0)
+        *st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+    return error == 0;
+}
+
+// entries created or renamed while gwatch was not running
+void rescan_dir(watched_repo* repo, fs_event_req_node* node,
+        const warm_state* state, path_map* dirty)
 {
     DIR* dir;
     struct dirent* entry;
+    char rel[2048];
+    char path[2048];
 
-    if (!(dir = opendir(name)))
+    if (!(dir = opendir(node->path)))
         return;
 
-    fs_event_req_node* node = add_to_list();
-    uv_fs_event_init(loop, &node->fs_event_req);
-    uv_fs_event_start(&node->fs_event_req, fs_cb, name, 0);
-
     while ((entry = readdir(dir)) != NULL)
     {
-        if (entry->d_type == DT_DIR)
+        if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0 ||
+                strcmp(entry->d_name, ".git") == 0)
+            continue;
+
+        join_path(rel, sizeof(rel), node->rel, entry->d_name);
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
         {
-            char path[2048];
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-            snprintf(path, sizeof(path), "%s/%s", name, entry->d_name);
-            listen_dirs_recursively(loop, fs_cb, path);
+            join_path(path, sizeof(path), node->path, entry->d_name);
+            is_dir = dir_exists(path);
+        }
+
+        if (is_dir && !state_has_dir(state, rel))
+        {
+            listen_dirs_recursively(repo, rel);
+            path_map_add(dirty, rel, NULL);
+        }
+        else if (!is_dir && !state_has_file(state, rel))
+        {
+            path_map_add(dirty, rel, NULL);
         }
     }
 
     closedir(dir);
 }
 
-void fs_listener_start_impl(uv_loop_t* loop, void(*fs_cb)(
-        uv_fs_event_t* handle, const char* filename, int events, int status))
+bool fs_listener_warm_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb, const warm_state* state, path_map* dirty)
+{
+    if (!state_has_dir(state, ""))
+        return false;
+
+    init_watches(loop, repo, cb);
+    repo_watches* ws = repo->watch_data;
+
+    for (size_t i = 0; i < state->dir_count; ++i)
+    {
+        const warm_dir* dir = &state->dirs[i];
+        uv_stat_t st;
+
+        // already watched as a part of a new subtree
+        if (path_map_contains(&ws->dirs, dir->path))
+            continue;
+
+        // removed directories show up as a changed mtime of their parent and
+        // their files are checked against the index anyway
+        fs_event_req_node* node = add_watch(repo, dir->path);
+        if (!node)
+            continue;
+
+        // the watch is already in place, later changes are not missed
+        if (!stat_path(node->path, &st) ||
+                st.st_mtim.tv_sec != dir->mtime_sec ||
+                (uint32_t)st.st_mtim.tv_nsec != dir->mtime_nsec)
+            rescan_dir(repo, node, state, dirty);
+    }
+
+    return true;
+}
+
+void snapshot_dir(watched_repo* repo, const char* path, warm_dir* dirs,
+        size_t* count, time_t now)
 {
-    listen_dirs_recursively(loop, fs_cb, get_repo_path());
+    char full[2048];
+    if (path[0] == '\0')
+        snprintf(full, sizeof(full), "%s", repo->path);
+    else
+        join_path(full, sizeof(full), repo->path, path);
+
+    uv_stat_t st;
+    if (!stat_path(full, &st))
+        return;
+
+    size_t len = strlen(path);
+    warm_dir* dir = &dirs[(*count)++];
+    dir->path = malloc(len + 1);
+    memcpy(dir->path, path, len + 1);
+    dir->mtime_sec = st.st_mtim.tv_sec;
+    dir->mtime_nsec = (uint32_t)st.st_mtim.tv_nsec;
+
+    // the events of a change this recent may still be queued, such racily
+    // clean directories are always re-read on the next start
+    if (st.st_mtim.tv_sec >= now - RACY_DIR_SECONDS)
+    {
+        dir->mtime_sec = 0;
+        dir->mtime_nsec = 0;
+    }
 }
 
-void close_cb(uv_handle_t* handle)
+// cold directories are watched again on the next start
+warm_dir* fs_listener_snapshot_impl(watched_repo* repo, size_t* count)
 {
-    (void)handle;
-    free_on_next_add = true;
+    repo_watches* ws = repo->watch_data;
+    size_t cold = ws->cold ? fs_poller_count(ws->cold) : 0;
+    warm_dir* dirs = malloc((ws->dirs.count + cold + 1) * sizeof(warm_dir));
+    time_t now = time(NULL);
+    *count = 0;
+
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (path_map_next(&ws->dirs, &it, &path, &value))
+        snapshot_dir(repo, path, dirs, count, now);
+
+    it = 0;
+    while (ws->cold && fs_poller_next(ws->cold, &it, &path))
+        snapshot_dir(repo, path, dirs, count, now);
+
+    return dirs;
 }
 
-void fs_listener_stop_impl(uv_fs_event_t* handle)
+void fs_listener_stop_impl(watched_repo* repo)
 {
-    (void)handle;
+    repo_watches* ws = repo->watch_data;
+    if (!ws)
+        return;
 
-    fs_event_req_node* it = fs_event_req_head;
-    while (it)
+    unwatch_subtree(repo, "");
+    path_map_free(&ws->dirs);
+    if (ws->cold)
     {
-        uv_fs_event_stop(&it->fs_event_req);
-        uv_close((uv_handle_t*)(&it->fs_event_req), close_cb);
-        it = it->next;
+        fs_poller_free(ws->cold);
+        uv_close((uv_handle_t*)ws->demote_timer, demote_timer_close_cb);
     }
+    free(ws);
+    repo->watch_data = NULL;
 }
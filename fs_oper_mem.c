@@ -0,0 +1,248 @@
+#include "fs_oper_mem.h"
+#include "path_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct mem_watch
+{
+    watched_repo* repo;
+    fs_event_cb cb;
+    size_t root_len;
+    struct mem_watch* next;
+} mem_watch;
+
+uv_once_t memfs_once = UV_ONCE_INIT;
+uv_mutex_t memfs_mutex;
+path_map memfs_dirs; // path -> NULL
+path_map memfs_files; // path -> uint64_t version
+mem_watch* memfs_watches = NULL; // loop thread only
+
+void memfs_init()
+{
+    uv_mutex_init(&memfs_mutex);
+    path_map_init(&memfs_dirs);
+    path_map_init(&memfs_files);
+}
+
+void memfs_lock()
+{
+    uv_once(&memfs_once, memfs_init);
+    uv_mutex_lock(&memfs_mutex);
+}
+
+void memfs_unlock()
+{
+    uv_mutex_unlock(&memfs_mutex);
+}
+
+bool is_below(const char* path, const char* root, size_t root_len)
+{
+    return strncmp(path, root, root_len) == 0 &&
+        (path[root_len] == '\0' || path[root_len] == '/');
+}
+
+size_t count_below(const path_map* map, const char* root, size_t root_len)
+{
+    size_t count = 0;
+    size_t it = 0;
+    const char* path;
+    while (path_map_next(map, &it, &path, NULL))
+    {
+        if (is_below(path, root, root_len))
+            ++count;
+    }
+    return count;
+}
+
+// hands the event to the repository whose tree contains path
+void notify(const char* path, int events, bool dirs_changed)
+{
+    for (mem_watch* w = memfs_watches; w; w = w->next)
+    {
+        if (!is_below(path, w->repo->path, w->root_len) ||
+                path[w->root_len] == '\0')
+            continue;
+
+        if (dirs_changed)
+        {
+            memfs_lock();
+            w->repo->watched_dirs = (unsigned int)count_below(&memfs_dirs,
+                    w->repo->path, w->root_len);
+            memfs_unlock();
+        }
+        w->cb(w->repo, path + w->root_len + 1, events);
+        return;
+    }
+}
+
+void memfs_mkdir(const char* path)
+{
+    memfs_lock();
+    bool added = path_map_add(&memfs_dirs, path, NULL);
+    memfs_unlock();
+
+    if (added)
+        notify(path, UV_RENAME, true);
+}
+
+uint64_t memfs_write(const char* path)
+{
+    memfs_lock();
+    uint64_t* version = path_map_get(&memfs_files, path);
+    bool created = !version;
+    if (created)
+    {
+        version = calloc(1, sizeof(uint64_t));
+        path_map_add(&memfs_files, path, version);
+    }
+    uint64_t current = ++*version;
+    memfs_unlock();
+
+    notify(path, created ? UV_RENAME : UV_CHANGE, false);
+    return current;
+}
+
+void remove_below(path_map* map, const char* path, bool free_values)
+{
+    size_t len = strlen(path);
+    size_t count = 0;
+    char** doomed = malloc(map->count * sizeof(char*));
+
+    size_t it = 0;
+    const char* key;
+    void* value;
+    while (path_map_next(map, &it, &key, &value))
+    {
+        if (is_below(key, path, len))
+        {
+            doomed[count] = malloc(strlen(key) + 1);
+            strcpy(doomed[count++], key);
+            if (free_values)
+                free(value);
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        path_map_remove(map, doomed[i]);
+        free(doomed[i]);
+    }
+    free(doomed);
+}
+
+void memfs_remove(const char* path)
+{
+    memfs_lock();
+    bool was_dir = path_map_contains(&memfs_dirs, path);
+    remove_below(&memfs_files, path, true);
+    remove_below(&memfs_dirs, path, false);
+    memfs_unlock();
+
+    notify(path, UV_RENAME, was_dir);
+}
+
+uint64_t memfs_file_version(const char* path)
+{
+    memfs_lock();
+    uint64_t* version = path_map_get(&memfs_files, path);
+    uint64_t current = version ? *version : 0;
+    memfs_unlock();
+    return current;
+}
+
+void memfs_foreach_file(const char* root,
+        void(*fn)(const char* rel, uint64_t version, void* arg), void* arg)
+{
+    size_t root_len = strlen(root);
+
+    memfs_lock();
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (path_map_next(&memfs_files, &it, &path, &value))
+    {
+        if (is_below(path, root, root_len) && path[root_len] == '/')
+            fn(path + root_len + 1, *(uint64_t*)value, arg);
+    }
+    memfs_unlock();
+}
+
+void memfs_clear()
+{
+    memfs_lock();
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (path_map_next(&memfs_files, &it, &path, &value))
+        free(value);
+    path_map_clear(&memfs_files);
+    path_map_clear(&memfs_dirs);
+    memfs_unlock();
+}
+
+bool dir_exists(const char* path)
+{
+    memfs_lock();
+    bool exists = path_map_contains(&memfs_dirs, path);
+    memfs_unlock();
+    return exists;
+}
+
+void fs_listener_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb)
+{
+    (void)loop;
+
+    mem_watch* w = malloc(sizeof(mem_watch));
+    w->repo = repo;
+    w->cb = cb;
+    w->root_len = strlen(repo->path);
+    w->next = memfs_watches;
+    memfs_watches = w;
+    repo->watch_data = w;
+
+    memfs_lock();
+    repo->watched_dirs = (unsigned int)count_below(&memfs_dirs, repo->path,
+            w->root_len);
+    memfs_unlock();
+}
+
+void fs_listener_stop_impl(watched_repo* repo)
+{
+    mem_watch* w = repo->watch_data;
+    if (!w)
+        return;
+
+    for (mem_watch** it = &memfs_watches; *it; it = &(*it)->next)
+    {
+        if (*it == w)
+        {
+            *it = w->next;
+            break;
+        }
+    }
+
+    free(w);
+    repo->watch_data = NULL;
+    repo->watched_dirs = 0;
+}
+
+// nothing survives the process, there is no state to start from
+bool fs_listener_warm_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb, const warm_state* state, path_map* dirty)
+{
+    (void)loop;
+    (void)repo;
+    (void)cb;
+    (void)state;
+    (void)dirty;
+    return false;
+}
+
+warm_dir* fs_listener_snapshot_impl(watched_repo* repo, size_t* count)
+{
+    (void)repo;
+    *count = 0;
+    return NULL;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "fs_oper.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// An in-memory tree behind fs_oper.h, linked instead of fs_oper_linux.c or
+// fs_oper_win.c. Paths are absolute keys that never touch the disk, e.g.
+// "/mem/repo/dir/file". Changes are made from the loop thread and deliver
+// their events synchronously to the repository watching the path, the way
+// the real backends do from their callbacks. File versions can be read from
+// any thread.
+
+void memfs_mkdir(const char* path);
+// creates the file or bumps its version, returns the new version
+uint64_t memfs_write(const char* path);
+// a file or a directory with everything below it
+void memfs_remove(const char* path);
+
+// 0 when the file does not exist
+uint64_t memfs_file_version(const char* path);
+// every file below root, with its path relative to root
+void memfs_foreach_file(const char* root,
+        void(*fn)(const char* rel, uint64_t version, void* arg), void* arg);
+void memfs_clear();
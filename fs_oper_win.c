@@ -1,7 +1,14 @@
 #include "fs_oper.h"
-#include "args.h"
 
-uv_fs_event_t fs_event_req;
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct repo_watch
+{
+    uv_fs_event_t fs_event_req;
+    watched_repo* repo;
+    fs_event_cb cb;
+} repo_watch;
 
 bool dir_exists(const char* path)
 {
@@ -10,16 +17,79 @@ bool dir_exists(const char* path)
         (dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
 }
 
-void fs_listener_start_impl(uv_loop_t* loop, void(*fs_cb)(
-        uv_fs_event_t* handle, const char* filename, int events, int status))
+void win_fs_cb(uv_fs_event_t* handle, const char* filename, int events,
+        int status)
 {
-    uv_fs_event_init(loop, &fs_event_req);
-    uv_fs_event_start(&fs_event_req, fs_cb, get_repo_path(),
+    repo_watch* watch = handle->data;
+    char rel[MAX_PATH * 4];
+
+    if (status < 0)
+        return;
+
+    if (!filename)
+    {
+        watch->cb(watch->repo, "", events);
+        return;
+    }
+
+    snprintf(rel, sizeof(rel), "%s", filename);
+    for (char* it = rel; *it; ++it)
+    {
+        if (*it == '\\')
+            *it = '/';
+    }
+
+    watch->cb(watch->repo, rel, events);
+}
+
+void fs_listener_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb)
+{
+    repo_watch* watch = malloc(sizeof(repo_watch));
+    watch->repo = repo;
+    watch->cb = cb;
+
+    uv_fs_event_init(loop, &watch->fs_event_req);
+    watch->fs_event_req.data = watch;
+    uv_fs_event_start(&watch->fs_event_req, win_fs_cb, repo->path,
         UV_FS_EVENT_RECURSIVE);
+
+    repo->watch_data = watch;
+    repo->watched_dirs = 1;
+}
+
+void close_cb(uv_handle_t* handle)
+{
+    free(handle->data);
+}
+
+void fs_listener_stop_impl(watched_repo* repo)
+{
+    repo_watch* watch = repo->watch_data;
+    if (!watch)
+        return;
+
+    uv_fs_event_stop(&watch->fs_event_req);
+    uv_close((uv_handle_t*)&watch->fs_event_req, close_cb);
+    repo->watch_data = NULL;
+    repo->watched_dirs = 0;
+}
+
+bool fs_listener_warm_start_impl(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb, const warm_state* state, path_map* dirty)
+{
+    // one recursive watch covers everything, there is nothing to save on
+    (void)loop;
+    (void)repo;
+    (void)cb;
+    (void)state;
+    (void)dirty;
+    return false;
 }
 
-void fs_listener_stop_impl(uv_fs_event_t* handle)
+warm_dir* fs_listener_snapshot_impl(watched_repo* repo, size_t* count)
 {
-    uv_fs_event_stop(handle);
-    uv_close((uv_handle_t*)handle, NULL);
+    (void)repo;
+    *count = 0;
+    return NULL;
 }
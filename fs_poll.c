@@ -0,0 +1,570 @@
+#include "fs_poll.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define POLL_MAX_BACKOFF 32 // unchanged directories are polled this much less often
+#define POLL_MAX_JOBS 64 // directories polled at once by a tick
+#define POLL_RACY_SECONDS 2
+
+typedef struct poll_entry
+{
+    uint32_t name; // offset into the names of the directory
+    uint32_t mode;
+    int64_t mtime; // ns
+    int64_t ctime; // ns
+    uint64_t size;
+    uint64_t ino;
+} poll_entry;
+
+// the last seen state of a directory, the entries are sorted by name
+typedef struct poll_dir
+{
+    char* rel;
+    char* names;
+    poll_entry* entries;
+    size_t count;
+    int64_t mtime; // ns, of the directory itself
+    bool racy; // the mtime was too recent to tell whether entries were added
+    bool baseline; // the snapshot is valid, differences are reported
+    bool reported; // new directory, everything found by the first poll is new
+    int64_t since; // ns, otherwise the first poll reports what changed after
+    bool busy; // a job reads the directory
+    bool gone; // forgotten while busy, freed when the job is done
+    uint64_t interval; // ms
+    uint64_t due; // loop time
+} poll_dir;
+
+struct fs_poller
+{
+    uv_loop_t* loop;
+    fs_event_cb cb;
+    watched_repo* repo;
+    path_map dirs; // relative directory path -> poll_dir
+    uv_timer_t timer;
+    uint64_t interval; // ms
+    unsigned int jobs;
+    bool recursive;
+    bool stopped; // released once the jobs and the timer are done
+    bool timer_open;
+};
+
+typedef struct poll_job
+{
+    uv_work_t req;
+    fs_poller* poller;
+    poll_dir* dir;
+    char* path;
+
+    // filled in on the threadpool
+    int error;
+    int64_t mtime;
+    bool racy;
+    char* names;
+    size_t names_size;
+    poll_entry* entries;
+    size_t count;
+} poll_job;
+
+void poll_submit(fs_poller* poller, poll_dir* dir);
+
+void poll_join(char* buf, size_t size, const char* dir, const char* name)
+{
+    if (dir[0] == '\0')
+        snprintf(buf, size, "%s", name);
+    else
+        snprintf(buf, size, "%s/%s", dir, name);
+}
+
+bool poll_lstat(const char* path, uv_stat_t* st)
+{
+    uv_fs_t req;
+    int error = uv_fs_lstat(NULL, &req, path, NULL);
+    if (error == 0)
+        *st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+    return error == 0;
+}
+
+int64_t poll_ns(const uv_timespec_t* t)
+{
+    return (int64_t)t->tv_sec * 1000000000 + (int64_t)t->tv_nsec;
+}
+
+bool poll_stat(const char* path, uv_stat_t* st)
+{
+    uv_fs_t req;
+    int error = uv_fs_stat(NULL, &req, path, NULL);
+    if (error == 0)
+        *st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+    return error == 0;
+}
+
+bool poll_is_dir(const poll_entry* entry)
+{
+    return (entry->mode & S_IFMT) == S_IFDIR;
+}
+
+char* poll_copy(const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* copy = malloc(len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+int poll_compare(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void poll_free_dir(poll_dir* dir)
+{
+    free(dir->rel);
+    free(dir->names);
+    free(dir->entries);
+    free(dir);
+}
+
+void poll_release(fs_poller* poller)
+{
+    if (poller->stopped && poller->jobs == 0 && !poller->timer_open)
+        free(poller);
+}
+
+void poll_timer_close_cb(uv_handle_t* handle)
+{
+    fs_poller* poller = handle->data;
+    poller->timer_open = false;
+    poll_release(poller);
+}
+
+poll_dir* poll_add_dir(fs_poller* poller, const char* rel, bool reported,
+        int64_t since)
+{
+    size_t len = strlen(rel);
+    poll_dir* dir = calloc(1, sizeof(poll_dir));
+    dir->rel = malloc(len + 1);
+    memcpy(dir->rel, rel, len + 1);
+    dir->reported = reported;
+    dir->since = since;
+    dir->interval = poller->interval;
+    dir->due = uv_now(poller->loop);
+
+    path_map_add(&poller->dirs, dir->rel, dir);
+    if (poller->recursive)
+        poller->repo->watched_dirs = (unsigned int)poller->dirs.count;
+    return dir;
+}
+
+void poll_forget(fs_poller* poller, const char* rel, bool subtree)
+{
+    size_t rel_len = strlen(rel);
+    size_t count = 0;
+    poll_dir** doomed = malloc((poller->dirs.count + 1) * sizeof(void*));
+
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (path_map_next(&poller->dirs, &it, &path, &value))
+    {
+        if (strncmp(path, rel, rel_len) == 0 && (path[rel_len] == '\0' ||
+                    (subtree && (rel_len == 0 || path[rel_len] == '/'))))
+            doomed[count++] = value;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        path_map_remove(&poller->dirs, doomed[i]->rel);
+        if (doomed[i]->busy)
+            doomed[i]->gone = true;
+        else
+            poll_free_dir(doomed[i]);
+    }
+
+    free(doomed);
+    if (poller->recursive)
+        poller->repo->watched_dirs = (unsigned int)poller->dirs.count;
+}
+
+void poll_append(poll_job* job, size_t* capacity, size_t* names_capacity,
+        const char* name, const uv_stat_t* st)
+{
+    size_t len = strlen(name) + 1;
+    if (job->names_size + len > *names_capacity)
+    {
+        while (job->names_size + len > *names_capacity)
+            *names_capacity = *names_capacity ? *names_capacity * 2 : 256;
+        job->names = realloc(job->names, *names_capacity);
+    }
+    if (job->count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        job->entries = realloc(job->entries, *capacity * sizeof(poll_entry));
+    }
+
+    poll_entry* entry = &job->entries[job->count++];
+    entry->name = (uint32_t)job->names_size;
+    entry->mode = (uint32_t)st->st_mode;
+    entry->mtime = poll_ns(&st->st_mtim);
+    entry->ctime = poll_ns(&st->st_ctim);
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+
+    memcpy(job->names + job->names_size, name, len);
+    job->names_size += len;
+}
+
+// the names to stat: while the mtime of the directory is unchanged no entry
+// was added or removed and the previous names are used (the snapshot is not
+// touched while the job runs), otherwise the directory is read again and
+// the names are owned by the caller
+char** poll_names(poll_job* job, size_t* count, bool* owned)
+{
+    poll_dir* dir = job->dir;
+    char** names;
+    *count = 0;
+    *owned = false;
+
+    if (dir->baseline && !dir->racy && job->mtime == dir->mtime)
+    {
+        names = malloc((dir->count + 1) * sizeof(char*));
+        for (size_t i = 0; i < dir->count; ++i)
+            names[(*count)++] = dir->names + dir->entries[i].name;
+        return names;
+    }
+
+    uv_fs_t req;
+    int result = uv_fs_scandir(NULL, &req, job->path, 0, NULL);
+    if (result < 0)
+    {
+        job->error = result;
+        uv_fs_req_cleanup(&req);
+        return NULL;
+    }
+
+    uv_dirent_t entry;
+    names = malloc(((size_t)result + 1) * sizeof(char*));
+    while (uv_fs_scandir_next(&req, &entry) != UV_EOF)
+    {
+        if (strcmp(entry.name, ".git") != 0)
+            names[(*count)++] = poll_copy(entry.name);
+    }
+    uv_fs_req_cleanup(&req);
+    *owned = true;
+
+    qsort(names, *count, sizeof(char*), poll_compare);
+    return names;
+}
+
+void poll_work(uv_work_t* req)
+{
+    poll_job* job = req->data;
+    uv_stat_t st;
+
+    if (!poll_stat(job->path, &st) || (st.st_mode & S_IFMT) != S_IFDIR)
+    {
+        job->error = UV_ENOENT;
+        return;
+    }
+    job->mtime = poll_ns(&st.st_mtim);
+    job->racy = (int64_t)time(NULL) - (int64_t)st.st_mtim.tv_sec <
+        POLL_RACY_SECONDS;
+
+    size_t count;
+    bool owned;
+    char** names = poll_names(job, &count, &owned);
+    if (!names)
+        return;
+
+    size_t capacity = 0;
+    size_t names_capacity = 0;
+    char path[4096];
+    for (size_t i = 0; i < count; ++i)
+    {
+        // an entry removed in the meantime is simply not there
+        poll_join(path, sizeof(path), job->path, names[i]);
+        if (poll_lstat(path, &st))
+            poll_append(job, &capacity, &names_capacity, names[i], &st);
+        if (owned)
+            free(names[i]);
+    }
+    free(names);
+}
+
+// keeps the polled directories in line with an entry that appeared or
+// disappeared, old or cur is NULL
+void poll_replace(fs_poller* poller, poll_dir* dir, const char* name,
+        const poll_entry* old, const poll_entry* cur, bool report)
+{
+    char rel[4096];
+    poll_join(rel, sizeof(rel), dir->rel, name);
+
+    if (old && poll_is_dir(old))
+        poll_forget(poller, rel, true);
+
+    // everything in a new directory is new as well, without recursion new
+    // directories are only reported
+    if (poller->recursive && cur && poll_is_dir(cur) &&
+            !path_map_contains(&poller->dirs, rel))
+        poll_submit(poller, poll_add_dir(poller, rel, report, 0));
+
+    if (report)
+        poller->cb(poller->repo, rel, UV_RENAME);
+}
+
+// reports the differences to the previous snapshot, returns whether there
+// were any
+bool poll_diff(fs_poller* poller, poll_dir* dir, const poll_job* job)
+{
+    bool report = dir->baseline || dir->reported;
+    bool changed = false;
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < dir->count || j < job->count)
+    {
+        const poll_entry* old = i < dir->count ? &dir->entries[i] : NULL;
+        const poll_entry* cur = j < job->count ? &job->entries[j] : NULL;
+        const char* old_name = old ? dir->names + old->name : NULL;
+        const char* cur_name = cur ? job->names + cur->name : NULL;
+        int order = !old ? 1 : !cur ? -1 : strcmp(old_name, cur_name);
+
+        if (order < 0)
+        {
+            poll_replace(poller, dir, old_name, old, NULL, true);
+            changed = true;
+            ++i;
+            continue;
+        }
+        if (order > 0)
+        {
+            poll_replace(poller, dir, cur_name, NULL, cur, report ||
+                    (dir->since > 0 && (cur->mtime >= dir->since ||
+                                        cur->ctime >= dir->since)));
+            changed = true;
+            ++j;
+            continue;
+        }
+
+        // a file saved by renaming a new one over it gets a new inode,
+        // subdirectories are polled on their own
+        if ((old->mode & S_IFMT) != (cur->mode & S_IFMT) || old->ino != cur->ino)
+        {
+            poll_replace(poller, dir, cur_name, old, cur, true);
+            changed = true;
+        }
+        else if (!poll_is_dir(cur) && (old->mtime != cur->mtime ||
+                    old->ctime != cur->ctime || old->size != cur->size ||
+                    old->mode != cur->mode))
+        {
+            char rel[4096];
+            poll_join(rel, sizeof(rel), dir->rel, cur_name);
+            poller->cb(poller->repo, rel, UV_CHANGE);
+            changed = true;
+        }
+        ++i;
+        ++j;
+    }
+
+    return changed;
+}
+
+void poll_done(uv_work_t* req, int status)
+{
+    (void)status;
+    poll_job* job = req->data;
+    fs_poller* poller = job->poller;
+    poll_dir* dir = job->dir;
+    bool changed = false;
+
+    // the directory stays busy while the callbacks run, so that it is not
+    // freed under the diff when one of them forgets it; a stopped poller
+    // has forgotten all of them
+    --poller->jobs;
+
+    if (!dir->gone && job->error < 0)
+    {
+        // a removed directory is also reported by its parent, the root is
+        // reported once and left to the listener
+        if (dir->rel[0] != '\0')
+        {
+            char rel[4096];
+            snprintf(rel, sizeof(rel), "%s", dir->rel);
+            poll_forget(poller, rel, true);
+            poller->cb(poller->repo, rel, UV_RENAME);
+        }
+        else if (dir->baseline)
+        {
+            dir->baseline = false;
+            poller->cb(poller->repo, "", UV_RENAME);
+        }
+    }
+    else if (!dir->gone)
+    {
+        // entries removed since are only visible in the directory mtime
+        if (!dir->baseline && dir->since > 0 && job->mtime >= dir->since)
+        {
+            char rel[4096];
+            snprintf(rel, sizeof(rel), "%s", dir->rel);
+            poller->cb(poller->repo, rel, UV_CHANGE);
+            changed = true;
+        }
+
+        changed = poll_diff(poller, dir, job) || changed;
+
+        free(dir->names);
+        free(dir->entries);
+        dir->names = job->names;
+        dir->entries = job->entries;
+        dir->count = job->count;
+        job->names = NULL;
+        job->entries = NULL;
+        dir->mtime = job->mtime;
+        dir->racy = job->racy;
+        dir->baseline = true;
+        dir->reported = false;
+        dir->since = 0;
+    }
+
+    dir->busy = false;
+    if (dir->gone)
+    {
+        poll_free_dir(dir);
+    }
+    else
+    {
+        // a directory that changed is polled at the base interval again,
+        // one that did not backs off
+        uint64_t max = poller->interval * POLL_MAX_BACKOFF;
+        if (changed)
+            dir->interval = poller->interval;
+        else if (dir->interval < max)
+            dir->interval = dir->interval * 2 < max ? dir->interval * 2 : max;
+        dir->due = uv_now(poller->loop) + dir->interval;
+    }
+
+    free(job->path);
+    free(job->names);
+    free(job->entries);
+    free(job);
+    poll_release(poller);
+}
+
+void poll_submit(fs_poller* poller, poll_dir* dir)
+{
+    poll_job* job = calloc(1, sizeof(poll_job));
+    job->req.data = job;
+    job->poller = poller;
+    job->dir = dir;
+
+    size_t root_len = strlen(poller->repo->path);
+    size_t rel_len = strlen(dir->rel);
+    job->path = malloc(root_len + rel_len + 2);
+    memcpy(job->path, poller->repo->path, root_len + 1);
+    if (rel_len > 0)
+    {
+        job->path[root_len] = '/';
+        memcpy(job->path + root_len + 1, dir->rel, rel_len + 1);
+    }
+
+    dir->busy = true;
+    ++poller->jobs;
+    uv_queue_work(poller->loop, &job->req, poll_work, poll_done);
+}
+
+void poll_tick(uv_timer_t* handle)
+{
+    fs_poller* poller = handle->data;
+    uint64_t now = uv_now(poller->loop);
+
+    size_t it = 0;
+    const char* path;
+    void* value;
+    while (poller->jobs < POLL_MAX_JOBS &&
+            path_map_next(&poller->dirs, &it, &path, &value))
+    {
+        poll_dir* dir = value;
+        if (!dir->busy && dir->due <= now)
+            poll_submit(poller, dir);
+    }
+}
+
+fs_poller* fs_poller_new(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb, uint64_t interval, bool recursive)
+{
+    fs_poller* poller = calloc(1, sizeof(fs_poller));
+    poller->loop = loop;
+    poller->cb = cb;
+    poller->repo = repo;
+    poller->interval = interval;
+    poller->recursive = recursive;
+    path_map_init(&poller->dirs);
+
+    uv_timer_init(loop, &poller->timer);
+    poller->timer.data = poller;
+    poller->timer_open = true;
+    uv_timer_start(&poller->timer, poll_tick, interval, interval);
+    return poller;
+}
+
+void fs_poller_add(fs_poller* poller, const char* rel, int64_t since)
+{
+    if (!path_map_contains(&poller->dirs, rel))
+        poll_submit(poller, poll_add_dir(poller, rel, false, since));
+}
+
+void fs_poller_remove(fs_poller* poller, const char* rel, bool subtree)
+{
+    poll_forget(poller, rel, subtree);
+}
+
+bool fs_poller_contains(const fs_poller* poller, const char* rel)
+{
+    return path_map_contains(&poller->dirs, rel);
+}
+
+size_t fs_poller_count(const fs_poller* poller)
+{
+    return poller->dirs.count;
+}
+
+bool fs_poller_next(const fs_poller* poller, size_t* it, const char** rel)
+{
+    void* value;
+    return path_map_next(&poller->dirs, it, rel, &value);
+}
+
+void fs_poller_free(fs_poller* poller)
+{
+    poll_forget(poller, "", true);
+    path_map_free(&poller->dirs);
+    poller->stopped = true;
+    uv_close((uv_handle_t*)&poller->timer, poll_timer_close_cb);
+    poll_release(poller);
+}
+
+void fs_poll_start(uv_loop_t* loop, watched_repo* repo, fs_event_cb cb,
+        uint64_t interval)
+{
+    // new directories are submitted as they are found, so the first
+    // snapshot of the tree does not wait for the ticks
+    fs_poller* poller = fs_poller_new(loop, repo, cb, interval, true);
+    repo->watch_data = poller;
+    fs_poller_add(poller, "", 0);
+}
+
+void fs_poll_stop(watched_repo* repo)
+{
+    fs_poller* poller = repo->watch_data;
+    if (!poller)
+        return;
+
+    fs_poller_free(poller);
+    repo->watch_data = NULL;
+}
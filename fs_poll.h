@@ -0,0 +1,36 @@
+#pragma once
+
+#include "fs_oper.h"
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// polls directories on the threadpool and reports the entries that differ
+// from the last poll; a directory that changed is polled every interval ms,
+// unchanged ones less often
+typedef struct fs_poller fs_poller;
+
+// with recursive set, subdirectories are polled as they are found, otherwise
+// new ones are only reported
+fs_poller* fs_poller_new(uv_loop_t* loop, watched_repo* repo,
+        fs_event_cb cb, uint64_t interval, bool recursive);
+
+// the first poll of the directory reports nothing, or with since (ns since
+// the epoch) the entries and the directory itself if changed after that
+void fs_poller_add(fs_poller* poller, const char* rel, int64_t since);
+void fs_poller_remove(fs_poller* poller, const char* rel, bool subtree);
+bool fs_poller_contains(const fs_poller* poller, const char* rel);
+size_t fs_poller_count(const fs_poller* poller);
+bool fs_poller_next(const fs_poller* poller, size_t* it, const char** rel);
+
+// released once the jobs in flight are done
+void fs_poller_free(fs_poller* poller);
+
+// watches the whole tree by polling instead of the watcher of the platform,
+// for file systems that do not report changes (network mounts, FUSE)
+void fs_poll_start(uv_loop_t* loop, watched_repo* repo, fs_event_cb cb,
+        uint64_t interval);
+void fs_poll_stop(watched_repo* repo);
@@ -1,34 +1,82 @@
 #include "git.h"
 #include "logs.h"
 #include "args.h"
+#include "counting_odb.h"
+#include "delta_pack.h"
+#include "metrics.h"
+#include "pressure.h"
+#include "retention.h"
+#include "snapshot.h"
+#include "state.h"
+#include "thread_oper.h"
+#include "trace.h"
 
 #include <git2.h>
+#include <git2/sys/repository.h>
+#include <uv.h>
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
-int files_added = 0;
+// single index updates at least this slow get a span of their own
+#define SLOW_ADD_NS 1000000
+
+// a file written this recently may change again without a visible change of
+// its stat data, its blob id is not cached
+#define RACY_FILE_SECONDS 2
+
+typedef struct status_payload
+{
+    git_index* index;
+    pressure_budget* budget;
+    watched_repo* repo;
+    int files_added;
+    uint64_t add_time; // ns
+    int64_t index_mtime; // ns, entries at least as new are racily clean
+    bool index_refreshed; // stat data updated without a content change
+    int filemode; // core.filemode, -1 until a snapshot needs it
+} status_payload;
+
+typedef struct phase_clock
+{
+    uint64_t wall; // ns, uv_hrtime
+    uint64_t cpu;
+    commit_counts counts;
+} phase_clock;
+
+void log_git_error()
+{
+    const git_error* ge = giterr_last();
+    pflog("Git related error, %s", ge ? ge->message : "unknown");
+}
 
 bool check_error(int error)
 {
     if (error < 0)
     {
-        const git_error* ge = giterr_last();
-        pflog("Git related error, %s", ge->message);
+        log_git_error();
         return true;
     }
     return false;
 }
 
-bool check_if_valid_git_repo()
+void repo_log(const watched_repo* repo, const char* str)
+{
+    pflog("%s: %s", repo->path, str);
+}
+
+bool check_if_valid_git_repo(const char* path)
 {
     git_repository* repo = NULL;
 
-    if (check_error(git_repository_open(&repo, get_repo_path())))
+    if (check_error(git_repository_open(&repo, path)))
     {
         pflog("The path %s does not represent a valid Git "
                 "repository. You may want to create one using "
-                "`git init`", get_repo_path());
+                "`git init`", path);
         return false;
     }
     else
@@ -38,9 +86,218 @@ bool check_if_valid_git_repo()
     }
 }
 
+void start_phase(phase_clock* clock, const watched_repo* repo)
+{
+    clock->wall = uv_hrtime();
+    clock->cpu = trace_enabled() ? thread_cpu_time() : 0;
+    clock->counts = repo->counts;
+}
+
+// reports the phase since the clock was started and restarts it
+void end_phase(commit_phase phase, phase_clock* clock,
+        const watched_repo* repo)
+{
+    uint64_t duration = uv_hrtime() - clock->wall;
+    metrics_observe(phase, duration);
+
+    if (trace_enabled())
+    {
+        const commit_counts* now = &repo->counts;
+        const commit_counts* then = &clock->counts;
+        char args[256];
+        snprintf(args, sizeof(args), "\"files_visited\":%llu,"
+                "\"files_added\":%llu,\"bytes_hashed\":%llu,"
+                "\"bytes_written\":%llu,\"objects_written\":%llu",
+                (unsigned long long)(now->files_visited - then->files_visited),
+                (unsigned long long)(now->files_added - then->files_added),
+                (unsigned long long)(now->bytes_hashed - then->bytes_hashed),
+                (unsigned long long)(now->bytes_written - then->bytes_written),
+                (unsigned long long)(now->objects_written -
+                    then->objects_written));
+        trace_span(metrics_phase_name(phase), repo->path, NULL, clock->wall,
+                duration, thread_cpu_time() - clock->cpu, args);
+    }
+
+    start_phase(clock, repo);
+}
+
+int64_t stat_ns(const uv_timespec_t* t)
+{
+    return (int64_t)t->tv_sec * 1000000000 + (int64_t)t->tv_nsec;
+}
+
+int64_t index_time_ns(const git_index_time* t)
+{
+    return (int64_t)t->seconds * 1000000000 + (int64_t)t->nanoseconds;
+}
+
+void entry_set_stat(git_index_entry* entry, const uv_stat_t* st)
+{
+    entry->ctime.seconds = (int32_t)st->st_ctim.tv_sec;
+    entry->ctime.nanoseconds = (uint32_t)st->st_ctim.tv_nsec;
+    entry->mtime.seconds = (int32_t)st->st_mtim.tv_sec;
+    entry->mtime.nanoseconds = (uint32_t)st->st_mtim.tv_nsec;
+    entry->dev = (uint32_t)st->st_dev;
+    entry->ino = (uint32_t)st->st_ino;
+    entry->uid = (uint32_t)st->st_uid;
+    entry->gid = (uint32_t)st->st_gid;
+    entry->file_size = (uint32_t)st->st_size;
+}
+
+// the same comparison the status pass makes before it hashes a file
+bool entry_matches_stat(const git_index_entry* entry, const uv_stat_t* st)
+{
+    git_index_entry now = *entry;
+    entry_set_stat(&now, st);
+    return index_time_ns(&now.mtime) == index_time_ns(&entry->mtime) &&
+        index_time_ns(&now.ctime) == index_time_ns(&entry->ctime) &&
+        now.ino == entry->ino && now.uid == entry->uid &&
+        now.gid == entry->gid && now.file_size == entry->file_size;
+}
+
+// remembers the blob id of a file just added to the index; only when the
+// file was not written for a while, later writes then always change the key
+void cache_staged(status_payload* sp, const char* path, int64_t hashed_at)
+{
+    const git_index_entry* entry = git_index_get_bypath(sp->index, path, 0);
+    if (!entry || (entry->mode != GIT_FILEMODE_BLOB &&
+                entry->mode != GIT_FILEMODE_BLOB_EXECUTABLE))
+        return;
+
+    char full[4096];
+    snprintf(full, sizeof(full), "%s/%s", sp->repo->path, path);
+    uv_fs_t req;
+    int error = uv_fs_lstat(NULL, &req, full, NULL);
+    uv_stat_t st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+
+    if (error == 0 && st.st_mtim.tv_sec < hashed_at - RACY_FILE_SECONDS &&
+            entry_matches_stat(entry, &st))
+    {
+        hash_key key = { st.st_dev, st.st_ino, st.st_size,
+            stat_ns(&st.st_mtim), stat_ns(&st.st_ctim) };
+        hash_cache_put(&sp->repo->hash_cache, &key, &entry->id);
+    }
+}
+
+// versions of large files written to the repository are packed later
+void track_large_blob(status_payload* sp, const char* path)
+{
+    const git_index_entry* entry = git_index_get_bypath(sp->index, path, 0);
+    if (entry && entry->file_size >= DELTA_MIN_SIZE &&
+            (entry->mode == GIT_FILEMODE_BLOB ||
+             entry->mode == GIT_FILEMODE_BLOB_EXECUTABLE))
+        delta_pack_add(&sp->repo->delta_pack, path, &entry->id,
+                entry->file_size);
+}
+
+bool trust_filemode(git_repository* repo)
+{
+    git_config* config = NULL;
+    int value = 1;
+    if (git_repository_config_snapshot(&config, repo) < 0 ||
+            git_config_get_bool(&value, config, "core.filemode") < 0)
+        value = 1;
+    git_config_free(config);
+    return value != 0;
+}
+
+// the mode git_index_add_bypath would give the file: the executable bit,
+// unless core.filemode is false, or on Windows, where a tracked file keeps
+// the mode of its entry
+uint32_t snapshot_mode(status_payload* sp, const char* path,
+        const uv_stat_t* st)
+{
+    if (sp->filemode < 0)
+        sp->filemode = trust_filemode(sp->repo->git_repo);
+
+    const git_index_entry* entry = git_index_get_bypath(sp->index, path, 0);
+#ifndef WIN32
+    if (sp->filemode || !entry)
+        return (st->st_mode & S_IXUSR) && sp->filemode ?
+            GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
+#else
+    (void)st;
+    if (!entry)
+        return GIT_FILEMODE_BLOB;
+#endif
+    return entry->mode == GIT_FILEMODE_BLOB_EXECUTABLE ?
+        GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
+}
+
+// hashes a snapshot of the file instead of the file itself, so that a file
+// written to while it is hashed does not end up torn in the blob; files
+// that go through filters or cannot be snapshotted are added in place
+int add_snapshot(status_payload* sp, const char* path)
+{
+    git_repository* repo = sp->repo->git_repo;
+    git_filter_list* filters = NULL;
+    char full[4096];
+    char snapshot_path[2048];
+    snprintf(full, sizeof(full), "%s/%s", sp->repo->path, path);
+    repo_gwatch_path(sp->repo->git_dir, "snapshot", snapshot_path,
+            sizeof(snapshot_path));
+
+    uv_stat_t st;
+    if (git_filter_list_load(&filters, repo, NULL, path, GIT_FILTER_TO_ODB,
+                GIT_FILTER_DEFAULT) < 0 || filters ||
+            !snapshot_take(full, snapshot_path, &sp->repo->snapshot_no_clone,
+                &st))
+    {
+        git_filter_list_free(filters);
+        return git_index_add_bypath(sp->index, path);
+    }
+
+    git_oid id;
+    int error = git_blob_create_fromdisk(&id, repo, snapshot_path);
+    uv_fs_t req;
+    uv_fs_unlink(NULL, &req, snapshot_path, NULL);
+    uv_fs_req_cleanup(&req);
+    if (error < 0)
+        return error;
+
+    git_index_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.path = path;
+    entry.mode = snapshot_mode(sp, path, &st);
+    git_oid_cpy(&entry.id, &id);
+    entry_set_stat(&entry, &st);
+    return git_index_add(sp->index, &entry);
+}
+
+int update_index(status_payload* sp, const char* path, bool remove)
+{
+    uint64_t start = uv_hrtime();
+    uint64_t cpu = trace_enabled() ? thread_cpu_time() : 0;
+
+    int error = remove ? git_index_remove_bypath(sp->index, path) :
+        get_snapshot() ? add_snapshot(sp, path) :
+        git_index_add_bypath(sp->index, path);
+
+    // the whole file is read and hashed, whether its blob is new or not
+    const git_index_entry* entry = error == 0 && !remove ?
+        git_index_get_bypath(sp->index, path, 0) : NULL;
+    if (entry)
+    {
+        metrics_add(METRIC_BYTES_HASHED, entry->file_size);
+        sp->repo->counts.bytes_hashed += entry->file_size;
+    }
+
+    uint64_t duration = uv_hrtime() - start;
+    sp->add_time += duration;
+    if (duration >= SLOW_ADD_NS && trace_enabled())
+        trace_span(remove ? "remove_bypath" : "add_bypath", sp->repo->path,
+                path, start, duration, thread_cpu_time() - cpu, NULL);
+
+    return error;
+}
+
 int status_cb(const char* path, unsigned int status_flags, void* payload)
 {
-    git_index* index = (git_index*)payload;
+    status_payload* sp = (status_payload*)payload;
+
+    pressure_throttle(sp->budget);
+    ++sp->repo->counts.files_visited;
 
     if (strcmp(path, get_prog_name()) != 0 &&
             (status_flags & GIT_STATUS_IGNORED) == 0)
@@ -50,122 +307,551 @@ int status_cb(const char* path, unsigned int status_flags, void* payload)
             (status_flags & GIT_STATUS_WT_TYPECHANGE) ||
             (status_flags & GIT_STATUS_WT_RENAMED))
         {
-            if (check_error(git_index_add_bypath(index, path)))
+            int64_t hashed_at = (int64_t)time(NULL);
+            if (check_error(update_index(sp, path, false)))
             {
                 pflog("Cannot add %s to index", path);
                 return -1;
             }
+            cache_staged(sp, path, hashed_at);
+            track_large_blob(sp, path);
         }
         else if (status_flags & GIT_STATUS_WT_DELETED)
         {
-            if (check_error(git_index_remove_bypath(index, path)))
+            if (check_error(update_index(sp, path, true)))
             {
                 pflog("Cannot remove %s from index", path);
                 return -1;
             }
         }
 
-        ++files_added;
+        ++sp->files_added;
+        ++sp->repo->counts.files_added;
+    }
+
+    return 0;
+}
+
+bool blob_exists(git_repository* repo, const git_oid* id)
+{
+    git_odb* odb;
+    if (git_repository_odb(&odb, repo) < 0)
+        return false;
+
+    bool exists = git_odb_exists(odb, id) != 0;
+    git_odb_free(odb);
+    return exists;
+}
+
+// stages a file that is tracked and still a regular file with the same mode
+// without a status pass, which would hash a file with new stat data once to
+// see whether it changed and the index update a second time; files whose
+// stat data was seen before are not read at all; returns 1 when the path is
+// done, 0 when it needs a status pass
+int stage_tracked_file(git_repository* repo, status_payload* sp,
+        const char* path)
+{
+    const git_index_entry* entry = git_index_get_bypath(sp->index, path, 0);
+    if (!entry || strcmp(path, get_prog_name()) == 0 ||
+            (entry->mode != GIT_FILEMODE_BLOB &&
+             entry->mode != GIT_FILEMODE_BLOB_EXECUTABLE))
+        return 0;
+
+    char full[4096];
+    snprintf(full, sizeof(full), "%s/%s", sp->repo->path, path);
+    uv_fs_t req;
+    int error = uv_fs_lstat(NULL, &req, full, NULL);
+    uv_stat_t st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+
+    // removed files, new directories and mode changes go through status
+#ifndef WIN32
+    git_filemode_t mode = (st.st_mode & S_IXUSR) ?
+        GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
+#else
+    // there is no executable bit, the entry keeps its mode as with
+    // core.filemode=false
+    git_filemode_t mode = (git_filemode_t)entry->mode;
+#endif
+    if (error < 0 || (st.st_mode & S_IFMT) != S_IFREG || mode != entry->mode)
+        return 0;
+
+    pressure_throttle(sp->budget);
+    ++sp->repo->counts.files_visited;
+
+    if (stat_ns(&st.st_mtim) < sp->index_mtime &&
+            entry_matches_stat(entry, &st))
+        return 1;
+
+    hash_key key = { st.st_dev, st.st_ino, st.st_size,
+        stat_ns(&st.st_mtim), stat_ns(&st.st_ctim) };
+    git_oid old_id = entry->id;
+    git_oid id;
+    if (hash_cache_get(&sp->repo->hash_cache, &key, &id) &&
+            (git_oid_equal(&id, &old_id) || blob_exists(repo, &id)))
+    {
+        git_index_entry updated = *entry;
+        entry_set_stat(&updated, &st);
+        git_oid_cpy(&updated.id, &id);
+        if (check_error(error = git_index_add(sp->index, &updated)))
+        {
+            pflog("Cannot add %s to index", path);
+            return error;
+        }
+
+        if (git_oid_equal(&id, &old_id))
+        {
+            sp->index_refreshed = true;
+            return 1;
+        }
+    }
+    else
+    {
+        int64_t hashed_at = (int64_t)time(NULL);
+        if (check_error(error = update_index(sp, path, false)))
+        {
+            pflog("Cannot add %s to index", path);
+            return error;
+        }
+
+        cache_staged(sp, path, hashed_at);
+        track_large_blob(sp, path);
+        entry = git_index_get_bypath(sp->index, path, 0);
+        if (entry && git_oid_equal(&entry->id, &old_id))
+        {
+            sp->index_refreshed = true;
+            return 1;
+        }
+    }
+
+    ++sp->files_added;
+    ++sp->repo->counts.files_added;
+    return 1;
+}
+
+// after a restart the index may hold stale or racily clean stat data of
+// files that did not change, status would hash each of them; entries whose
+// current stat data is in the hash cache with the same blob id get that
+// stat data instead, and clean entries are added to the cache
+void refresh_index(status_payload* sp)
+{
+    int64_t now = (int64_t)time(NULL);
+    size_t count = git_index_entrycount(sp->index);
+    char full[4096];
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const git_index_entry* entry = git_index_get_byindex(sp->index, i);
+        if (!entry || git_index_entry_stage(entry) != 0 ||
+                (entry->mode != GIT_FILEMODE_BLOB &&
+                 entry->mode != GIT_FILEMODE_BLOB_EXECUTABLE))
+            continue;
+
+        snprintf(full, sizeof(full), "%s/%s", sp->repo->path, entry->path);
+        uv_fs_t req;
+        int error = uv_fs_lstat(NULL, &req, full, NULL);
+        uv_stat_t st = req.statbuf;
+        uv_fs_req_cleanup(&req);
+        if (error < 0 || (st.st_mode & S_IFMT) != S_IFREG)
+            continue;
+
+        hash_key key = { st.st_dev, st.st_ino, st.st_size,
+            stat_ns(&st.st_mtim), stat_ns(&st.st_ctim) };
+        git_oid id;
+        if (entry_matches_stat(entry, &st))
+        {
+            if (stat_ns(&st.st_mtim) < sp->index_mtime &&
+                    st.st_mtim.tv_sec < now - RACY_FILE_SECONDS)
+                hash_cache_put(&sp->repo->hash_cache, &key, &entry->id);
+        }
+        else if (hash_cache_get(&sp->repo->hash_cache, &key, &id) &&
+                git_oid_equal(&id, &entry->id))
+        {
+            git_index_entry updated = *entry;
+            entry_set_stat(&updated, &st);
+            if (git_index_add(sp->index, &updated) == 0)
+                sp->index_refreshed = true;
+        }
+    }
+}
+
+bool has_pathspec_magic(const char* path)
+{
+    // such paths would be matched as patterns instead of literally
+    return path[0] == '!' || strpbrk(path, "*?[\\") != NULL ||
+        path[strlen(path) - 1] == ' ';
+}
+
+bool has_dirty_ancestor(const path_map* paths, const char* path)
+{
+    char buf[2048];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    char* slash;
+    while ((slash = strrchr(buf, '/')) != NULL)
+    {
+        *slash = '\0';
+        if (path_map_contains(paths, buf))
+            return true;
+    }
+    return false;
+}
+
+int stage_changes(git_repository* repo, const path_map* paths,
+        status_payload* sp)
+{
+    git_status_options opts;
+    git_status_init_options(&opts, GIT_STATUS_OPTIONS_VERSION);
+    opts.flags = GIT_STATUS_OPT_DEFAULTS;
+
+    size_t it = 0;
+    const char* path;
+    while (paths && path_map_next(paths, &it, &path, NULL))
+    {
+        if (has_pathspec_magic(path))
+        {
+            paths = NULL;
+            break;
+        }
+    }
+
+    if (!paths)
+        return git_status_foreach_ext(repo, &opts, status_cb, sp);
+
+    // one status pass per dirty path, each one limited to that path's subtree
+    it = 0;
+    while (path_map_next(paths, &it, &path, NULL))
+    {
+        if (has_dirty_ancestor(paths, path))
+            continue;
+
+        int staged = stage_tracked_file(repo, sp, path);
+        if (staged < 0)
+            return staged;
+        if (staged > 0)
+            continue;
+
+        char buf[2048];
+        char* spec = buf;
+        snprintf(buf, sizeof(buf), "%s", path);
+        opts.pathspec.strings = &spec;
+        opts.pathspec.count = 1;
+
+        int error = git_status_foreach_ext(repo, &opts, status_cb, sp);
+        if (error < 0)
+            return error;
     }
 
     return 0;
 }
 
-void commit_impl(git_repository** repo, git_index** index, git_tree** tree,
-        git_signature** gwatch_sig, git_commit** parent)
+// a failed pack leaves the blobs loose, which is where they already are
+void pack_large_blobs(watched_repo* wrepo)
+{
+    uint64_t bytes = wrepo->delta_pack.bytes;
+    size_t objects;
+    uint64_t pack_size;
+    if (!delta_pack_write(&wrepo->delta_pack, wrepo->git_repo, &objects,
+                &pack_size))
+    {
+        log_git_error();
+        repo_log(wrepo, "Cannot pack the versions of large files");
+    }
+    else if (objects > 0)
+        pflog("%s: packed %zu versions of large files, %.1fMB into %.1fMB",
+                wrepo->path, objects, (double)bytes / (1024 * 1024),
+                (double)pack_size / (1024 * 1024));
+}
+
+bool branch_name(git_repository* repo, char* buf, size_t size)
+{
+    git_reference* head = NULL;
+    bool ok = git_reference_lookup(&head, repo, "HEAD") == 0 &&
+        git_reference_type(head) == GIT_REF_SYMBOLIC &&
+        strncmp(git_reference_symbolic_target(head), "refs/heads/",
+                strlen("refs/heads/")) == 0 &&
+        (size_t)snprintf(buf, size, "%s",
+                git_reference_symbolic_target(head)) < size;
+    git_reference_free(head);
+    return ok;
+}
+
+bool commit_ref_name(git_repository* repo, char* buf, size_t size)
+{
+    char branch[1024];
+    if (!get_private())
+        return (size_t)snprintf(buf, size, "HEAD") < size;
+
+    return branch_name(repo, branch, sizeof(branch)) &&
+        (size_t)snprintf(buf, size, "refs/gwatch/%s",
+                branch + strlen("refs/heads/")) < size;
+}
+
+// with --private the index is .git/gwatch/index, which starts as a copy of
+// the index of the repository, so its stat data spares the first status
+// pass from hashing
+bool open_private_index(watched_repo* wrepo)
+{
+    char path[2048];
+    char shared[2048];
+    repo_gwatch_path(wrepo->git_dir, "index", path, sizeof(path));
+    snprintf(shared, sizeof(shared), "%sindex",
+            git_repository_path(wrepo->git_repo));
+    if (!repo_make_gwatch_dir(wrepo->git_dir))
+        return false;
+
+    uv_fs_t req;
+    uv_fs_copyfile(NULL, &req, shared, path, UV_FS_COPYFILE_EXCL, NULL);
+    uv_fs_req_cleanup(&req);
+
+    git_index* index = NULL;
+    if (check_error(git_index_open(&index, path)))
+        return false;
+    git_repository_set_index(wrepo->git_repo, index);
+    git_index_free(index);
+    return true;
+}
+
+bool open_git_repo(watched_repo* wrepo)
+{
+    if (wrepo->git_repo)
+        return true;
+
+    if (check_error(git_repository_open(&wrepo->git_repo, wrepo->path)))
+    {
+        repo_log(wrepo, "Cannot open the git repository");
+        wrepo->git_repo = NULL;
+        return false;
+    }
+    if ((get_metrics_address() || trace_enabled()) &&
+            !counting_odb_attach(wrepo->git_repo, &wrepo->counts))
+        repo_log(wrepo, "Cannot count the objects written");
+    if (get_private() && !open_private_index(wrepo))
+    {
+        repo_log(wrepo, "Cannot open the private index");
+        git_repository_free(wrepo->git_repo);
+        wrepo->git_repo = NULL;
+        return false;
+    }
+    return true;
+}
+
+// keeps the branch from growing by a commit per change for ever
+void thin_history(watched_repo* wrepo)
 {
-    if (check_error(git_repository_open(repo, get_repo_path())))
+    int64_t now = (int64_t)time(NULL);
+    wrepo->retention_next = now + RETENTION_INTERVAL;
+
+    // without --private the branch is the user's own, it is only rewritten
+    // when that was asked for
+    if (!get_private() && !get_retention_branch())
     {
-        plog("Cannot open the git repository");
+        repo_log(wrepo, "Not thinning the checked out branch, "
+                "use --retention branch or --private on");
         return;
     }
 
-    int unborn = git_repository_head_unborn(*repo);
+    char branch[1024];
+    retention_result result;
+    if (get_private() ?
+            !commit_ref_name(wrepo->git_repo, branch, sizeof(branch)) :
+            !branch_name(wrepo->git_repo, branch, sizeof(branch)))
+        repo_log(wrepo, "Cannot find the branch to thin");
+    else if (!retention_apply(wrepo->git_repo, branch, now,
+                &wrepo->retention_thinned, &result))
+    {
+        log_git_error();
+        repo_log(wrepo, "Cannot thin the history");
+    }
+    else if (result.rewritten)
+        pflog("%s: history thinned, %zu of %zu recent commits kept, "
+                "the space is freed by the next git gc",
+                wrepo->path, result.kept, result.walked);
+}
+
+commit_result commit_impl(watched_repo* wrepo, git_index** index,
+        git_tree** tree, git_signature** gwatch_sig, git_commit** parent,
+        pressure_budget* budget)
+{
+    phase_clock clock;
+    start_phase(&clock, wrepo);
+
+    if (!open_git_repo(wrepo))
+        return COMMIT_FAILED;
+
+    // snapshots are taken next to the other files of gwatch
+    if (get_snapshot() && !repo_make_gwatch_dir(wrepo->git_dir))
+        repo_log(wrepo, "Cannot create the snapshot folder");
+
+    // the blob ids are kept next to the warm start state
+    if (!wrepo->hash_cache_opened && get_warm_start())
+    {
+        char path[2048];
+        wrepo->hash_cache_opened = true;
+        repo_gwatch_path(wrepo->git_dir, "hashes", path, sizeof(path));
+        if (!repo_make_gwatch_dir(wrepo->git_dir) ||
+                !hash_cache_open(&wrepo->hash_cache, path))
+            repo_log(wrepo, "Cannot open the hash cache");
+        wrepo->index_refresh = true;
+    }
+    git_repository* repo = wrepo->git_repo;
+
+    int unborn = git_repository_head_unborn(repo);
     if (check_error(unborn))
     {
-        plog("Cannot check if HEAD is unborn");
-        return;
+        repo_log(wrepo, "Cannot check if HEAD is unborn");
+        return COMMIT_FAILED;
     }
-    if (unborn)
+    if (unborn && !get_private())
     {
-        plog("HEAD is unborn - creating initial commit...");
+        repo_log(wrepo, "HEAD is unborn - creating initial commit...");
     }
 
-    int detached = git_repository_head_detached(*repo);
+    int detached = git_repository_head_detached(repo);
     if (check_error(detached))
     {
-        plog("Cannot check if HEAD is detached");
-        return;
+        repo_log(wrepo, "Cannot check if HEAD is detached");
+        return COMMIT_FAILED;
     }
     if (detached)
     {
-        plog("HEAD is detached - will not commit");
-        return;
+        repo_log(wrepo, "HEAD is detached - will not commit");
+        return COMMIT_NO_CHANGES;
     }
+    end_phase(PHASE_OPEN, &clock, wrepo);
 
-    if (check_error(git_repository_index(index, *repo)))
+    if (check_error(git_repository_index(index, repo)))
     {
-        plog("Cannot open the index file");
-        return;
+        repo_log(wrepo, "Cannot open the index file");
+        return COMMIT_FAILED;
     }
+    if (check_error(git_index_read(*index, false)))
+    {
+        repo_log(wrepo, "Cannot read the index file");
+        return COMMIT_FAILED;
+    }
+    end_phase(PHASE_INDEX_LOAD, &clock, wrepo);
 
-    files_added = 0;
-    if (check_error(git_status_foreach(*repo, status_cb, *index)))
+    // after a start only the files that differ from the saved state are
+    // examined, unless the repository moved on while gwatch was down; the
+    // paths journaled before a crash are committed as they are if HEAD is
+    // still the tree they were journaled against, and the rest of the tree
+    // is scanned by the next commit
+    if (wrepo->warm_state || wrepo->journal_replay)
     {
-        plog("Cannot add files to index");
-        return;
+        git_oid head_tree;
+        bool replay = wrepo->journal_replay &&
+            state_head_tree(&head_tree, repo) &&
+            git_oid_equal(&head_tree, &wrepo->journal_base);
+
+        if (wrepo->warm_state && state_verify(wrepo->warm_state, repo))
+        {
+            state_collect_changes(wrepo->warm_state, wrepo->path,
+                    &wrepo->commit_paths);
+            wrepo->scan_after_replay = false;
+        }
+        else if (!replay)
+        {
+            wrepo->commit_full_scan = true;
+        }
+
+        if (wrepo->commit_paths.count > DIRTY_SET_LIMIT)
+            wrepo->commit_full_scan = true;
+        if (wrepo->commit_full_scan)
+            wrepo->scan_after_replay = false;
+    }
+
+    status_payload sp = { *index, budget, wrepo, 0, 0, 0, false, -1 };
+    uv_fs_t req;
+    if (uv_fs_stat(NULL, &req, git_index_path(*index), NULL) == 0)
+        sp.index_mtime = stat_ns(&req.statbuf.st_mtim);
+    uv_fs_req_cleanup(&req);
+
+    if (wrepo->commit_full_scan && wrepo->index_refresh)
+    {
+        wrepo->index_refresh = false;
+        refresh_index(&sp);
     }
-    if (files_added == 0)
+
+    if (check_error(stage_changes(repo,
+                    wrepo->commit_full_scan ? NULL : &wrepo->commit_paths, &sp)))
+    {
+        repo_log(wrepo, "Cannot add files to index");
+        return COMMIT_FAILED;
+    }
+    end_phase(PHASE_STATUS, &clock, wrepo);
+    metrics_observe(PHASE_ADD, sp.add_time);
+    if (sp.files_added == 0 && !sp.index_refreshed)
     {
         // let's avoid too many log messages
-        // plog("No changes - will not commit");
-        return;
+        // repo_log(wrepo, "No changes - will not commit");
+        return COMMIT_NO_CHANGES;
     }
+    // refreshed stat data spares the next status pass from hashing
     if (check_error(git_index_write(*index)))
     {
-        plog("Cannot write index to disk");
-        return;
+        repo_log(wrepo, "Cannot write index to disk");
+        return COMMIT_FAILED;
     }
+    end_phase(PHASE_INDEX_WRITE, &clock, wrepo);
+    if (sp.files_added == 0)
+        return COMMIT_NO_CHANGES;
 
     git_oid tree_id;
     if (check_error(git_index_write_tree(&tree_id, *index)))
     {
-        plog("Cannot write index as a tree");
-        return;
+        repo_log(wrepo, "Cannot write index as a tree");
+        return COMMIT_FAILED;
     }
+    end_phase(PHASE_TREE_WRITE, &clock, wrepo);
 
-    if (check_error(git_tree_lookup(tree, *repo, &tree_id)))
+    if (check_error(git_tree_lookup(tree, repo, &tree_id)))
     {
-        plog("Cannot find the index tree object");
-        return;
+        repo_log(wrepo, "Cannot find the index tree object");
+        return COMMIT_FAILED;
     }
 
     if (check_error(git_signature_now(gwatch_sig,
-                    "gwatch", "gwatch@example.com")))
+                    GWATCH_NAME, GWATCH_EMAIL)))
     {
-        plog("Cannot create the signature");
-        return;
+        repo_log(wrepo, "Cannot create the signature");
+        return COMMIT_FAILED;
+    }
+
+    char ref_name[1024];
+    if (!commit_ref_name(repo, ref_name, sizeof(ref_name)))
+    {
+        repo_log(wrepo, "Cannot find the branch to commit to");
+        return COMMIT_FAILED;
     }
 
     git_oid commit_id;
-    if (!unborn)
+    git_oid parent_id;
+    int error = git_reference_name_to_id(&parent_id, repo, ref_name);
+    // a private ref starts from the branch it stands in for
+    if (error == GIT_ENOTFOUND && !unborn)
+        error = git_reference_name_to_id(&parent_id, repo, "HEAD");
+    if (error != GIT_ENOTFOUND)
     {
-        git_oid parent_id;
-        if (check_error(git_reference_name_to_id(&parent_id, *repo, "HEAD")))
+        if (check_error(error))
         {
-            plog("Cannot find HEAD id");
-            return;
+            repo_log(wrepo, "Cannot find HEAD id");
+            return COMMIT_FAILED;
         }
-        if (check_error(git_commit_lookup(parent, *repo, &parent_id)))
+        if (check_error(git_commit_lookup(parent, repo, &parent_id)))
         {
-            plog("Cannot find HEAD commit");
-            return;
+            repo_log(wrepo, "Cannot find HEAD commit");
+            return COMMIT_FAILED;
         }
 
+        // e.g. files changed and changed back within the batch
+        if (git_oid_equal(git_commit_tree_id(*parent), &tree_id))
+            return COMMIT_NO_CHANGES;
+
         if (check_error(git_commit_create_v(
             &commit_id,
-            *repo,
-            "HEAD",
+            repo,
+            ref_name,
             *gwatch_sig, // author
             *gwatch_sig, // committer
             NULL, // utf-8 encoding
@@ -175,16 +861,16 @@ void commit_impl(git_repository** repo, git_index** index, git_tree** tree,
             *parent
         )))
         {
-            plog("Cannot create a commit");
-            return;
+            repo_log(wrepo, "Cannot create a commit");
+            return COMMIT_FAILED;
         }
     }
     else
     {
         if (check_error(git_commit_create_v(
             &commit_id,
-            *repo,
-            "HEAD",
+            repo,
+            ref_name,
             *gwatch_sig,
             *gwatch_sig,
             NULL,
@@ -193,27 +879,69 @@ void commit_impl(git_repository** repo, git_index** index, git_tree** tree,
             0
         )))
         {
-            plog("Cannot create initial commit");
-            return;
+            repo_log(wrepo, "Cannot create initial commit");
+            return COMMIT_FAILED;
         }
     }
 
-    plog("Successfully created a new commit");
+    end_phase(PHASE_COMMIT, &clock, wrepo);
+    metrics_add(METRIC_COMMITS, 1);
+    repo_log(wrepo, "Successfully created a new commit");
+
+    if (delta_pack_ready(&wrepo->delta_pack))
+    {
+        pack_large_blobs(wrepo);
+        end_phase(PHASE_PACK, &clock, wrepo);
+    }
+    if (get_retention() && (int64_t)time(NULL) >= wrepo->retention_next)
+    {
+        thin_history(wrepo);
+        end_phase(PHASE_RETENTION, &clock, wrepo);
+    }
+    return COMMIT_CREATED;
 }
 
-void commit()
+void commit(watched_repo* repo)
 {
-    git_repository* repo = NULL;
     git_index* index = NULL;
     git_tree* tree = NULL;
     git_signature* gwatch_sig = NULL;
     git_commit* parent = NULL;
 
-    commit_impl(&repo, &index, &tree, &gwatch_sig, &parent);
+    // the loop deferred the commit already, hashing keeps throttling
+    phase_clock clock;
+    start_phase(&clock, repo);
+    commit_result result = commit_impl(repo, &index, &tree, &gwatch_sig,
+            &parent, &repo->pressure);
+    bool ok = result != COMMIT_FAILED;
+    end_phase(PHASE_TOTAL, &clock, repo);
+    trace_flush();
+    if (!ok)
+        metrics_add(METRIC_COMMIT_FAILURES, 1);
+
+    state_free(repo->warm_state);
+    repo->warm_state = NULL;
+    repo->journal_replay = false;
+
+    // the journal is compacted against the tree that is now committed
+    repo->committed_tree_valid = ok &&
+        state_head_tree(&repo->committed_tree, repo->git_repo);
+
+    pressure_report(&repo->pressure);
 
     git_commit_free(parent);
     git_signature_free(gwatch_sig);
     git_tree_free(tree);
     git_index_free(index);
-    git_repository_free(repo);
+
+    // nothing to commit is not a failure, the loop must not rescan for it
+    repo->commit_result = result;
+
+    // the handle is kept between commits, also when there was nothing to
+    // commit, unless something went wrong with it
+    if (!ok)
+    {
+        git_repository_free(repo->git_repo);
+        repo->git_repo = NULL;
+    }
 }
@@ -1,6 +1,23 @@
 #pragma once
 
+#include "repos.h"
+
+#include <git2.h>
+
 #include <stdbool.h>
+#include <stddef.h>
+
+#define GWATCH_NAME "gwatch"
+#define GWATCH_EMAIL "gwatch@example.com"
+
+bool check_if_valid_git_repo(const char* path);
+
+// opens the cached git_repository of a watched repository on its commit
+// thread, with the object counting and the private index set up, whichever
+// job needs it first
+bool open_git_repo(watched_repo* wrepo);
 
-bool check_if_valid_git_repo();
-void commit();
+// the ref commits go to, HEAD or with --private refs/gwatch/<branch> for the
+// branch HEAD points to; false when HEAD is detached
+bool commit_ref_name(git_repository* repo, char* buf, size_t size);
+void commit(watched_repo* repo);
@@ -0,0 +1,228 @@
+#include "hash_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_CACHE_MAGIC "GWHC"
+#define HASH_CACHE_VERSION 1
+#define HASH_CACHE_HEADER_SIZE 64
+#define HASH_CACHE_MIN_CAPACITY 256
+#define HASH_CACHE_MAX_CAPACITY 32768 // in memory, about 2MB
+#define HASH_CACHE_FILE_MIN_CAPACITY 4096
+#define HASH_CACHE_FILE_MAX_CAPACITY (1024 * 1024) // 64MB of file
+
+// the entries follow the header, the file is private to this machine so the
+// native layout is used
+typedef struct hash_cache_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t count;
+} hash_cache_header;
+
+uint64_t hash_key_hash(const hash_key* key)
+{
+    // FNV-1a over the fields
+    const uint64_t fields[] = { key->dev, key->ino, key->size,
+        (uint64_t)key->mtime, (uint64_t)key->ctime };
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+    {
+        hash ^= fields[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+bool hash_key_equal(const hash_key* a, const hash_key* b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+        a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+uint32_t hash_entry_check(const hash_key* key, const git_oid* id)
+{
+    uint64_t hash = hash_key_hash(key);
+    for (size_t i = 0; i < GIT_OID_RAWSZ; ++i)
+    {
+        hash ^= id->id[i];
+        hash *= 1099511628211u;
+    }
+    return (uint32_t)(hash ^ (hash >> 32)) | 1;
+}
+
+hash_cache_header* cache_header(const hash_cache* cache)
+{
+    return (hash_cache_header*)cache->file.data;
+}
+
+size_t hash_cache_find(const hash_cache* cache, const hash_key* key)
+{
+    size_t mask = cache->capacity - 1;
+    size_t i = (size_t)hash_key_hash(key) & mask;
+
+    while (cache->entries[i].check &&
+            !hash_key_equal(&cache->entries[i].key, key))
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+void hash_cache_init(hash_cache* cache)
+{
+    cache->entries = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+    cache->file.data = NULL;
+    cache->file.size = 0;
+}
+
+void hash_cache_free(hash_cache* cache)
+{
+    if (cache->file.data)
+        file_map_close(&cache->file);
+    else
+        free(cache->entries);
+    hash_cache_init(cache);
+}
+
+// makes room for capacity entries in the file, false when it cannot grow
+bool hash_cache_map(hash_cache* cache, size_t capacity)
+{
+    size_t size = HASH_CACHE_HEADER_SIZE + capacity * sizeof(hash_cache_entry);
+    if (cache->file.size != size && !file_map_resize(&cache->file, size))
+        return false;
+
+    cache->entries = (hash_cache_entry*)
+        ((char*)cache->file.data + HASH_CACHE_HEADER_SIZE);
+    cache->capacity = capacity;
+    cache_header(cache)->capacity = capacity;
+    return true;
+}
+
+bool hash_cache_open(hash_cache* cache, const char* path)
+{
+    size_t min_size = HASH_CACHE_HEADER_SIZE +
+        HASH_CACHE_FILE_MIN_CAPACITY * sizeof(hash_cache_entry);
+
+    hash_cache_free(cache);
+    if (!file_map_open(&cache->file, path, min_size))
+    {
+        hash_cache_init(cache);
+        return false;
+    }
+
+    hash_cache_header* h = cache_header(cache);
+    size_t capacity = (size_t)h->capacity;
+    bool valid = memcmp(h->magic, HASH_CACHE_MAGIC, 4) == 0 &&
+        h->version == HASH_CACHE_VERSION &&
+        h->entry_size == sizeof(hash_cache_entry) &&
+        capacity >= HASH_CACHE_FILE_MIN_CAPACITY &&
+        capacity <= HASH_CACHE_FILE_MAX_CAPACITY &&
+        (capacity & (capacity - 1)) == 0 &&
+        HASH_CACHE_HEADER_SIZE + capacity * sizeof(hash_cache_entry) <=
+            cache->file.size &&
+        h->count < capacity;
+
+    if (!valid)
+    {
+        memset(cache->file.data, 0, cache->file.size);
+        memcpy(h->magic, HASH_CACHE_MAGIC, 4);
+        h->version = HASH_CACHE_VERSION;
+        h->entry_size = sizeof(hash_cache_entry);
+        capacity = HASH_CACHE_FILE_MIN_CAPACITY;
+    }
+
+    if (!hash_cache_map(cache, capacity))
+    {
+        hash_cache_free(cache);
+        return false;
+    }
+    cache->count = (size_t)cache_header(cache)->count;
+    return true;
+}
+
+bool hash_cache_get(const hash_cache* cache, const hash_key* key, git_oid* id)
+{
+    if (cache->count == 0)
+        return false;
+
+    const hash_cache_entry* entry = &cache->entries[hash_cache_find(cache, key)];
+    if (!entry->check || entry->check != hash_entry_check(key, &entry->id))
+        return false;
+
+    git_oid_cpy(id, &entry->id);
+    return true;
+}
+
+// doubles the capacity up to the limit, a full cache starts over
+void hash_cache_grow(hash_cache* cache)
+{
+    bool mapped = cache->file.data != NULL;
+    size_t max = mapped ? HASH_CACHE_FILE_MAX_CAPACITY : HASH_CACHE_MAX_CAPACITY;
+    size_t old_capacity = cache->capacity;
+    size_t capacity = !old_capacity ? HASH_CACHE_MIN_CAPACITY :
+        old_capacity < max ? old_capacity * 2 : old_capacity;
+    bool keep = capacity > old_capacity;
+
+    hash_cache_entry* old = NULL;
+    if (keep && mapped)
+    {
+        old = malloc(old_capacity * sizeof(hash_cache_entry));
+        memcpy(old, cache->entries, old_capacity * sizeof(hash_cache_entry));
+    }
+    else if (!mapped)
+    {
+        old = cache->entries;
+    }
+
+    if (mapped)
+    {
+        if (!hash_cache_map(cache, capacity))
+        {
+            keep = false;
+            capacity = old_capacity;
+        }
+        memset(cache->entries, 0, capacity * sizeof(hash_cache_entry));
+    }
+    else
+    {
+        cache->entries = calloc(capacity, sizeof(hash_cache_entry));
+        cache->capacity = capacity;
+    }
+    cache->count = 0;
+
+    for (size_t i = 0; keep && i < old_capacity; ++i)
+    {
+        if (old[i].check)
+        {
+            cache->entries[hash_cache_find(cache, &old[i].key)] = old[i];
+            ++cache->count;
+        }
+    }
+
+    free(old);
+}
+
+void hash_cache_put(hash_cache* cache, const hash_key* key, const git_oid* id)
+{
+    // kept at most 3/4 full
+    if ((cache->count + 1) * 4 > cache->capacity * 3)
+        hash_cache_grow(cache);
+
+    hash_cache_entry* entry = &cache->entries[hash_cache_find(cache, key)];
+    if (!entry->check)
+        ++cache->count;
+
+    // the check is written last, a torn entry is never taken for valid
+    entry->check = 0;
+    entry->key = *key;
+    git_oid_cpy(&entry->id, id);
+    entry->check = hash_entry_check(key, id);
+
+    if (cache->file.data)
+        cache_header(cache)->count = cache->count;
+}
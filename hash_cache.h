@@ -0,0 +1,46 @@
+#pragma once
+
+#include "file_oper.h"
+
+#include <git2.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the stat data that identifies the content of a file
+typedef struct hash_key
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime; // ns
+    int64_t ctime; // ns
+} hash_key;
+
+typedef struct hash_cache_entry
+{
+    hash_key key;
+    git_oid id;
+    uint32_t check; // 0 for an empty slot, guards against torn writes
+} hash_cache_entry;
+
+// open addressing map from the stat data of a file to its blob id, emptied
+// when full; kept in memory, or in a memory mapped file so that it survives
+// restarts
+typedef struct hash_cache
+{
+    hash_cache_entry* entries;
+    size_t capacity;
+    size_t count;
+    mapped_file file;
+} hash_cache;
+
+void hash_cache_init(hash_cache* cache);
+void hash_cache_free(hash_cache* cache);
+
+// moves the cache to the file, the entries already in it are kept if the
+// file is valid, otherwise the file starts empty
+bool hash_cache_open(hash_cache* cache, const char* path);
+bool hash_cache_get(const hash_cache* cache, const hash_key* key, git_oid* id);
+void hash_cache_put(hash_cache* cache, const hash_key* key, const git_oid* id);
@@ -0,0 +1,181 @@
+#include "journal.h"
+#include "logs.h"
+#include "repos.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC "GWJL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_MIN_SIZE (64 * 1024)
+#define JOURNAL_MAX_SIZE (16 * 1024 * 1024)
+
+// the base is only valid when JOURNAL_BASE_VALID is set
+#define JOURNAL_BASE_VALID 1
+#define JOURNAL_FULL_SCAN 2
+
+// records of a 16-bit length followed by the path follow the header, the
+// file is private to this machine so the native byte order is used
+typedef struct journal_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t used; // bytes of records
+    unsigned char base[GIT_OID_RAWSZ]; // tree id
+} journal_header;
+
+journal_header* header(const journal* j)
+{
+    return (journal_header*)j->file.data;
+}
+
+unsigned char* records(const journal* j)
+{
+    return (unsigned char*)j->file.data + JOURNAL_HEADER_SIZE;
+}
+
+bool journal_open(journal* j, const char* git_dir)
+{
+    char path[2048];
+
+    if (journal_is_open(j) || !repo_make_gwatch_dir(git_dir))
+        return journal_is_open(j);
+
+    repo_gwatch_path(git_dir, "journal", path, sizeof(path));
+    if (!file_map_open(&j->file, path, JOURNAL_MIN_SIZE))
+    {
+        pflog("Cannot open the journal %s", path);
+        return false;
+    }
+
+    journal_header* h = header(j);
+    if (memcmp(h->magic, JOURNAL_MAGIC, 4) != 0 ||
+            h->version != JOURNAL_VERSION ||
+            h->used > j->file.size - JOURNAL_HEADER_SIZE)
+    {
+        memset(h, 0, JOURNAL_HEADER_SIZE);
+        memcpy(h->magic, JOURNAL_MAGIC, 4);
+        h->version = JOURNAL_VERSION;
+    }
+
+    return true;
+}
+
+bool journal_is_open(const journal* j)
+{
+    return j->file.data != NULL;
+}
+
+bool journal_recover(const journal* j, git_oid* base, path_map* paths)
+{
+    if (!journal_is_open(j))
+        return false;
+
+    journal_header* h = header(j);
+    if ((h->flags & JOURNAL_BASE_VALID) == 0 || (h->flags & JOURNAL_FULL_SCAN))
+        return false;
+
+    const unsigned char* p = records(j);
+    const unsigned char* end = p + h->used;
+    char path[2048];
+
+    while (end - p >= 2)
+    {
+        uint16_t len;
+        memcpy(&len, p, 2);
+        p += 2;
+        if (len >= sizeof(path) || len > end - p)
+            return false;
+
+        memcpy(path, p, len);
+        path[len] = '\0';
+        p += len;
+        path_map_add(paths, path, NULL);
+    }
+
+    git_oid_fromraw(base, h->base);
+    return true;
+}
+
+bool ensure_space(journal* j, size_t needed)
+{
+    size_t size = j->file.size;
+    while (JOURNAL_HEADER_SIZE + header(j)->used + needed > size)
+        size *= 2;
+
+    if (size == j->file.size)
+        return true;
+    if (size > JOURNAL_MAX_SIZE)
+        return false;
+
+    // a journal that cannot grow is still mapped, it falls back to a full scan
+    return file_map_resize(&j->file, size);
+}
+
+void journal_append(journal* j, const char* path)
+{
+    if (!journal_is_open(j) || (header(j)->flags & JOURNAL_FULL_SCAN))
+        return;
+
+    size_t len = strlen(path);
+    if (len > UINT16_MAX || !ensure_space(j, len + 2))
+    {
+        journal_mark_full_scan(j);
+        return;
+    }
+
+    // the record is complete before it is counted
+    uint16_t len16 = (uint16_t)len;
+    unsigned char* p = records(j) + header(j)->used;
+    memcpy(p, &len16, 2);
+    memcpy(p + 2, path, len);
+    header(j)->used += (uint32_t)(len + 2);
+}
+
+void journal_mark_full_scan(journal* j)
+{
+    if (journal_is_open(j))
+        header(j)->flags |= JOURNAL_FULL_SCAN;
+}
+
+void journal_compact(journal* j, const git_oid* base, const path_map* paths,
+        bool full_scan)
+{
+    if (!journal_is_open(j))
+        return;
+
+    // a crash in the middle leaves a journal without a valid base
+    journal_header* h = header(j);
+    h->flags = 0;
+    h->used = 0;
+
+    // a journal that cannot shrink just stays as large as it is
+    if (j->file.size > JOURNAL_MIN_SIZE)
+        file_map_resize(&j->file, JOURNAL_MIN_SIZE);
+
+    if (full_scan)
+    {
+        journal_mark_full_scan(j);
+    }
+    else
+    {
+        size_t it = 0;
+        const char* path;
+        while (path_map_next(paths, &it, &path, NULL))
+            journal_append(j, path);
+    }
+
+    if (base)
+    {
+        h = header(j);
+        memcpy(h->base, base->id, GIT_OID_RAWSZ);
+        h->flags |= JOURNAL_BASE_VALID;
+    }
+}
+
+void journal_close(journal* j)
+{
+    file_map_close(&j->file);
+}
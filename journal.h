@@ -0,0 +1,24 @@
+#pragma once
+
+#include "file_oper.h"
+#include "path_map.h"
+
+#include <git2.h>
+
+#include <stdbool.h>
+
+// paths that changed since the tree in the journal header, appended as the
+// events arrive so that they survive a crash of the process
+typedef struct journal
+{
+    mapped_file file;
+} journal;
+
+bool journal_open(journal* j, const char* git_dir);
+bool journal_is_open(const journal* j);
+bool journal_recover(const journal* j, git_oid* base, path_map* paths);
+void journal_append(journal* j, const char* path);
+void journal_mark_full_scan(journal* j);
+void journal_compact(journal* j, const git_oid* base, const path_map* paths,
+        bool full_scan);
+void journal_close(journal* j);
@@ -1,20 +1,261 @@
 #include "logs.h"
+#include "metrics.h"
+
+#include <uv.h>
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
-void plog(const char* str)
+#ifdef _MSC_VER
+#include <windows.h>
+#define ATOMIC_LOAD(p) ((uint64_t)InterlockedOr64((volatile LONG64*)(p), 0))
+#define ATOMIC_STORE(p, v) InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#define ATOMIC_ADD(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v))
+#define ATOMIC_SUB(p, v) InterlockedExchangeAdd64((volatile LONG64*)(p), -(LONG64)(v))
+#define ATOMIC_CAS(p, old, v) \
+    (InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(v), \
+        (LONG64)(old)) == (LONG64)(old))
+#else
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_SUB(p, v) __atomic_fetch_sub(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_CAS(p, old, v) \
+    __atomic_compare_exchange_n(p, &(old), v, false, __ATOMIC_ACQ_REL, \
+        __ATOMIC_RELAXED)
+#endif
+
+#define LOG_LINE_MAX 1024
+#define LOG_RING_SIZE 512 // power of two
+
+// a bounded multi-producer queue after Dmitry Vyukov: a slot is free for
+// position pos when its sequence equals pos and holds a line when it equals
+// pos + 1, so producers only contend on the enqueue position
+typedef struct log_slot
+{
+    uint64_t sequence;
+    time_t time;
+    char text[LOG_LINE_MAX];
+} log_slot;
+
+log_slot log_ring[LOG_RING_SIZE];
+uint64_t enqueue_pos;
+uint64_t dequeue_pos; // only touched by the writer thread
+uint64_t lines_dropped;
+uint64_t lines_pending; // claimed by producers and not written yet
+uint64_t log_running;
+uint64_t writer_quit;
+bool json_lines = false;
+uv_thread_t writer_thread;
+
+// the writer waits on wake_cond while no line is pending, a producer only
+// signals it when the first pending line arrives
+uv_once_t wake_once = UV_ONCE_INIT;
+uv_mutex_t wake_mutex;
+uv_cond_t wake_cond;
+
+// the writer thread formats at most one timestamp per second
+time_t cached_second = -1;
+char cached_stamp[50];
+
+const char* format_time(time_t rawtime)
+{
+    struct tm timeinfo;
+
+    if (rawtime == cached_second)
+        return cached_stamp;
+
+#ifdef WIN32
+    localtime_s(&timeinfo, &rawtime);
+#else
+    localtime_r(&rawtime, &timeinfo);
+#endif
+
+    strftime(cached_stamp, sizeof(cached_stamp),
+            json_lines ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %X", &timeinfo);
+    cached_second = rawtime;
+    return cached_stamp;
+}
+
+void write_json_string(const char* str)
+{
+    putchar('"');
+    for (const unsigned char* it = (const unsigned char*)str; *it; ++it)
+    {
+        if (*it == '"' || *it == '\\')
+            printf("\\%c", *it);
+        else if (*it == '\n')
+            fputs("\\n", stdout);
+        else if (*it < 0x20)
+            printf("\\u%04x", *it);
+        else
+            putchar(*it);
+    }
+    putchar('"');
+}
+
+void write_line(time_t rawtime, const char* str)
+{
+    const char* stamp = format_time(rawtime);
+
+    if (json_lines)
+    {
+        printf("{\"time\":\"%s\",\"msg\":", stamp);
+        write_json_string(str);
+        fputs("}\n", stdout);
+    }
+    else
+    {
+        printf("%s: %s\n", stamp, str);
+    }
+}
+
+uv_mutex_t sync_mutex;
+
+void sync_mutex_init()
+{
+    uv_mutex_init(&sync_mutex);
+}
+
+// used while no writer thread runs, plog is called from the commit threads
+void write_line_sync(const char* str)
+{
+    static uv_once_t once = UV_ONCE_INIT;
+    uv_once(&once, sync_mutex_init);
+
+    uv_mutex_lock(&sync_mutex);
+    write_line(time(NULL), str);
+    uv_mutex_unlock(&sync_mutex);
+}
+
+bool enqueue(const char* str)
+{
+    uint64_t pos = ATOMIC_LOAD(&enqueue_pos);
+    log_slot* slot;
+
+    for (;;)
+    {
+        slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(ATOMIC_LOAD(&slot->sequence) - pos);
+
+        if (diff == 0)
+        {
+            if (ATOMIC_CAS(&enqueue_pos, pos, pos + 1))
+                break;
+#ifdef _MSC_VER
+            pos = ATOMIC_LOAD(&enqueue_pos);
+#endif
+        }
+        else if (diff < 0)
+        {
+            // the writer is behind by a whole ring
+            return false;
+        }
+        else
+        {
+            pos = ATOMIC_LOAD(&enqueue_pos);
+        }
+    }
+
+    slot->time = time(NULL);
+    size_t len = strlen(str);
+    if (len >= LOG_LINE_MAX)
+        len = LOG_LINE_MAX - 1;
+    memcpy(slot->text, str, len);
+    slot->text[len] = '\0';
+
+    ATOMIC_STORE(&slot->sequence, pos + 1);
+    return true;
+}
+
+bool dequeue_and_write()
 {
-    time_t rawtime;
-    struct tm* timeinfo;
+    log_slot* slot = &log_ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    if (ATOMIC_LOAD(&slot->sequence) != dequeue_pos + 1)
+        return false;
 
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
+    write_line(slot->time, slot->text);
 
-    char buf[50];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %X", timeinfo);
-    printf("%s: %s\n", buf, str);
+    ATOMIC_STORE(&slot->sequence, dequeue_pos + LOG_RING_SIZE);
+    ++dequeue_pos;
+    return true;
+}
+
+void report_drops(uint64_t* reported)
+{
+    uint64_t dropped = ATOMIC_LOAD(&lines_dropped);
+    if (dropped == *reported)
+        return;
+
+    char text[64];
+    snprintf(text, sizeof(text), "%llu log lines dropped",
+            (unsigned long long)(dropped - *reported));
+    write_line(time(NULL), text);
+    metrics_add(METRIC_LOG_LINES_DROPPED, dropped - *reported);
+    *reported = dropped;
+}
+
+void wake_init()
+{
+    uv_mutex_init(&wake_mutex);
+    uv_cond_init(&wake_cond);
+}
+
+void wake_writer()
+{
+    uv_mutex_lock(&wake_mutex);
+    uv_cond_signal(&wake_cond);
+    uv_mutex_unlock(&wake_mutex);
+}
+
+void writer_main(void* arg)
+{
+    (void)arg;
+    uint64_t reported = 0;
+
+    for (;;)
+    {
+        bool quit = ATOMIC_LOAD(&writer_quit) != 0;
+
+        while (dequeue_and_write())
+            ATOMIC_SUB(&lines_pending, 1);
+        report_drops(&reported);
+        fflush(stdout);
+
+        if (quit)
+            break;
+
+        // a line still being copied into its slot keeps the writer going
+        uv_mutex_lock(&wake_mutex);
+        while (ATOMIC_LOAD(&lines_pending) == 0 &&
+                ATOMIC_LOAD(&writer_quit) == 0)
+            uv_cond_wait(&wake_cond, &wake_mutex);
+        uv_mutex_unlock(&wake_mutex);
+    }
+}
+
+void plog(const char* str)
+{
+    if (ATOMIC_LOAD(&log_running) == 0)
+    {
+        write_line_sync(str);
+        return;
+    }
+
+    // counted before the line is published, so the writer cannot miss it
+    bool first = ATOMIC_ADD(&lines_pending, 1) == 0;
+    if (!enqueue(str))
+    {
+        ATOMIC_SUB(&lines_pending, 1);
+        ATOMIC_ADD(&lines_dropped, 1);
+    }
+    else if (first)
+    {
+        wake_writer();
+    }
 }
 
 void pflog(const char* fmt, ...)
@@ -22,9 +263,29 @@ void pflog(const char* fmt, ...)
     va_list args;
     va_start(args, fmt);
 
-    char buf[1024];
+    char buf[LOG_LINE_MAX];
     vsnprintf(buf, sizeof(buf), fmt, args);
     plog(buf);
 
     va_end(args);
 }
+
+void logs_start(bool json)
+{
+    json_lines = json;
+    for (uint64_t i = 0; i < LOG_RING_SIZE; ++i)
+        log_ring[i].sequence = i;
+
+    uv_once(&wake_once, wake_init);
+    ATOMIC_STORE(&writer_quit, 0);
+    uv_thread_create(&writer_thread, writer_main, NULL);
+    ATOMIC_STORE(&log_running, 1);
+}
+
+void logs_stop()
+{
+    ATOMIC_STORE(&log_running, 0);
+    ATOMIC_STORE(&writer_quit, 1);
+    wake_writer();
+    uv_thread_join(&writer_thread);
+}
@@ -1,4 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
+
 void plog(const char* str);
 void pflog(const char* fmt, ...);
+
+// until logs_start and after logs_stop lines are written synchronously
+void logs_start(bool json);
+void logs_stop();
@@ -5,33 +5,109 @@
 #include <git2.h>
 
 #include "args.h"
+#include "commit_worker.h"
+#include "control.h"
 #include "fs_listener.h"
 #include "git.h"
+#include "logs.h"
+#include "mem_governor.h"
+#include "metrics.h"
+#include "pressure.h"
+#include "recorder.h"
+#include "repos.h"
+#include "trace.h"
 
-int main(int argc, char* argv[])
+uv_loop_t loop;
+uv_signal_t sigint_handle;
+uv_signal_t sigterm_handle;
+
+void shutdown_done()
+{
+    uv_stop(&loop);
+}
+
+void signal_cb(uv_signal_t* handle, int signum)
 {
-    uv_loop_t loop;
+    (void)handle;
+    (void)signum;
+
+    // a second signal terminates the process right away
+    uv_signal_stop(&sigint_handle);
+    uv_signal_stop(&sigterm_handle);
+
+    plog("Shutting down");
+    fs_listener_shutdown(shutdown_done);
+}
+
+void close_handle(uv_handle_t* handle, void* arg)
+{
+    (void)arg;
+    if (!uv_is_closing(handle))
+        uv_close(handle, NULL);
+}
 
+int main(int argc, char* argv[])
+{
     if (!parse_args(argc, argv))
         return -1;
 
     printf("Starting gwatch\n");
-    printf("Watched repository: %s\n", get_repo_path());
+    for (int i = 0; i < get_repo_count(); ++i)
+        printf("Watched repository: %s\n", get_repo_path(i));
     printf("Timeout: %ds\n", get_timeout());
+    printf("Commit threads: %d\n", get_workers());
+
+    logs_start(get_log_json());
+
+    // commit threads check for tracing without locks, it is set up first
+    if (get_trace_path() && !trace_start(get_trace_path()))
+    {
+        logs_stop();
+        return -1;
+    }
 
     git_libgit2_init();
 
-    if (check_if_valid_git_repo())
-        commit();
+    if (get_record_path() && !recorder_start(get_record_path()))
+    {
+        git_libgit2_shutdown();
+        trace_stop();
+        logs_stop();
+        return -1;
+    }
 
     uv_loop_init(&loop);
+    pressure_start();
+    commit_worker_start(&loop, get_workers());
+    fs_listener_init(&loop, commit);
+    mem_governor_start(&loop);
 
-    fs_listener_start(&loop, commit);
+    uv_signal_init(&loop, &sigint_handle);
+    uv_signal_start(&sigint_handle, signal_cb, SIGINT);
+    uv_signal_init(&loop, &sigterm_handle);
+    uv_signal_start(&sigterm_handle, signal_cb, SIGTERM);
 
-    uv_run(&loop, UV_RUN_DEFAULT);
+    for (int i = 0; i < get_repo_count(); ++i)
+    {
+        watched_repo* repo = repos_add(get_repo_path(i));
+        fs_listener_add(repo, check_if_valid_git_repo(repo->path));
+    }
+
+    bool ok = (!get_control_path() || control_start(&loop, get_control_path())) &&
+        (!get_metrics_address() || metrics_start(&loop, get_metrics_address()));
 
+    if (ok)
+        uv_run(&loop, UV_RUN_DEFAULT);
+
+    commit_worker_stop();
+    uv_walk(&loop, close_handle, NULL);
+    uv_run(&loop, UV_RUN_DEFAULT);
     uv_loop_close(&loop);
+    repos_free();
+    recorder_stop();
     git_libgit2_shutdown();
+    trace_stop();
+    logs_stop();
 
-    return 0;
+    return ok ? 0 : -1;
 }
@@ -0,0 +1,94 @@
+#include "mem_governor.h"
+#include "args.h"
+#include "logs.h"
+#include "repos.h"
+
+#include <git2.h>
+
+#include <stdbool.h>
+
+#define GOVERNOR_INTERVAL 5000 // ms
+#define CACHE_SHARE 40 // % of the budget for the object cache
+#define MAPPED_SHARE 50 // % of the budget for pack windows
+#define WINDOWS_PER_LIMIT 4 // the mapped limit holds at least this many windows
+#define MIN_CACHE (1024 * 1024)
+
+uv_timer_t governor_timer;
+size_t budget = 0;
+size_t cache_target = 0;
+size_t cache_limit = 0;
+
+void set_cache_limit(size_t limit)
+{
+    cache_limit = limit;
+    git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t)limit);
+}
+
+int release_idle_repos()
+{
+    int released = 0;
+
+    // without a job in flight no commit thread touches the handle
+    for (watched_repo* it = repos_first(); it; it = it->next)
+    {
+        if (!repo_busy(it) && it->git_repo)
+        {
+            git_repository_free(it->git_repo);
+            it->git_repo = NULL;
+            ++released;
+        }
+    }
+
+    return released;
+}
+
+void governor_cb(uv_timer_t* handle)
+{
+    (void)handle;
+
+    size_t rss = 0;
+    ssize_t cached = 0;
+    ssize_t allowed = 0;
+    uv_resident_set_memory(&rss);
+    git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &cached, &allowed);
+
+    if (rss > budget)
+    {
+        if (cache_limit > MIN_CACHE)
+            set_cache_limit(cache_limit / 2 > MIN_CACHE ? cache_limit / 2 : MIN_CACHE);
+
+        int released = release_idle_repos();
+        pflog("Memory above budget (RSS %zuMB, cached objects %zdMB) - "
+                "cache limit lowered to %zuMB, %d idle repositories released",
+                rss >> 20, cached >> 20, cache_limit >> 20, released);
+    }
+    else if (rss < budget / 10 * 7 && cache_limit < cache_target)
+    {
+        set_cache_limit(cache_limit * 2 < cache_target ? cache_limit * 2 : cache_target);
+        pflog("Memory below budget (RSS %zuMB) - cache limit raised to %zuMB",
+                rss >> 20, cache_limit >> 20);
+    }
+}
+
+void mem_governor_start(uv_loop_t* loop)
+{
+    if (get_mem_budget() == 0)
+        return;
+
+    budget = (size_t)get_mem_budget() * 1024 * 1024;
+    cache_target = budget / 100 * CACHE_SHARE;
+    size_t mapped_limit = budget / 100 * MAPPED_SHARE;
+    size_t window_size = mapped_limit / WINDOWS_PER_LIMIT;
+
+    set_cache_limit(cache_target);
+    git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, mapped_limit);
+    git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, window_size);
+
+    pflog("Memory budget %dMB: object cache %zuMB, pack windows %zuMB "
+            "(%zuMB each)", get_mem_budget(), cache_target >> 20,
+            mapped_limit >> 20, window_size >> 20);
+
+    uv_timer_init(loop, &governor_timer);
+    uv_timer_start(&governor_timer, governor_cb, GOVERNOR_INTERVAL,
+            GOVERNOR_INTERVAL);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <uv.h>
+
+void mem_governor_start(uv_loop_t* loop);
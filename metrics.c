@@ -0,0 +1,400 @@
+#include "metrics.h"
+#include "logs.h"
+#include "repos.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define METRICS_REQUEST_MAX 4096
+#define BUCKET_COUNT 14
+
+typedef struct histogram
+{
+    uint64_t buckets[BUCKET_COUNT]; // not cumulative
+    uint64_t count;
+    uint64_t sum; // ns
+} histogram;
+
+typedef struct metrics_client
+{
+    union
+    {
+        uv_tcp_t tcp;
+        uv_pipe_t pipe;
+    } handle;
+    char buf[METRICS_REQUEST_MAX];
+    size_t len;
+    bool answered;
+} metrics_client;
+
+typedef struct metrics_reply
+{
+    uv_write_t req;
+    metrics_client* client;
+    char* text;
+} metrics_reply;
+
+typedef struct text_buf
+{
+    char* data;
+    size_t len;
+    size_t cap;
+} text_buf;
+
+// upper bounds in seconds, the last bucket is +Inf
+const double bucket_bounds[BUCKET_COUNT - 1] = {
+    0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 60
+};
+
+const char* const counter_names[METRIC_COUNTER_COUNT] = {
+    "gwatch_events_total",
+    "gwatch_events_dropped_total",
+    "gwatch_commits_total",
+    "gwatch_commit_failures_total",
+    "gwatch_bytes_hashed_total",
+    "gwatch_bytes_written_total",
+    "gwatch_objects_written_total",
+    "gwatch_log_lines_dropped_total"
+};
+
+const char* const counter_help[METRIC_COUNTER_COUNT] = {
+    "File system events received",
+    "Events whose path was not recorded because a full scan was pending",
+    "Commits created",
+    "Commit attempts that failed",
+    "Bytes of file content hashed for the index",
+    "Bytes of new loose objects written",
+    "New objects written",
+    "Log lines dropped because the log buffer was full"
+};
+
+const char* const phase_names[PHASE_COUNT] = {
+    "open", "index_load", "status", "add_bypath", "index_write", "tree_write",
+    "commit", "pack", "retention", "total"
+};
+
+uv_once_t metrics_once = UV_ONCE_INIT;
+uv_mutex_t metrics_mutex;
+uint64_t counters[METRIC_COUNTER_COUNT];
+histogram phases[PHASE_COUNT];
+
+uv_loop_t* loop_metrics;
+bool metrics_tcp;
+union
+{
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+} metrics_server;
+
+void metrics_init()
+{
+    uv_mutex_init(&metrics_mutex);
+}
+
+void metrics_add(metric_counter counter, uint64_t value)
+{
+    uv_once(&metrics_once, metrics_init);
+    uv_mutex_lock(&metrics_mutex);
+    counters[counter] += value;
+    uv_mutex_unlock(&metrics_mutex);
+}
+
+void metrics_observe(commit_phase phase, uint64_t ns)
+{
+    double seconds = (double)ns / 1e9;
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && seconds > bucket_bounds[bucket])
+        ++bucket;
+
+    uv_once(&metrics_once, metrics_init);
+    uv_mutex_lock(&metrics_mutex);
+    ++phases[phase].buckets[bucket];
+    ++phases[phase].count;
+    phases[phase].sum += ns;
+    uv_mutex_unlock(&metrics_mutex);
+}
+
+const char* metrics_phase_name(commit_phase phase)
+{
+    return phase_names[phase];
+}
+
+void text_printf(text_buf* buf, const char* fmt, ...)
+{
+    va_list args;
+
+    for (;;)
+    {
+        va_start(args, fmt);
+        int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+
+        if (n < 0)
+            return;
+        if ((size_t)n < buf->cap - buf->len)
+        {
+            buf->len += (size_t)n;
+            return;
+        }
+
+        buf->cap = buf->cap * 2 + (size_t)n;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+}
+
+// label values escape backslashes, quotes and line breaks
+void text_label(text_buf* buf, const char* value)
+{
+    for (const char* it = value; *it; ++it)
+    {
+        if (*it == '\\' || *it == '"')
+            text_printf(buf, "\\%c", *it);
+        else if (*it == '\n')
+            text_printf(buf, "\\n");
+        else
+            text_printf(buf, "%c", *it);
+    }
+}
+
+void repo_gauge(text_buf* buf, const char* name, const char* help,
+        size_t(*value)(const watched_repo*))
+{
+    text_printf(buf, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    for (watched_repo* it = repos_first(); it; it = it->next)
+    {
+        if (it->removed)
+            continue;
+        text_printf(buf, "%s{repo=\"", name);
+        text_label(buf, it->path);
+        text_printf(buf, "\"} %zu\n", value(it));
+    }
+}
+
+size_t watched_dirs_value(const watched_repo* repo)
+{
+    return repo->watched_dirs;
+}
+
+size_t dirty_value(const watched_repo* repo)
+{
+    return repo->dirty.count;
+}
+
+size_t full_scan_value(const watched_repo* repo)
+{
+    return repo->full_scan ? 1 : 0;
+}
+
+char* format_metrics()
+{
+    uint64_t counters_copy[METRIC_COUNTER_COUNT];
+    histogram phases_copy[PHASE_COUNT];
+
+    uv_once(&metrics_once, metrics_init);
+    uv_mutex_lock(&metrics_mutex);
+    memcpy(counters_copy, counters, sizeof(counters));
+    memcpy(phases_copy, phases, sizeof(phases));
+    uv_mutex_unlock(&metrics_mutex);
+
+    text_buf buf = { malloc(4096), 0, 4096 };
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; ++i)
+    {
+        text_printf(&buf, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                counter_names[i], counter_help[i], counter_names[i],
+                counter_names[i], (unsigned long long)counters_copy[i]);
+    }
+
+    repo_gauge(&buf, "gwatch_watched_directories",
+            "Directories with a watch", watched_dirs_value);
+    repo_gauge(&buf, "gwatch_dirty_paths",
+            "Changed paths waiting for a commit", dirty_value);
+    repo_gauge(&buf, "gwatch_full_scan_pending",
+            "1 if the next commit scans the whole tree", full_scan_value);
+
+    text_printf(&buf, "# HELP gwatch_commit_phase_seconds "
+            "Time spent in each phase of a commit\n"
+            "# TYPE gwatch_commit_phase_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; ++p)
+    {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b)
+        {
+            cumulative += phases_copy[p].buckets[b];
+            if (b < BUCKET_COUNT - 1)
+                text_printf(&buf, "gwatch_commit_phase_seconds_bucket"
+                        "{phase=\"%s\",le=\"%g\"} %llu\n", phase_names[p],
+                        bucket_bounds[b], (unsigned long long)cumulative);
+            else
+                text_printf(&buf, "gwatch_commit_phase_seconds_bucket"
+                        "{phase=\"%s\",le=\"+Inf\"} %llu\n", phase_names[p],
+                        (unsigned long long)cumulative);
+        }
+        text_printf(&buf, "gwatch_commit_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+                "gwatch_commit_phase_seconds_count{phase=\"%s\"} %llu\n",
+                phase_names[p], (double)phases_copy[p].sum / 1e9,
+                phase_names[p], (unsigned long long)phases_copy[p].count);
+    }
+
+    size_t rss = 0;
+    uv_resident_set_memory(&rss);
+    text_printf(&buf, "# HELP gwatch_resident_memory_bytes "
+            "Resident memory of the process\n"
+            "# TYPE gwatch_resident_memory_bytes gauge\n"
+            "gwatch_resident_memory_bytes %zu\n", rss);
+
+    return buf.data;
+}
+
+void metrics_client_close_cb(uv_handle_t* handle)
+{
+    free(handle->data);
+}
+
+void metrics_reply_cb(uv_write_t* req, int status)
+{
+    (void)status;
+    metrics_reply* r = req->data;
+    uv_close((uv_handle_t*)&r->client->handle, metrics_client_close_cb);
+    free(r->text);
+    free(r);
+}
+
+// the answer is plain HTTP, so that Prometheus or curl can scrape it directly
+void metrics_answer(metrics_client* client)
+{
+    char* body = format_metrics();
+    size_t body_len = strlen(body);
+
+    text_buf buf = { malloc(body_len + 256), 0, body_len + 256 };
+    text_printf(&buf, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n%s", body_len, body);
+    free(body);
+
+    metrics_reply* r = malloc(sizeof(metrics_reply));
+    r->req.data = r;
+    r->client = client;
+    r->text = buf.data;
+    client->answered = true;
+
+    uv_buf_t out = uv_buf_init(buf.data, (unsigned int)buf.len);
+    if (uv_write(&r->req, (uv_stream_t*)&client->handle, &out, 1,
+                metrics_reply_cb) < 0)
+    {
+        uv_close((uv_handle_t*)&client->handle, metrics_client_close_cb);
+        free(r->text);
+        free(r);
+    }
+}
+
+void metrics_alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+{
+    (void)suggested_size;
+    metrics_client* client = handle->data;
+    *buf = uv_buf_init(client->buf + client->len,
+            (unsigned int)(sizeof(client->buf) - client->len));
+}
+
+void metrics_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    (void)buf;
+    metrics_client* client = stream->data;
+
+    if (client->answered)
+        return;
+
+    // whatever the request is, the end of its header or of the input is
+    // answered with the metrics
+    if (nread > 0)
+        client->len += (size_t)nread;
+
+    bool complete = nread < 0 || client->len == sizeof(client->buf);
+    for (size_t i = 0; !complete && i + 1 < client->len; ++i)
+    {
+        complete = client->buf[i] == '\n' &&
+            (client->buf[i + 1] == '\n' ||
+             (client->buf[i + 1] == '\r' && i + 2 < client->len &&
+              client->buf[i + 2] == '\n'));
+    }
+
+    if (complete)
+    {
+        uv_read_stop(stream);
+        metrics_answer(client);
+    }
+}
+
+void metrics_connection_cb(uv_stream_t* server, int status)
+{
+    if (status < 0)
+        return;
+
+    metrics_client* client = malloc(sizeof(metrics_client));
+    client->len = 0;
+    client->answered = false;
+    if (metrics_tcp)
+        uv_tcp_init(loop_metrics, &client->handle.tcp);
+    else
+        uv_pipe_init(loop_metrics, &client->handle.pipe, 0);
+    client->handle.tcp.data = client;
+
+    if (uv_accept(server, (uv_stream_t*)&client->handle) < 0)
+    {
+        uv_close((uv_handle_t*)&client->handle, metrics_client_close_cb);
+        return;
+    }
+
+    uv_read_start((uv_stream_t*)&client->handle, metrics_alloc_cb, metrics_read_cb);
+}
+
+bool metrics_start(uv_loop_t* loop, const char* address)
+{
+    int error;
+    loop_metrics = loop;
+    metrics_tcp = address[0] != '\0' &&
+        strspn(address, "0123456789") == strlen(address);
+
+    if (metrics_tcp)
+    {
+        // only the local host may read the metrics
+        struct sockaddr_in addr;
+        long int port = strtol(address, NULL, 10);
+        uv_tcp_init(loop, &metrics_server.tcp);
+        error = port >= 1 && port <= 65535 ? 0 : UV_EINVAL;
+        if (error == 0)
+            error = uv_ip4_addr("127.0.0.1", (int)port, &addr);
+        if (error == 0)
+            error = uv_tcp_bind(&metrics_server.tcp,
+                    (const struct sockaddr*)&addr, 0);
+    }
+    else
+    {
+        uv_pipe_init(loop, &metrics_server.pipe, 0);
+
+#ifndef WIN32
+        struct stat st;
+        if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+            remove(address);
+#endif
+
+        error = uv_pipe_bind(&metrics_server.pipe, address);
+    }
+
+    if (error == 0)
+        error = uv_listen((uv_stream_t*)&metrics_server, 16, metrics_connection_cb);
+
+    if (error < 0)
+    {
+        pflog("Cannot serve metrics on %s, %s", address, uv_strerror(error));
+        uv_close((uv_handle_t*)&metrics_server, NULL);
+        return false;
+    }
+
+    pflog("Serving metrics on %s", address);
+    return true;
+}
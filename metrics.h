@@ -0,0 +1,52 @@
+#pragma once
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum metric_counter
+{
+    METRIC_EVENTS,
+    METRIC_EVENTS_DROPPED, // merged into a full scan, the path is lost
+    METRIC_COMMITS,
+    METRIC_COMMIT_FAILURES,
+    METRIC_BYTES_HASHED, // content of the files added to the index
+    METRIC_BYTES_WRITTEN, // size of the new loose object files
+    METRIC_OBJECTS_WRITTEN,
+    METRIC_LOG_LINES_DROPPED,
+    METRIC_COUNTER_COUNT
+} metric_counter;
+
+typedef enum commit_phase
+{
+    PHASE_OPEN,
+    PHASE_INDEX_LOAD,
+    PHASE_STATUS, // finding and hashing the changed files
+    PHASE_ADD, // the part of PHASE_STATUS spent updating index entries
+    PHASE_INDEX_WRITE,
+    PHASE_TREE_WRITE,
+    PHASE_COMMIT,
+    PHASE_PACK, // packing the versions of large files, now and then
+    PHASE_RETENTION, // thinning the history, once a day at most
+    PHASE_TOTAL,
+    PHASE_COUNT
+} commit_phase;
+
+// running totals of one repository, only touched by its commit thread
+typedef struct commit_counts
+{
+    uint64_t files_visited;
+    uint64_t files_added;
+    uint64_t bytes_hashed;
+    uint64_t bytes_written;
+    uint64_t objects_written;
+} commit_counts;
+
+// safe to call from any thread
+void metrics_add(metric_counter counter, uint64_t value);
+void metrics_observe(commit_phase phase, uint64_t ns);
+const char* metrics_phase_name(commit_phase phase);
+
+// address is a loopback TCP port number or a local socket path
+bool metrics_start(uv_loop_t* loop, const char* address);
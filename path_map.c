@@ -0,0 +1,163 @@
+#include "path_map.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_MAP_MIN_CAPACITY 16
+
+uint64_t path_hash(const char* path)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037u;
+    for (const unsigned char* it = (const unsigned char*)path; *it; ++it)
+    {
+        hash ^= *it;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+size_t path_map_find(const path_map* map, const char* path)
+{
+    size_t mask = map->capacity - 1;
+    size_t i = (size_t)path_hash(path) & mask;
+
+    while (map->entries[i].path && strcmp(map->entries[i].path, path) != 0)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+void path_map_grow(path_map* map)
+{
+    path_map_entry* old = map->entries;
+    size_t old_capacity = map->capacity;
+
+    map->capacity = old_capacity ? old_capacity * 2 : PATH_MAP_MIN_CAPACITY;
+    map->entries = calloc(map->capacity, sizeof(path_map_entry));
+
+    for (size_t i = 0; i < old_capacity; ++i)
+    {
+        if (old[i].path)
+            map->entries[path_map_find(map, old[i].path)] = old[i];
+    }
+
+    free(old);
+}
+
+void path_map_init(path_map* map)
+{
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+void path_map_free(path_map* map)
+{
+    path_map_clear(map);
+    free(map->entries);
+    path_map_init(map);
+}
+
+void path_map_clear(path_map* map)
+{
+    for (size_t i = 0; i < map->capacity && map->count > 0; ++i)
+    {
+        if (map->entries[i].path)
+        {
+            free(map->entries[i].path);
+            map->entries[i].path = NULL;
+            --map->count;
+        }
+    }
+}
+
+void path_map_swap(path_map* a, path_map* b)
+{
+    path_map temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+bool path_map_add(path_map* map, const char* path, void* value)
+{
+    // keep the load factor below 3/4
+    if ((map->count + 1) * 4 > map->capacity * 3)
+        path_map_grow(map);
+
+    size_t i = path_map_find(map, path);
+    if (map->entries[i].path)
+        return false;
+
+    size_t len = strlen(path);
+    map->entries[i].path = malloc(len + 1);
+    memcpy(map->entries[i].path, path, len + 1);
+    map->entries[i].value = value;
+    ++map->count;
+    return true;
+}
+
+bool path_map_contains(const path_map* map, const char* path)
+{
+    return map->count > 0 && map->entries[path_map_find(map, path)].path;
+}
+
+void* path_map_get(const path_map* map, const char* path)
+{
+    if (map->count == 0)
+        return NULL;
+
+    return map->entries[path_map_find(map, path)].value;
+}
+
+bool path_map_remove(path_map* map, const char* path)
+{
+    if (map->count == 0)
+        return false;
+
+    size_t mask = map->capacity - 1;
+    size_t i = path_map_find(map, path);
+    if (!map->entries[i].path)
+        return false;
+
+    free(map->entries[i].path);
+    map->entries[i].path = NULL;
+    --map->count;
+
+    // backward shift deletion keeps probe sequences intact without tombstones
+    size_t j = i;
+    while (true)
+    {
+        j = (j + 1) & mask;
+        if (!map->entries[j].path)
+            break;
+
+        size_t home = (size_t)path_hash(map->entries[j].path) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            map->entries[i] = map->entries[j];
+            map->entries[j].path = NULL;
+            i = j;
+        }
+    }
+
+    return true;
+}
+
+bool path_map_next(const path_map* map, size_t* it, const char** path,
+        void** value)
+{
+    while (*it < map->capacity)
+    {
+        path_map_entry* entry = &map->entries[(*it)++];
+        if (entry->path)
+        {
+            *path = entry->path;
+            if (value)
+                *value = entry->value;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct path_map_entry
+{
+    char* path; // NULL for an empty slot
+    void* value;
+} path_map_entry;
+
+// open addressing hash map from a path to an optional value
+typedef struct path_map
+{
+    path_map_entry* entries;
+    size_t capacity;
+    size_t count;
+} path_map;
+
+void path_map_init(path_map* map);
+void path_map_free(path_map* map);
+void path_map_clear(path_map* map);
+void path_map_swap(path_map* a, path_map* b);
+bool path_map_add(path_map* map, const char* path, void* value);
+bool path_map_contains(const path_map* map, const char* path);
+void* path_map_get(const path_map* map, const char* path);
+bool path_map_remove(path_map* map, const char* path);
+bool path_map_next(const path_map* map, size_t* it, const char** path,
+        void** value);
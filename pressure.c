@@ -0,0 +1,150 @@
+#include "pressure.h"
+#include "args.h"
+#include "logs.h"
+#include "thread_oper.h"
+
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define PSI_DEFER_STEP 1000 // ms, timer step before the commit starts
+#define PSI_THROTTLE_STEP 100 // ms, wait step while hashing
+#define PSI_CHECK_INTERVAL 250 // ms, how often hashing looks at PSI
+
+uv_once_t totals_once = UV_ONCE_INIT;
+uv_mutex_t totals_mutex;
+unsigned long total_deferrals = 0;
+uint64_t total_deferred = 0; // ns
+bool psi_unavailable = false; // set by pressure_start, only read afterwards
+
+double read_psi(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return -1.0;
+
+    double avg10 = -1.0;
+    if (fscanf(f, "some avg10=%lf", &avg10) != 1)
+        avg10 = -1.0;
+
+    fclose(f);
+    return avg10;
+}
+
+double current_pressure()
+{
+    double io = read_psi("/proc/pressure/io");
+    double cpu = read_psi("/proc/pressure/cpu");
+
+    // a file that cannot be read counts as no pressure
+    double pressure = io > cpu ? io : cpu;
+    return pressure > 0.0 ? pressure : 0.0;
+}
+
+void pressure_start()
+{
+    if (get_psi_threshold() == 0)
+        return;
+
+    if (read_psi("/proc/pressure/io") < 0.0 &&
+            read_psi("/proc/pressure/cpu") < 0.0)
+    {
+        plog("PSI is not available - the pressure governor is disabled");
+        psi_unavailable = true;
+    }
+}
+
+void wait_while_pressured(pressure_budget* budget, unsigned int step)
+{
+    uint64_t max_defer = (uint64_t)get_psi_max_defer() * 1000000000u;
+    bool counted = false;
+
+    while (budget->deferred < max_defer &&
+            current_pressure() >= (double)get_psi_threshold())
+    {
+        if (!counted)
+        {
+            ++budget->deferrals;
+            counted = true;
+        }
+
+        uint64_t start = uv_hrtime();
+        thread_sleep(step);
+        budget->deferred += uv_hrtime() - start;
+    }
+
+    budget->last_check = uv_hrtime();
+}
+
+void pressure_budget_init(pressure_budget* budget)
+{
+    budget->last_check = 0;
+    budget->deferred = 0;
+    budget->deferrals = 0;
+}
+
+unsigned int pressure_defer(pressure_budget* budget)
+{
+    if (get_psi_threshold() == 0 || psi_unavailable)
+        return 0;
+
+    // the time since the last step is what the timer kept the commit back
+    uint64_t now = uv_hrtime();
+    if (budget->last_check != 0)
+        budget->deferred += now - budget->last_check;
+
+    uint64_t max_defer = (uint64_t)get_psi_max_defer() * 1000000000u;
+    bool wait = budget->deferred < max_defer &&
+        current_pressure() >= (double)get_psi_threshold();
+    if (wait && budget->last_check == 0)
+        ++budget->deferrals;
+
+    budget->last_check = now;
+    return wait ? PSI_DEFER_STEP : 0;
+}
+
+void pressure_throttle(pressure_budget* budget)
+{
+    if (get_psi_threshold() == 0 || psi_unavailable)
+        return;
+
+    if (uv_hrtime() - budget->last_check < PSI_CHECK_INTERVAL * 1000000u)
+        return;
+
+    wait_while_pressured(budget, PSI_THROTTLE_STEP);
+}
+
+void init_totals_mutex()
+{
+    uv_mutex_init(&totals_mutex);
+}
+
+void pressure_report(const pressure_budget* budget)
+{
+    if (budget->deferrals == 0)
+        return;
+
+    // commits of different repositories report from different threads
+    uv_once(&totals_once, init_totals_mutex);
+    uv_mutex_lock(&totals_mutex);
+    total_deferrals += budget->deferrals;
+    total_deferred += budget->deferred;
+    unsigned long deferrals = total_deferrals;
+    uint64_t deferred = total_deferred;
+    uv_mutex_unlock(&totals_mutex);
+
+    pflog("Commit deferred %u time(s) for %.1fs due to IO/CPU pressure "
+            "(%lu deferrals, %.1fs in total)", budget->deferrals,
+            (double)budget->deferred / 1e9, deferrals,
+            (double)deferred / 1e9);
+}
+
+void pressure_get_totals(unsigned long* deferrals, uint64_t* deferred_ns)
+{
+    uv_once(&totals_once, init_totals_mutex);
+    uv_mutex_lock(&totals_mutex);
+    *deferrals = total_deferrals;
+    *deferred_ns = total_deferred;
+    uv_mutex_unlock(&totals_mutex);
+}
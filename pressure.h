@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct pressure_budget
+{
+    uint64_t last_check; // ns
+    uint64_t deferred; // ns spent waiting during the current commit
+    unsigned int deferrals;
+} pressure_budget;
+
+// checks once whether PSI can be read, before any commit thread starts
+void pressure_start();
+
+void pressure_budget_init(pressure_budget* budget);
+// runs on the loop thread before a commit starts: the time in ms to wait
+// before asking again while IO/CPU pressure is high, 0 once the commit can
+// start; nothing sleeps, the caller waits on a timer
+unsigned int pressure_defer(pressure_budget* budget);
+
+// runs on the commit thread while hashing and sleeps it while the pressure
+// is high, within what is left of --psi-max-defer
+void pressure_throttle(pressure_budget* budget);
+void pressure_report(const pressure_budget* budget);
+void pressure_get_totals(unsigned long* deferrals, uint64_t* deferred_ns);
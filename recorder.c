@@ -0,0 +1,332 @@
+#include "recorder.h"
+#include "logs.h"
+
+#include <uv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// "GWTR", version, then records: 'R' defines the next repository index,
+// 'E' is an event; numbers are LEB128 varints and times are deltas in us
+#define RECORDING_MAGIC "GWTR"
+#define RECORDING_VERSION 1
+#define RECORD_REPO 'R'
+#define RECORD_EVENT 'E'
+#define MAX_RECORDED_PATH 4096
+
+// an event whose path is examined on the threadpool, the records are
+// written in the order the events arrived
+typedef struct recorder_job
+{
+    uv_work_t req;
+    uint64_t time; // us since origin
+    uint64_t repo;
+    int events;
+    char* full;
+    const char* path; // relative, points into full
+    recorded_kind kind;
+    uint64_t size;
+    git_oid id;
+    bool done;
+    struct recorder_job* next;
+} recorder_job;
+
+FILE* recorder_file = NULL;
+uint64_t recorder_origin; // ns
+uint64_t recorder_last; // us since origin
+char** recorder_repos = NULL;
+uint64_t recorder_repo_count = 0;
+uint64_t recorder_repos_written = 0;
+recorder_job* recorder_head = NULL;
+recorder_job* recorder_tail = NULL;
+
+void put_varint(FILE* f, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        fputc((int)(v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc((int)v, f);
+}
+
+void put_string(FILE* f, const char* str)
+{
+    size_t len = strlen(str);
+    put_varint(f, len);
+    fwrite(str, 1, len, f);
+}
+
+bool recorder_start(const char* path)
+{
+    recorder_file = fopen(path, "wb");
+    if (!recorder_file)
+    {
+        pflog("Cannot open the recording %s", path);
+        return false;
+    }
+
+    fwrite(RECORDING_MAGIC, 1, 4, recorder_file);
+    fputc(RECORDING_VERSION, recorder_file);
+    recorder_origin = uv_hrtime();
+    recorder_last = 0;
+    pflog("Recording events to %s", path);
+    return true;
+}
+
+bool recorder_enabled()
+{
+    return recorder_file != NULL;
+}
+
+// the record of a repository is written before its first event
+uint64_t recorder_repo(const char* repo_root)
+{
+    for (uint64_t i = 0; i < recorder_repo_count; ++i)
+    {
+        if (strcmp(recorder_repos[i], repo_root) == 0)
+            return i;
+    }
+
+    size_t len = strlen(repo_root);
+    recorder_repos = realloc(recorder_repos,
+            (size_t)(recorder_repo_count + 1) * sizeof(char*));
+    recorder_repos[recorder_repo_count] = malloc(len + 1);
+    memcpy(recorder_repos[recorder_repo_count], repo_root, len + 1);
+    return recorder_repo_count++;
+}
+
+void recorder_work(uv_work_t* req)
+{
+    recorder_job* job = req->data;
+
+    uv_fs_t fs_req;
+    if (uv_fs_lstat(NULL, &fs_req, job->full, NULL) == 0)
+    {
+        if ((fs_req.statbuf.st_mode & S_IFMT) == S_IFREG)
+        {
+            job->kind = RECORDED_FILE;
+            job->size = fs_req.statbuf.st_size;
+            // a file replaced meanwhile is recorded with what is there now
+            if (git_odb_hashfile(&job->id, job->full, GIT_OBJ_BLOB) < 0)
+                job->kind = RECORDED_MISSING;
+        }
+        else if ((fs_req.statbuf.st_mode & S_IFMT) == S_IFDIR)
+            job->kind = RECORDED_DIR;
+        else
+            job->kind = RECORDED_OTHER;
+    }
+    uv_fs_req_cleanup(&fs_req);
+}
+
+void recorder_write(const recorder_job* job)
+{
+    while (recorder_repos_written <= job->repo)
+    {
+        fputc(RECORD_REPO, recorder_file);
+        put_string(recorder_file, recorder_repos[recorder_repos_written++]);
+    }
+
+    fputc(RECORD_EVENT, recorder_file);
+    put_varint(recorder_file, job->time - recorder_last);
+    put_varint(recorder_file, job->repo);
+    put_varint(recorder_file, (uint64_t)job->events);
+    fputc((int)job->kind, recorder_file);
+    if (job->kind == RECORDED_FILE)
+    {
+        put_varint(recorder_file, job->size);
+        fwrite(job->id.id, 1, GIT_OID_RAWSZ, recorder_file);
+    }
+    put_string(recorder_file, job->path);
+    recorder_last = job->time;
+}
+
+// an event hashed early waits for the ones before it
+void recorder_flush()
+{
+    while (recorder_head && recorder_head->done)
+    {
+        recorder_job* job = recorder_head;
+        recorder_head = job->next;
+        if (!recorder_head)
+            recorder_tail = NULL;
+
+        recorder_write(job);
+        free(job->full);
+        free(job);
+    }
+}
+
+void recorder_done(uv_work_t* req, int status)
+{
+    (void)status;
+    recorder_job* job = req->data;
+    job->done = true;
+    recorder_flush();
+}
+
+void recorder_event(uv_loop_t* loop, const char* repo_root, const char* path,
+        int events)
+{
+    if (!recorder_file)
+        return;
+
+    // the time the event arrived, not the time its file was hashed
+    recorder_job* job = calloc(1, sizeof(recorder_job));
+    job->req.data = job;
+    job->time = (uv_hrtime() - recorder_origin) / 1000;
+    job->repo = recorder_repo(repo_root);
+    job->events = events;
+    job->kind = RECORDED_MISSING;
+
+    size_t root_len = strlen(repo_root);
+    size_t len = strlen(path);
+    job->full = malloc(root_len + len + 2);
+    memcpy(job->full, repo_root, root_len);
+    job->full[root_len] = '/';
+    memcpy(job->full + root_len + 1, path, len + 1);
+    job->path = job->full + root_len + 1;
+
+    if (recorder_tail)
+        recorder_tail->next = job;
+    else
+        recorder_head = job;
+    recorder_tail = job;
+
+    uv_queue_work(loop, &job->req, recorder_work, recorder_done);
+}
+
+void recorder_stop()
+{
+    if (!recorder_file)
+        return;
+
+    // the loop has finished all the work, nothing is left in the queue
+    recorder_flush();
+    fclose(recorder_file);
+    recorder_file = NULL;
+    recorder_repos_written = 0;
+
+    for (uint64_t i = 0; i < recorder_repo_count; ++i)
+        free(recorder_repos[i]);
+    free(recorder_repos);
+    recorder_repos = NULL;
+    recorder_repo_count = 0;
+}
+
+bool get_varint(FILE* f, uint64_t* v)
+{
+    *v = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+        int c = fgetc(f);
+        if (c == EOF)
+            return false;
+
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+char* get_string(FILE* f, char** buf, size_t* size)
+{
+    uint64_t len;
+    if (!get_varint(f, &len) || len >= MAX_RECORDED_PATH)
+        return NULL;
+
+    if (*size < len + 1)
+    {
+        *buf = realloc(*buf, (size_t)len + 1);
+        *size = (size_t)len + 1;
+    }
+    if (fread(*buf, 1, (size_t)len, f) != len)
+        return NULL;
+
+    (*buf)[len] = '\0';
+    return *buf;
+}
+
+bool recording_open(recording* r, const char* path)
+{
+    char magic[5];
+
+    memset(r, 0, sizeof(*r));
+    r->file = fopen(path, "rb");
+    if (!r->file)
+        return false;
+
+    if (fread(magic, 1, 5, r->file) != 5 ||
+            memcmp(magic, RECORDING_MAGIC, 4) != 0 ||
+            magic[4] != RECORDING_VERSION)
+    {
+        fclose(r->file);
+        r->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool recording_next(recording* r, recorded_event* event)
+{
+    int type;
+    while ((type = fgetc(r->file)) == RECORD_REPO)
+    {
+        char* repo = NULL;
+        size_t size = 0;
+        if (!get_string(r->file, &repo, &size))
+        {
+            free(repo);
+            return false;
+        }
+
+        r->repos = realloc(r->repos,
+                (size_t)(r->repo_count + 1) * sizeof(char*));
+        r->repos[r->repo_count++] = repo;
+    }
+
+    if (type != RECORD_EVENT)
+        return false;
+
+    uint64_t delta, repo, events, size = 0;
+    int kind;
+    if (!get_varint(r->file, &delta) || !get_varint(r->file, &repo) ||
+            repo >= r->repo_count || !get_varint(r->file, &events) ||
+            (kind = fgetc(r->file)) == EOF || kind > RECORDED_OTHER)
+        return false;
+
+    memset(&event->id, 0, sizeof(event->id));
+    if (kind == RECORDED_FILE && (!get_varint(r->file, &size) ||
+                fread(event->id.id, 1, GIT_OID_RAWSZ, r->file) !=
+                GIT_OID_RAWSZ))
+        return false;
+
+    if (!get_string(r->file, &r->path, &r->path_size))
+        return false;
+
+    r->time += delta;
+    event->time = r->time * 1000;
+    event->repo = r->repos[repo];
+    event->path = r->path;
+    event->events = (int)events;
+    event->kind = (recorded_kind)kind;
+    event->size = size;
+    return true;
+}
+
+bool recording_error(const recording* r)
+{
+    return !feof(r->file) || ferror(r->file);
+}
+
+void recording_close(recording* r)
+{
+    if (r->file)
+        fclose(r->file);
+    for (uint64_t i = 0; i < r->repo_count; ++i)
+        free(r->repos[i]);
+    free(r->repos);
+    free(r->path);
+    memset(r, 0, sizeof(*r));
+}
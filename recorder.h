@@ -0,0 +1,54 @@
+#pragma once
+
+#include <git2.h>
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// the state of an event's path when it was delivered
+typedef enum recorded_kind
+{
+    RECORDED_MISSING,
+    RECORDED_FILE,
+    RECORDED_DIR,
+    RECORDED_OTHER
+} recorded_kind;
+
+typedef struct recorded_event
+{
+    uint64_t time; // ns since the recording started
+    const char* repo;
+    const char* path; // relative to the repository root
+    int events; // UV_RENAME, UV_CHANGE
+    recorded_kind kind;
+    uint64_t size; // files only
+    git_oid id; // blob id of the content, files only
+} recorded_event;
+
+// every event given to the listener with the state of its path, in a
+// compact binary file; the path is examined on the threadpool of the loop
+bool recorder_start(const char* path);
+bool recorder_enabled();
+void recorder_event(uv_loop_t* loop, const char* repo_root, const char* path,
+        int events);
+void recorder_stop();
+
+// reading a recording back, the strings of an event stay valid until the
+// next call
+typedef struct recording
+{
+    FILE* file;
+    char** repos;
+    uint64_t repo_count;
+    uint64_t time;
+    char* path;
+    size_t path_size;
+} recording;
+
+bool recording_open(recording* r, const char* path);
+// false at the end or when the file is damaged, see recording_error
+bool recording_next(recording* r, recorded_event* event);
+bool recording_error(const recording* r);
+void recording_close(recording* r);
@@ -0,0 +1,162 @@
+#include "repos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+watched_repo* repos_head = NULL;
+watched_repo* repos_tail = NULL;
+
+size_t trimmed_length(const char* path)
+{
+    size_t len = strlen(path);
+    // trailing slashes would break the relative paths of events
+    while (len > 1 && (path[len-1] == '/' || path[len-1] == '\\'))
+        --len;
+    return len;
+}
+
+// the same folder is found however it is named, e.g. ./repo or /abs/repo;
+// a path that does not exist (yet) is kept as it is
+char* canonical_path(const char* path)
+{
+    uv_fs_t req;
+    const char* found = path;
+    if (uv_fs_realpath(NULL, &req, path, NULL) == 0)
+        found = req.ptr;
+
+    size_t len = trimmed_length(found);
+    char* result = malloc(len + 1);
+    memcpy(result, found, len);
+    result[len] = '\0';
+    uv_fs_req_cleanup(&req);
+    return result;
+}
+
+void free_repo(watched_repo* repo)
+{
+    git_repository_free(repo->git_repo);
+    hash_cache_free(&repo->hash_cache);
+    delta_pack_free(&repo->delta_pack);
+    path_map_free(&repo->dirty);
+    path_map_free(&repo->commit_paths);
+    state_free(repo->warm_state);
+    journal_close(&repo->journal);
+    free(repo->git_dir);
+    free(repo->path);
+    free(repo);
+}
+
+watched_repo* repos_add(const char* path)
+{
+    watched_repo* repo = calloc(1, sizeof(watched_repo));
+    repo->path = canonical_path(path);
+    repo_find_git_dir(repo);
+
+    path_map_init(&repo->dirty);
+    path_map_init(&repo->commit_paths);
+    hash_cache_init(&repo->hash_cache);
+    delta_pack_init(&repo->delta_pack);
+    repo->full_scan = true;
+    commit_queue_init(&repo->queue);
+
+    if (repos_tail)
+        repos_tail->next = repo;
+    else
+        repos_head = repo;
+    repos_tail = repo;
+
+    return repo;
+}
+
+watched_repo* repos_first()
+{
+    return repos_head;
+}
+
+watched_repo* repos_find(const char* path)
+{
+    char* canonical = canonical_path(path);
+
+    watched_repo* it = repos_head;
+    while (it && strcmp(it->path, canonical) != 0)
+        it = it->next;
+
+    free(canonical);
+    return it;
+}
+
+void repos_remove(watched_repo* repo)
+{
+    watched_repo* prev = NULL;
+    for (watched_repo* it = repos_head; it; prev = it, it = it->next)
+    {
+        if (it != repo)
+            continue;
+
+        if (prev)
+            prev->next = it->next;
+        else
+            repos_head = it->next;
+        if (repos_tail == it)
+            repos_tail = prev;
+        break;
+    }
+
+    free_repo(repo);
+}
+
+void repos_free()
+{
+    watched_repo* it = repos_head;
+    while (it)
+    {
+        watched_repo* temp = it;
+        it = it->next;
+        free_repo(temp);
+    }
+    repos_head = repos_tail = NULL;
+}
+
+bool repo_busy(const watched_repo* repo)
+{
+    // a commit thread may be using the repository
+    return repo->committing || repo->saving;
+}
+
+void repo_find_git_dir(watched_repo* repo)
+{
+    git_repository* git_repo = NULL;
+    char fallback[2048];
+    const char* git_dir = fallback;
+
+    // the same way commits open it, a gitfile is followed
+    repo->git_dir_found = git_repository_open(&git_repo, repo->path) == 0;
+    if (repo->git_dir_found)
+        git_dir = git_repository_path(git_repo);
+    else
+        snprintf(fallback, sizeof(fallback), "%s/.git/", repo->path);
+
+    size_t len = strlen(git_dir);
+    free(repo->git_dir);
+    repo->git_dir = malloc(len + 1);
+    memcpy(repo->git_dir, git_dir, len + 1);
+    git_repository_free(git_repo);
+}
+
+void repo_gwatch_path(const char* git_dir, const char* name, char* buf,
+        size_t size)
+{
+    snprintf(buf, size, "%sgwatch/%s", git_dir, name);
+}
+
+bool repo_make_gwatch_dir(const char* git_dir)
+{
+    char path[2048];
+    uv_fs_t req;
+
+    repo_gwatch_path(git_dir, "", path, sizeof(path));
+    int error = uv_fs_mkdir(NULL, &req, path, 0755, NULL);
+    uv_fs_req_cleanup(&req);
+    return error == 0 || error == UV_EEXIST;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "commit_worker.h"
+#include "delta_pack.h"
+#include "hash_cache.h"
+#include "journal.h"
+#include "metrics.h"
+#include "path_map.h"
+#include "pressure.h"
+#include "state.h"
+
+#include <git2.h>
+#include <uv.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// beyond this many distinct paths a full scan is cheaper than per-path ones
+#define DIRTY_SET_LIMIT 4096
+
+typedef enum commit_result
+{
+    COMMIT_FAILED,
+    COMMIT_NO_CHANGES, // nothing to commit, or HEAD is detached
+    COMMIT_CREATED
+} commit_result;
+
+struct watched_repo
+{
+    char* path;
+    char* git_dir; // with a trailing slash, .git/ or where a gitfile points
+    bool git_dir_found; // false while the folder is no repository yet
+
+    // owned by the commit thread
+    git_repository* git_repo;
+    commit_counts counts;
+    hash_cache hash_cache; // blob ids of files staged before
+    bool hash_cache_opened; // moved to .git/gwatch/hashes, once
+    bool index_refresh; // the next full scan refreshes the index first
+    delta_pack delta_pack; // large blobs not packed yet
+    int64_t retention_next; // s since the epoch, of the next thinning
+    int64_t retention_thinned; // commits older than this are thinned
+    bool snapshot_no_clone; // the file system cannot clone files
+
+    // owned by the loop thread
+    uv_timer_t low_pass_timer;
+    uv_timer_t retry_timer;
+    void* watch_data; // fs_oper backend state
+    unsigned int watched_dirs;
+    path_map dirty; // paths relative to the repository root
+    journal journal; // mirrors dirty on disk
+    bool full_scan; // the dirty set is incomplete, scan the whole tree
+    bool paused;
+    bool flush_requested;
+    bool removed;
+    bool saving;
+    int open_timers;
+    uint64_t last_save; // ms, loop time
+
+    // handed over to the commit thread while committing is true
+    path_map commit_paths;
+    bool commit_full_scan;
+    commit_result commit_result;
+    bool committing;
+    pressure_budget pressure; // deferred on the loop, then throttled
+    warm_state* warm_state; // consumed by the next commit
+    bool journal_replay; // dirty was recovered from a journal at journal_base
+    git_oid journal_base;
+    bool scan_after_replay; // only the journal was committed, scan next
+    bool committed_tree_valid; // set by a successful commit
+    git_oid committed_tree;
+    warm_dir* save_dirs;
+    size_t save_dir_count;
+    commit_queue queue;
+
+    struct watched_repo* next;
+};
+typedef struct watched_repo watched_repo;
+
+watched_repo* repos_add(const char* path);
+watched_repo* repos_first();
+watched_repo* repos_find(const char* path);
+void repos_remove(watched_repo* repo);
+bool repo_busy(const watched_repo* repo);
+// the files of gwatch live in gwatch/ of the git dir, which for worktrees,
+// submodules and separate git dirs is not the .git folder of the worktree
+void repo_find_git_dir(watched_repo* repo);
+void repo_gwatch_path(const char* git_dir, const char* name, char* buf,
+        size_t size);
+bool repo_make_gwatch_dir(const char* git_dir);
+void repos_free();
@@ -0,0 +1,229 @@
+#include "retention.h"
+#include "git.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RETENTION_ALL (24 * 3600) // s, every commit this young is kept
+#define RETENTION_HOURLY (30 * 24 * 3600) // s, then one per hour until then
+#define RETENTION_HOUR 3600
+#define RETENTION_DAY (24 * 3600)
+
+typedef struct walked_commit
+{
+    git_oid id;
+    int64_t time;
+    bool keep;
+} walked_commit;
+
+bool is_gwatch_commit(const git_commit* commit)
+{
+    const git_signature* author = git_commit_author(commit);
+    return git_commit_parentcount(commit) <= 1 &&
+        strcmp(author->name, GWATCH_NAME) == 0 &&
+        strcmp(author->email, GWATCH_EMAIL) == 0;
+}
+
+int compare_oids(const void* a, const void* b)
+{
+    return git_oid_cmp((const git_oid*)a, (const git_oid*)b);
+}
+
+// entries are dropped oldest first, the end of the list is the cheap end
+bool drop_reflog_entries(git_repository* repo, const char* name,
+        const git_oid* replaced, size_t count)
+{
+    git_reflog* reflog = NULL;
+    if (git_reflog_read(&reflog, repo, name) < 0)
+        return false;
+
+    bool changed = false;
+    for (size_t i = git_reflog_entrycount(reflog); i-- > 0;)
+    {
+        const git_reflog_entry* entry = git_reflog_entry_byindex(reflog, i);
+        if (bsearch(git_reflog_entry_id_new(entry), replaced, count,
+                    sizeof(git_oid), compare_oids))
+        {
+            git_reflog_drop(reflog, i, 1);
+            changed = true;
+        }
+    }
+
+    bool ok = !changed || git_reflog_write(reflog) == 0;
+    git_reflog_free(reflog);
+    return ok;
+}
+
+bool head_points_to(git_repository* repo, const char* branch)
+{
+    git_reference* head = NULL;
+    bool points = git_reference_lookup(&head, repo, "HEAD") == 0 &&
+        git_reference_type(head) == GIT_REF_SYMBOLIC &&
+        strcmp(git_reference_symbolic_target(head), branch) == 0;
+    git_reference_free(head);
+    return points;
+}
+
+// the kept commits are written again on top of each other, from the oldest
+// one whose parent was dropped on
+bool rewrite_commits(git_repository* repo, walked_commit* walked,
+        size_t count, const git_oid* base, git_oid* tip)
+{
+    bool has_parent = base != NULL;
+    git_oid parent_id;
+    if (base)
+        git_oid_cpy(&parent_id, base);
+
+    bool reuse = true;
+    for (size_t i = count; i-- > 0;)
+    {
+        if (!walked[i].keep)
+        {
+            reuse = false;
+            continue;
+        }
+        if (reuse)
+        {
+            git_oid_cpy(&parent_id, &walked[i].id);
+            has_parent = true;
+            continue;
+        }
+
+        git_commit* commit = NULL;
+        git_commit* parent = NULL;
+        git_tree* tree = NULL;
+        git_oid id;
+        bool ok = git_commit_lookup(&commit, repo, &walked[i].id) == 0 &&
+            git_commit_tree(&tree, commit) == 0 &&
+            (!has_parent ||
+             git_commit_lookup(&parent, repo, &parent_id) == 0);
+
+        const git_commit* parents[1] = { parent };
+        ok = ok && git_commit_create(&id, repo, NULL, git_commit_author(commit),
+                    git_commit_committer(commit),
+                    git_commit_message_encoding(commit),
+                    git_commit_message(commit), tree, has_parent ? 1 : 0,
+                    parents) == 0;
+
+        git_tree_free(tree);
+        git_commit_free(parent);
+        git_commit_free(commit);
+        if (!ok)
+            return false;
+
+        git_oid_cpy(&parent_id, &id);
+        has_parent = true;
+    }
+
+    git_oid_cpy(tip, &parent_id);
+    return true;
+}
+
+bool retention_apply(git_repository* repo, const char* branch, int64_t now,
+        int64_t* thinned, retention_result* result)
+{
+    memset(result, 0, sizeof(retention_result));
+
+    git_oid tip;
+    if (git_reference_name_to_id(&tip, repo, branch) < 0)
+        return false;
+
+    // the run of gwatch commits ends at a commit of someone else, a merge,
+    // the root or at the part thinned before
+    walked_commit* walked = NULL;
+    size_t capacity = 0;
+    git_oid base;
+    bool has_base = false;
+    git_oid id = tip;
+    bool ok = true;
+    for (;;)
+    {
+        git_commit* commit = NULL;
+        if (git_commit_lookup(&commit, repo, &id) < 0)
+        {
+            ok = false;
+            break;
+        }
+
+        int64_t time = git_commit_time(commit);
+        if (!is_gwatch_commit(commit) || time < *thinned)
+        {
+            git_oid_cpy(&base, &id);
+            has_base = true;
+            git_commit_free(commit);
+            break;
+        }
+
+        if (result->walked == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            walked = realloc(walked, capacity * sizeof(walked_commit));
+        }
+        walked_commit* w = &walked[result->walked++];
+        git_oid_cpy(&w->id, &id);
+        w->time = time;
+
+        bool root = git_commit_parentcount(commit) == 0;
+        if (!root)
+            git_oid_cpy(&id, git_commit_parent_id(commit, 0));
+        git_commit_free(commit);
+        if (root)
+            break;
+    }
+
+    // newest first, so the commit kept for an hour or a day is its newest
+    int64_t last_kept = 0;
+    for (size_t i = 0; ok && i < result->walked; ++i)
+    {
+        int64_t age = now - walked[i].time;
+        int64_t span = age < RETENTION_HOURLY ? RETENTION_HOUR : RETENTION_DAY;
+        walked[i].keep = i == 0 || age < RETENTION_ALL ||
+            walked[i].time / span != last_kept / span;
+        if (walked[i].keep)
+        {
+            last_kept = walked[i].time;
+            ++result->kept;
+        }
+    }
+
+    git_oid new_tip;
+    git_reference* ref = NULL;
+    if (ok && result->kept < result->walked)
+    {
+        ok = rewrite_commits(repo, walked, result->walked,
+                has_base ? &base : NULL, &new_tip) &&
+            git_reference_create_matching(&ref, repo, branch, &new_tip, 1,
+                    &tip, "gwatch: thinned history") == 0;
+        git_reference_free(ref);
+        result->rewritten = ok;
+    }
+
+    if (result->rewritten)
+    {
+        // the commits that are no longer on the branch, whether dropped or
+        // written again
+        size_t count = 0;
+        bool reuse = true;
+        git_oid* replaced = malloc(result->walked * sizeof(git_oid));
+        for (size_t i = result->walked; i-- > 0;)
+        {
+            reuse = reuse && walked[i].keep;
+            if (!reuse)
+                git_oid_cpy(&replaced[count++], &walked[i].id);
+        }
+        qsort(replaced, count, sizeof(git_oid), compare_oids);
+
+        if (!drop_reflog_entries(repo, branch, replaced, count) ||
+                (head_points_to(repo, branch) &&
+                 !drop_reflog_entries(repo, "HEAD", replaced, count)))
+            ok = false;
+        free(replaced);
+    }
+
+    // whole days past the hourly part have one commit left each
+    if (ok)
+        *thinned = (now - RETENTION_HOURLY) / RETENTION_DAY * RETENTION_DAY;
+
+    free(walked);
+    return ok;
+}
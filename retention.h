@@ -0,0 +1,26 @@
+#pragma once
+
+#include <git2.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RETENTION_INTERVAL (24 * 3600) // s, between passes over a branch
+
+typedef struct retention_result
+{
+    size_t walked;
+    size_t kept;
+    bool rewritten;
+} retention_result;
+
+// thins the run of gwatch commits at the tip of the branch: all commits of
+// the last day are kept, of older ones the newest of every hour for a month
+// and the newest of every day before that; the branch is only moved if it
+// still points where it did, and the reflog entries of the commits that
+// were replaced are dropped, so git gc can release them; commits older than
+// *thinned (s since the epoch, 0 for none) were thinned by an earlier pass
+// and are not walked again, *thinned is moved on after a pass
+bool retention_apply(git_repository* repo, const char* branch, int64_t now,
+        int64_t* thinned, retention_result* result);
@@ -0,0 +1,51 @@
+#include "snapshot.h"
+
+#include <sys/stat.h>
+
+bool snapshot_lstat(const char* path, uv_stat_t* st)
+{
+    uv_fs_t req;
+    int error = uv_fs_lstat(NULL, &req, path, NULL);
+    if (error == 0)
+        *st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+    return error == 0;
+}
+
+int snapshot_copy(const char* path, const char* snapshot_path, int flags)
+{
+    uv_fs_t req;
+    int error = uv_fs_copyfile(NULL, &req, path, snapshot_path, flags, NULL);
+    uv_fs_req_cleanup(&req);
+    return error;
+}
+
+bool snapshot_take(const char* path, const char* snapshot_path,
+        bool* no_clone, uv_stat_t* st)
+{
+    if (!snapshot_lstat(path, st) || (st->st_mode & S_IFMT) != S_IFREG)
+        return false;
+
+    // a clone shares the extents of the file as they are, atomically
+    if (!*no_clone)
+    {
+        int error = snapshot_copy(path, snapshot_path,
+                UV_FS_COPYFILE_FICLONE_FORCE);
+        if (error == 0)
+            return true;
+        *no_clone = error == UV_ENOTSUP || error == UV_ENOSYS;
+    }
+
+    if (st->st_size > SNAPSHOT_COPY_MAX ||
+            snapshot_copy(path, snapshot_path, 0) != 0)
+        return false;
+
+    // a copy is only as good as the file staying the same throughout
+    uv_stat_t after;
+    return snapshot_lstat(path, &after) &&
+        after.st_size == st->st_size &&
+        after.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+        after.st_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+        after.st_ctim.tv_sec == st->st_ctim.tv_sec &&
+        after.st_ctim.tv_nsec == st->st_ctim.tv_nsec;
+}
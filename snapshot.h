@@ -0,0 +1,17 @@
+#pragma once
+
+#include <uv.h>
+
+#include <stdbool.h>
+
+// larger files are only snapshotted where the file system can clone them
+#define SNAPSHOT_COPY_MAX (64 * 1024 * 1024)
+
+// copies the file at path to snapshot_path as it was at one point in time:
+// a reflink where the file system supports it, otherwise a copy of a file
+// up to SNAPSHOT_COPY_MAX bytes that did not change while it was copied;
+// st receives the stat data of the file taken before the copy, so a write
+// that slipped in before the copy shows up as a change later on; no_clone
+// is set once the file system turns out not to support reflinks
+bool snapshot_take(const char* path, const char* snapshot_path,
+        bool* no_clone, uv_stat_t* st);
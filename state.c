@@ -0,0 +1,477 @@
+#include "state.h"
+#include "git.h"
+#include "logs.h"
+#include "repos.h"
+
+#include <uv.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATE_MAGIC "GWST"
+#define STATE_VERSION 1
+#define STATE_FILE "state"
+#define STATE_TMP_FILE "state.tmp"
+
+typedef struct state_reader
+{
+    const unsigned char* p;
+    const unsigned char* end;
+    bool ok;
+} state_reader;
+
+uint64_t get_uint(state_reader* r, int bytes)
+{
+    uint64_t v = 0;
+    if ((size_t)(r->end - r->p) < (size_t)bytes)
+    {
+        r->ok = false;
+        return 0;
+    }
+
+    for (int i = 0; i < bytes; ++i)
+        v |= (uint64_t)r->p[i] << (8 * i);
+    r->p += bytes;
+    return v;
+}
+
+void put_uint(FILE* f, uint64_t v, int bytes)
+{
+    unsigned char buf[8];
+    for (int i = 0; i < bytes; ++i)
+        buf[i] = (unsigned char)(v >> (8 * i));
+    fwrite(buf, 1, (size_t)bytes, f);
+}
+
+// paths are stored as the length of the prefix shared with the previous
+// path followed by the rest, like in version 4 of the git index
+void put_path(FILE* f, const char* prev, const char* path)
+{
+    size_t shared = 0;
+    while (prev[shared] && prev[shared] == path[shared] && shared < 0xffff)
+        ++shared;
+
+    size_t rest = strlen(path + shared);
+    put_uint(f, shared, 2);
+    put_uint(f, rest, 2);
+    fwrite(path + shared, 1, rest, f);
+}
+
+size_t get_path(state_reader* r, char** arena, size_t* used, size_t* cap,
+        size_t prev)
+{
+    size_t shared = (size_t)get_uint(r, 2);
+    size_t rest = (size_t)get_uint(r, 2);
+    size_t prev_len = prev == (size_t)-1 ? 0 : strlen(*arena + prev);
+
+    if (!r->ok || shared > prev_len || (size_t)(r->end - r->p) < rest)
+    {
+        r->ok = false;
+        return 0;
+    }
+
+    while (*used + shared + rest + 1 > *cap)
+    {
+        *cap = *cap ? *cap * 2 : 4096;
+        *arena = realloc(*arena, *cap);
+    }
+
+    size_t offset = *used;
+    if (shared > 0)
+        memcpy(*arena + offset, *arena + prev, shared);
+    memcpy(*arena + offset + shared, r->p, rest);
+    (*arena)[offset + shared + rest] = '\0';
+    r->p += rest;
+    *used += shared + rest + 1;
+    return offset;
+}
+
+bool read_whole_file(const char* path, unsigned char** data, size_t* size)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+
+    size_t cap = 1 << 16;
+    *size = 0;
+    *data = malloc(cap);
+
+    size_t n;
+    while ((n = fread(*data + *size, 1, cap - *size, f)) > 0)
+    {
+        *size += n;
+        if (*size == cap)
+        {
+            cap *= 2;
+            *data = realloc(*data, cap);
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+warm_state* state_load(const char* git_dir)
+{
+    char path[2048];
+    unsigned char* data;
+    size_t size;
+
+    repo_gwatch_path(git_dir, STATE_FILE, path, sizeof(path));
+    if (!read_whole_file(path, &data, &size))
+        return NULL;
+
+    state_reader r = { data, data + size, true };
+    warm_state* state = calloc(1, sizeof(warm_state));
+    size_t used = 0;
+    size_t cap = 0;
+    size_t* offsets = NULL;
+
+    if (size < 8 || memcmp(data, STATE_MAGIC, 4) != 0)
+        r.ok = false;
+    r.p += 4;
+    if (get_uint(&r, 4) != STATE_VERSION || (size_t)(r.end - r.p) < GIT_OID_RAWSZ)
+        r.ok = false;
+
+    if (r.ok)
+    {
+        git_oid_fromraw(&state->tree_id, r.p);
+        r.p += GIT_OID_RAWSZ;
+        state->index_size = get_uint(&r, 8);
+        state->index_mtime_sec = (int64_t)get_uint(&r, 8);
+        state->index_mtime_nsec = (uint32_t)get_uint(&r, 4);
+
+        state->dir_count = (size_t)get_uint(&r, 4);
+        if (state->dir_count > size)
+            r.ok = false;
+    }
+
+    if (r.ok)
+    {
+        state->dirs = calloc(state->dir_count + 1, sizeof(warm_dir));
+        offsets = malloc((state->dir_count + 1) * sizeof(size_t));
+        size_t prev = (size_t)-1;
+        for (size_t i = 0; i < state->dir_count && r.ok; ++i)
+        {
+            prev = offsets[i] = get_path(&r, &state->strings, &used, &cap, prev);
+            state->dirs[i].mtime_sec = (int64_t)get_uint(&r, 8);
+            state->dirs[i].mtime_nsec = (uint32_t)get_uint(&r, 4);
+        }
+
+        state->file_count = (size_t)get_uint(&r, 4);
+        if (state->file_count > size)
+            r.ok = false;
+    }
+
+    size_t* file_offsets = NULL;
+    if (r.ok)
+    {
+        state->files = calloc(state->file_count + 1, sizeof(warm_file));
+        file_offsets = malloc((state->file_count + 1) * sizeof(size_t));
+        size_t prev = (size_t)-1;
+        for (size_t i = 0; i < state->file_count && r.ok; ++i)
+        {
+            prev = file_offsets[i] = get_path(&r, &state->strings, &used, &cap, prev);
+            state->files[i].size = (uint32_t)get_uint(&r, 4);
+            state->files[i].mtime_sec = (uint32_t)get_uint(&r, 4);
+            state->files[i].mtime_nsec = (uint32_t)get_uint(&r, 4);
+            state->files[i].ino = (uint32_t)get_uint(&r, 4);
+        }
+    }
+
+    if (r.ok)
+    {
+        // the arena may have moved while growing, pointers are set at the end
+        for (size_t i = 0; i < state->dir_count; ++i)
+            state->dirs[i].path = state->strings + offsets[i];
+        for (size_t i = 0; i < state->file_count; ++i)
+            state->files[i].path = state->strings + file_offsets[i];
+    }
+
+    free(offsets);
+    free(file_offsets);
+    free(data);
+
+    if (!r.ok)
+    {
+        pflog("Ignoring the damaged state file %s", path);
+        state_free(state);
+        return NULL;
+    }
+
+    return state;
+}
+
+void state_free(warm_state* state)
+{
+    if (!state)
+        return;
+
+    free(state->dirs);
+    free(state->files);
+    free(state->strings);
+    free(state);
+}
+
+bool state_has_dir(const warm_state* state, const char* path)
+{
+    size_t lo = 0;
+    size_t hi = state->dir_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(state->dirs[mid].path, path);
+        if (cmp == 0)
+            return true;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+bool state_has_file(const warm_state* state, const char* path)
+{
+    size_t lo = 0;
+    size_t hi = state->file_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(state->files[mid].path, path);
+        if (cmp == 0)
+            return true;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+bool lstat_path(const char* path, uv_stat_t* st)
+{
+    uv_fs_t req;
+    int error = uv_fs_lstat(NULL, &req, path, NULL);
+    if (error == 0)
+        *st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+    return error == 0;
+}
+
+bool state_head_tree(git_oid* out, git_repository* repo)
+{
+    git_reference* head = NULL;
+    git_object* tree = NULL;
+    char ref_name[1024];
+
+    // a private ref that does not exist yet starts from HEAD
+    int error = commit_ref_name(repo, ref_name, sizeof(ref_name)) ?
+        git_reference_lookup(&head, repo, ref_name) : -1;
+    if (error == GIT_ENOTFOUND)
+        error = git_reference_lookup(&head, repo, "HEAD");
+
+    bool ok = error == 0 &&
+        git_reference_peel(&tree, head, GIT_OBJ_TREE) == 0;
+    if (ok)
+        git_oid_cpy(out, git_object_id(tree));
+
+    git_object_free(tree);
+    git_reference_free(head);
+    return ok;
+}
+
+bool index_file_stat(git_repository* repo, uv_stat_t* st)
+{
+    git_index* index = NULL;
+    if (git_repository_index(&index, repo) < 0)
+        return false;
+
+    bool ok = git_index_path(index) && lstat_path(git_index_path(index), st);
+    git_index_free(index);
+    return ok;
+}
+
+bool state_verify(const warm_state* state, git_repository* repo)
+{
+    git_oid tree_id;
+    uv_stat_t st;
+
+    // somebody committed or staged something while gwatch was not running
+    return state_head_tree(&tree_id, repo) &&
+        git_oid_equal(&tree_id, &state->tree_id) &&
+        index_file_stat(repo, &st) &&
+        st.st_size == state->index_size &&
+        st.st_mtim.tv_sec == state->index_mtime_sec &&
+        (uint32_t)st.st_mtim.tv_nsec == state->index_mtime_nsec;
+}
+
+// like the lstat cache of git: paths are sorted, so everything below a
+// directory that is gone follows it and is dirty without a stat of its own
+typedef struct missing_dir
+{
+    char prefix[2048]; // relative, with a trailing slash, "" if none
+    size_t len;
+} missing_dir;
+
+void find_missing_dir(missing_dir* md, const char* repo_path, const char* rel)
+{
+    char path[2048];
+    uv_stat_t st;
+    const char* slash = strchr(rel, '/');
+
+    md->len = 0;
+    md->prefix[0] = '\0';
+
+    // the topmost directory that does not exist
+    while (slash && (size_t)(slash - rel) + 1 < sizeof(md->prefix))
+    {
+        snprintf(path, sizeof(path), "%s/%.*s", repo_path,
+                (int)(slash - rel), rel);
+        if (!lstat_path(path, &st))
+        {
+            md->len = (size_t)(slash - rel) + 1;
+            memcpy(md->prefix, rel, md->len);
+            md->prefix[md->len] = '\0';
+            return;
+        }
+        slash = strchr(slash + 1, '/');
+    }
+}
+
+bool file_changed(missing_dir* md, const char* repo_path, const char* rel,
+        uint32_t size, uint32_t mtime_sec, uint32_t mtime_nsec, uint32_t ino)
+{
+    char path[2048];
+    uv_stat_t st;
+
+    if (md->len > 0 && strncmp(rel, md->prefix, md->len) == 0)
+        return true;
+
+    snprintf(path, sizeof(path), "%s/%s", repo_path, rel);
+    if (!lstat_path(path, &st))
+    {
+        find_missing_dir(md, repo_path, rel);
+        return true;
+    }
+
+    return (uint32_t)st.st_size != size ||
+        (uint32_t)st.st_mtim.tv_sec != mtime_sec ||
+        (uint32_t)st.st_mtim.tv_nsec != mtime_nsec ||
+        (uint32_t)st.st_ino != ino;
+}
+
+// assumed unchanged or outside of a sparse checkout, git does not look at
+// these in the working tree either
+bool index_entry_skipped(const git_index_entry* e)
+{
+    return (e->flags & GIT_IDXENTRY_VALID) ||
+        (e->flags_extended & GIT_IDXENTRY_SKIP_WORKTREE);
+}
+
+// every recorded file is checked, not only those in directories with a
+// changed mtime: writing a file in place leaves its directory alone
+void state_collect_changes(const warm_state* state, const char* repo_path,
+        path_map* dirty)
+{
+    missing_dir md = { "", 0 };
+    for (size_t i = 0; i < state->file_count && dirty->count <= DIRTY_SET_LIMIT; ++i)
+    {
+        const warm_file* f = &state->files[i];
+        if (file_changed(&md, repo_path, f->path, f->size, f->mtime_sec,
+                    f->mtime_nsec, f->ino))
+            path_map_add(dirty, f->path, NULL);
+    }
+}
+
+int compare_dirs(const void* a, const void* b)
+{
+    return strcmp(((const warm_dir*)a)->path, ((const warm_dir*)b)->path);
+}
+
+bool state_save(git_repository* repo, const char* git_dir,
+        warm_dir* dirs, size_t dir_count)
+{
+    git_oid tree_id;
+    git_index* index = NULL;
+    uv_stat_t index_st;
+    char path[2048];
+    char tmp_path[2048];
+
+    if (dir_count == 0 || !state_head_tree(&tree_id, repo) ||
+            git_repository_index(&index, repo) < 0)
+        return false;
+
+    if (git_index_read(index, false) < 0 || !index_file_stat(repo, &index_st) ||
+            !repo_make_gwatch_dir(git_dir))
+    {
+        git_index_free(index);
+        return false;
+    }
+
+    repo_gwatch_path(git_dir, STATE_TMP_FILE, tmp_path, sizeof(tmp_path));
+    repo_gwatch_path(git_dir, STATE_FILE, path, sizeof(path));
+
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f)
+    {
+        git_index_free(index);
+        return false;
+    }
+
+    qsort(dirs, dir_count, sizeof(warm_dir), compare_dirs);
+
+    fwrite(STATE_MAGIC, 1, 4, f);
+    put_uint(f, STATE_VERSION, 4);
+    fwrite(tree_id.id, 1, GIT_OID_RAWSZ, f);
+    put_uint(f, index_st.st_size, 8);
+    put_uint(f, (uint64_t)index_st.st_mtim.tv_sec, 8);
+    put_uint(f, (uint64_t)index_st.st_mtim.tv_nsec, 4);
+
+    put_uint(f, dir_count, 4);
+    const char* prev = "";
+    for (size_t i = 0; i < dir_count; ++i)
+    {
+        put_path(f, prev, dirs[i].path);
+        put_uint(f, (uint64_t)dirs[i].mtime_sec, 8);
+        put_uint(f, dirs[i].mtime_nsec, 4);
+        prev = dirs[i].path;
+    }
+
+    size_t entry_count = git_index_entrycount(index);
+    size_t file_count = 0;
+    for (size_t i = 0; i < entry_count; ++i)
+        file_count += !index_entry_skipped(git_index_get_byindex(index, i));
+
+    put_uint(f, file_count, 4);
+    prev = "";
+    for (size_t i = 0; i < entry_count; ++i)
+    {
+        const git_index_entry* entry = git_index_get_byindex(index, i);
+        if (index_entry_skipped(entry))
+            continue;
+        put_path(f, prev, entry->path);
+        put_uint(f, entry->file_size, 4);
+        put_uint(f, (uint32_t)entry->mtime.seconds, 4);
+        put_uint(f, entry->mtime.nanoseconds, 4);
+        put_uint(f, entry->ino, 4);
+        prev = entry->path;
+    }
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+    git_index_free(index);
+
+    uv_fs_t req;
+    ok = ok && uv_fs_rename(NULL, &req, tmp_path, path, NULL) == 0;
+    uv_fs_req_cleanup(&req);
+    return ok;
+}
+
+void state_free_dirs(warm_dir* dirs, size_t dir_count)
+{
+    for (size_t i = 0; i < dir_count; ++i)
+        free(dirs[i].path);
+    free(dirs);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "path_map.h"
+
+#include <git2.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATE_SAVE_INTERVAL 60000 // ms, between saves after commits
+
+typedef struct warm_dir
+{
+    char* path; // relative to the repository root, "" for the root itself
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+} warm_dir;
+
+// stat data as stored in the index, truncated to 32 bits the same way
+typedef struct warm_file
+{
+    char* path;
+    uint32_t size;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ino;
+} warm_file;
+
+typedef struct warm_state
+{
+    git_oid tree_id;
+    uint64_t index_size;
+    int64_t index_mtime_sec;
+    uint32_t index_mtime_nsec;
+
+    // both sorted by path
+    warm_dir* dirs;
+    size_t dir_count;
+    warm_file* files;
+    size_t file_count;
+
+    char* strings; // backing storage of all paths
+} warm_state;
+
+warm_state* state_load(const char* git_dir);
+void state_free(warm_state* state);
+bool state_has_dir(const warm_state* state, const char* path);
+bool state_has_file(const warm_state* state, const char* path);
+bool state_head_tree(git_oid* out, git_repository* repo);
+bool state_verify(const warm_state* state, git_repository* repo);
+void state_collect_changes(const warm_state* state, const char* repo_path,
+        path_map* dirty);
+bool state_save(git_repository* repo, const char* git_dir,
+        warm_dir* dirs, size_t dir_count);
+void state_free_dirs(warm_dir* dirs, size_t dir_count);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool thread_set_cpu_priority(int priority);
+bool thread_set_io_idle();
+void thread_sleep(unsigned int ms);
+uint64_t thread_cpu_time(); // ns of CPU used by the calling thread
+unsigned long thread_id();
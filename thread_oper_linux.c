@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+
+#include "thread_oper.h"
+#include "args.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+bool thread_set_cpu_priority(int priority)
+{
+    if (priority == CPU_PRIORITY_IDLE)
+    {
+        struct sched_param param = { 0 };
+        return pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) == 0;
+    }
+
+    // on Linux the nice value is a per-thread attribute
+    id_t tid = (id_t)syscall(SYS_gettid);
+    return setpriority(PRIO_PROCESS, tid, priority) == 0;
+}
+
+bool thread_set_io_idle()
+{
+    long tid = syscall(SYS_gettid);
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+            IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0;
+}
+
+void thread_sleep(unsigned int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+uint64_t thread_cpu_time()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) < 0)
+        return 0;
+
+    return ((uint64_t)usage.ru_utime.tv_sec + (uint64_t)usage.ru_stime.tv_sec)
+        * 1000000000ULL + ((uint64_t)usage.ru_utime.tv_usec +
+        (uint64_t)usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+unsigned long thread_id()
+{
+    return (unsigned long)syscall(SYS_gettid);
+}
@@ -0,0 +1,48 @@
+#include "thread_oper.h"
+#include "args.h"
+
+#include <windows.h>
+
+bool thread_set_cpu_priority(int priority)
+{
+    int win_priority = THREAD_PRIORITY_NORMAL;
+
+    if (priority == CPU_PRIORITY_IDLE)
+        win_priority = THREAD_PRIORITY_IDLE;
+    else if (priority >= 15)
+        win_priority = THREAD_PRIORITY_LOWEST;
+    else if (priority > 0)
+        win_priority = THREAD_PRIORITY_BELOW_NORMAL;
+
+    return SetThreadPriority(GetCurrentThread(), win_priority) != 0;
+}
+
+bool thread_set_io_idle()
+{
+    // background mode lowers both the IO and the memory priority, and also
+    // resets the CPU priority, which has to be set after it
+    return SetThreadPriority(GetCurrentThread(),
+            THREAD_MODE_BACKGROUND_BEGIN) != 0;
+}
+
+void thread_sleep(unsigned int ms)
+{
+    Sleep(ms);
+}
+
+uint64_t thread_cpu_time()
+{
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+
+    // FILETIME counts 100ns intervals
+    uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (k + u) * 100;
+}
+
+unsigned long thread_id()
+{
+    return GetCurrentThreadId();
+}
@@ -0,0 +1,94 @@
+#include "trace.h"
+#include "logs.h"
+#include "thread_oper.h"
+
+#include <uv.h>
+
+#include <stdio.h>
+
+FILE* trace_file = NULL;
+uint64_t trace_origin; // ns
+uv_mutex_t trace_mutex;
+
+void trace_write_string(const char* str)
+{
+    fputc('"', trace_file);
+    for (const unsigned char* it = (const unsigned char*)str; *it; ++it)
+    {
+        if (*it == '"' || *it == '\\')
+            fprintf(trace_file, "\\%c", *it);
+        else if (*it < 0x20)
+            fprintf(trace_file, "\\u%04x", *it);
+        else
+            fputc(*it, trace_file);
+    }
+    fputc('"', trace_file);
+}
+
+bool trace_start(const char* path)
+{
+    trace_file = fopen(path, "w");
+    if (!trace_file)
+    {
+        pflog("Cannot open the trace file %s", path);
+        return false;
+    }
+
+    uv_mutex_init(&trace_mutex);
+    trace_origin = uv_hrtime();
+
+    // the closing bracket is optional in this format, a trace cut short by
+    // a crash still loads
+    fputs("[\n", trace_file);
+    pflog("Writing commit traces to %s", path);
+    return true;
+}
+
+bool trace_enabled()
+{
+    return trace_file != NULL;
+}
+
+void trace_span(const char* name, const char* repo, const char* path,
+        uint64_t start, uint64_t duration, uint64_t cpu, const char* args)
+{
+    if (!trace_file)
+        return;
+
+    uv_mutex_lock(&trace_mutex);
+    fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"commit\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%lu,"
+            "\"args\":{\"repo\":", name, (double)(start - trace_origin) / 1e3,
+            (double)duration / 1e3, thread_id());
+    trace_write_string(repo);
+    if (path)
+    {
+        fputs(",\"path\":", trace_file);
+        trace_write_string(path);
+    }
+    fprintf(trace_file, ",\"cpu_ms\":%.3f%s%s}},\n", (double)cpu / 1e6,
+            args ? "," : "", args ? args : "");
+    uv_mutex_unlock(&trace_mutex);
+}
+
+void trace_flush()
+{
+    if (!trace_file)
+        return;
+
+    uv_mutex_lock(&trace_mutex);
+    fflush(trace_file);
+    uv_mutex_unlock(&trace_mutex);
+}
+
+void trace_stop()
+{
+    if (!trace_file)
+        return;
+
+    fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"gwatch\"}}\n]\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+    uv_mutex_destroy(&trace_mutex);
+}
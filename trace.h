@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// spans in the Chrome trace event format, loadable by chrome://tracing and
+// Perfetto; start is a uv_hrtime value, path is optional and args is the
+// inside of a JSON object or NULL
+bool trace_start(const char* path);
+bool trace_enabled();
+void trace_span(const char* name, const char* repo, const char* path,
+        uint64_t start, uint64_t duration, uint64_t cpu, const char* args);
+void trace_flush();
+void trace_stop();